@@ -132,6 +132,10 @@ int main(int argc, char **argv)
 	osc_server_add_method(s, "/Fader2/x", moodlamp_set, &ms_g);
 	osc_server_add_method(s, "/Fader3/x", moodlamp_set, &ms_b);
 
+	/* Writing to the lamp is slow, so receive in a thread of its own */
+	if (osc_server_start_pipeline(s, 256 * 1024, -1))
+		fprintf(stderr, "Could not start receive thread.\n");
+
 	osc_server_run(s);
 	return 1;
 }
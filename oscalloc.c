@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "oscalloc.h"
+
+static void *osc_libc_alloc(void *ctx, size_t size)
+{
+	(void)ctx;
+	return malloc(size);
+}
+
+static void *osc_libc_realloc(void *ctx, void *ptr, size_t size)
+{
+	(void)ctx;
+	return realloc(ptr, size);
+}
+
+static void osc_libc_free(void *ctx, void *ptr)
+{
+	(void)ctx;
+	free(ptr);
+}
+
+static const struct osc_allocator osc_allocator_libc = {
+	.alloc = osc_libc_alloc,
+	.realloc = osc_libc_realloc,
+	.free = osc_libc_free,
+};
+
+static const struct osc_allocator *osc_allocator_global = &osc_allocator_libc;
+static __thread const struct osc_allocator *osc_allocator_thread;
+
+static struct osc_alloc_stats osc_alloc_stats;
+
+/* Use a for all allocations not made for an object with an allocator
+ * of its own, NULL returns to malloc and free. Memory has to be freed
+ * by the allocator it came from, so this is to be set before anything
+ * else is done with the library. */
+void osc_set_allocator(const struct osc_allocator *a)
+{
+	osc_allocator_global = a ? a : &osc_allocator_libc;
+}
+
+/* Use a for allocations of the calling thread instead of the global
+ * allocator, NULL returns to the global one. Objects remember the
+ * allocator in use when they were created and use it for everything
+ * they allocate later on, on any thread. So does what they dispatch,
+ * like the elements passed to methods. Returns the allocator the
+ * thread used before. */
+const struct osc_allocator *osc_use_allocator(const struct osc_allocator *a)
+{
+	const struct osc_allocator *prev = osc_allocator_thread;
+
+	osc_allocator_thread = a;
+	return prev;
+}
+
+void osc_allocator_leave(const struct osc_allocator **prev)
+{
+	osc_allocator_thread = *prev;
+}
+
+const struct osc_allocator *osc_allocator_current(void)
+{
+	return osc_allocator_thread ? osc_allocator_thread : osc_allocator_global;
+}
+
+/* Counted over all threads and allocators, e.g. to check that a steady
+ * stream of packets is processed without allocating */
+void osc_get_alloc_stats(struct osc_alloc_stats *stats)
+{
+	stats->allocs = __atomic_load_n(&osc_alloc_stats.allocs, __ATOMIC_RELAXED);
+	stats->frees = __atomic_load_n(&osc_alloc_stats.frees, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&osc_alloc_stats.bytes, __ATOMIC_RELAXED);
+}
+
+static void osc_alloc_count(size_t size)
+{
+	__atomic_fetch_add(&osc_alloc_stats.allocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&osc_alloc_stats.bytes, size, __ATOMIC_RELAXED);
+}
+
+void *osc_mem_alloc(size_t size)
+{
+	const struct osc_allocator *a = osc_allocator_current();
+	void *rv = a->alloc(a->ctx, size);
+
+	if (rv)
+		osc_alloc_count(size);
+	return rv;
+}
+
+void *osc_mem_calloc(size_t count, size_t size)
+{
+	if (size && count > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	void *rv = osc_mem_alloc(count * size);
+	if (rv)
+		memset(rv, 0, count * size);
+	return rv;
+}
+
+void *osc_mem_realloc(void *ptr, size_t size)
+{
+	const struct osc_allocator *a = osc_allocator_current();
+	void *rv = a->realloc(a->ctx, ptr, size);
+
+	if (rv) {
+		osc_alloc_count(size);
+		if (ptr)
+			__atomic_fetch_add(&osc_alloc_stats.frees, 1, __ATOMIC_RELAXED);
+	}
+	return rv;
+}
+
+/* Memory aligned to align, a power of two, which has to be freed with
+ * osc_mem_free_aligned. The pointer to the allocation is kept in front
+ * of it. */
+void *osc_mem_alloc_aligned(size_t align, size_t size)
+{
+	if (align < sizeof(void*))
+		align = sizeof(void*);
+
+	unsigned char *base = osc_mem_alloc(size + align + sizeof(void*));
+	if (!base)
+		return NULL;
+
+	uintptr_t rv = ((uintptr_t)base + sizeof(void*) + align - 1)
+	               & ~(uintptr_t)(align - 1);
+	memcpy((void*)(rv - sizeof(void*)), &base, sizeof(base));
+	return (void*)rv;
+}
+
+char *osc_mem_strdup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *rv = osc_mem_alloc(len);
+
+	if (rv)
+		memcpy(rv, s, len);
+	return rv;
+}
+
+void osc_mem_free(void *ptr)
+{
+	const struct osc_allocator *a;
+
+	if (!ptr)
+		return;
+
+	a = osc_allocator_current();
+	a->free(a->ctx, ptr);
+	__atomic_fetch_add(&osc_alloc_stats.frees, 1, __ATOMIC_RELAXED);
+}
+
+void osc_mem_free_aligned(void *ptr)
+{
+	void *base;
+
+	if (!ptr)
+		return;
+
+	memcpy(&base, (unsigned char*)ptr - sizeof(void*), sizeof(base));
+	osc_mem_free(base);
+}
+
+/* Free memory handed out by the library, like the log of
+ * osc_parse_packet or the tokens of osc_addr_split, with the allocator
+ * of the calling thread */
+void osc_dealloc(void *ptr)
+{
+	osc_mem_free(ptr);
+}
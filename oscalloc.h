@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef OSCALLOC_H
+#define OSCALLOC_H
+
+/* Memory allocation functions used for all memory the library
+ * allocates, each getting ctx as first argument */
+struct osc_allocator {
+	void *(*alloc)(void *ctx, size_t size);
+	void *(*realloc)(void *ctx, void *ptr, size_t size);
+	void (*free)(void *ctx, void *ptr);
+	void *ctx;
+};
+
+/* Allocations and frees done through any allocator, and the bytes
+ * allocated in total */
+struct osc_alloc_stats {
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t bytes;
+};
+
+void osc_set_allocator(const struct osc_allocator *a);
+const struct osc_allocator *osc_use_allocator(const struct osc_allocator *a);
+void osc_get_alloc_stats(struct osc_alloc_stats *stats);
+void osc_dealloc(void *ptr);
+
+const struct osc_allocator *osc_allocator_current(void);
+void osc_allocator_leave(const struct osc_allocator **prev);
+
+/* Makes a the allocator of the calling thread until the end of the
+ * enclosing block */
+#define OSC_ALLOCATOR_SCOPE(a) \
+	const struct osc_allocator *osc_allocator_prev \
+		__attribute__((cleanup(osc_allocator_leave), unused)) \
+		= osc_use_allocator(a)
+
+void *osc_mem_alloc(size_t size);
+void *osc_mem_calloc(size_t count, size_t size);
+void *osc_mem_realloc(void *ptr, size_t size);
+void *osc_mem_alloc_aligned(size_t align, size_t size);
+char *osc_mem_strdup(const char *s);
+void osc_mem_free(void *ptr);
+void osc_mem_free_aligned(void *ptr);
+
+#endif
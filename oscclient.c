@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "oscclient.h"
+#include "oscalloc.h"
+#include "oscutils.h"
+
+/* "#bundle" followed by the timetag which means "immediately" */
+static const unsigned char osc_bundle_header[16] = {
+	'#', 'b', 'u', 'n', 'd', 'l', 'e', '\0',
+	0, 0, 0, 0, 0, 0, 0, 1
+};
+
+#define OSC_BUNDLE_HEADER_LEN sizeof(osc_bundle_header)
+
+/* Maximum number of datagrams held back by pacing */
+#define OSC_CLIENT_QUEUE_MAX 1024
+
+struct osc_datagram {
+	struct osc_datagram *next;
+	size_t len;
+	unsigned char data[];
+};
+
+struct osc_client {
+	int fd;
+	int level;
+
+	/* Coalescing of packets into bundles, disabled if mtu is 0 */
+	size_t mtu;
+	uint64_t deadline_ns;
+	unsigned char *bundle;
+	size_t bundle_len;
+	size_t bundle_count;
+	uint64_t bundle_due;
+
+	/* Pacing as a token bucket in its GCRA form, disabled if
+	 * interval_ns is 0. A datagram may be sent when the current time
+	 * is not more than burst_ns before the theoretical arrival time. */
+	uint64_t interval_ns;
+	uint64_t burst_ns;
+	uint64_t tat;
+	struct osc_datagram *queue;
+	struct osc_datagram **queue_endp;
+	size_t queue_len;
+
+	const struct osc_allocator *allocator;
+};
+
+/* Protocol level for options concerning the destination, IPv4 mapped
+ * destinations on IPv6 sockets are handled by the IPv4 layer. */
+static int osc_client_level(int fd)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+
+	if (getpeername(fd, (struct sockaddr*)&ss, &len) || ss.ss_family != AF_INET6)
+		return IPPROTO_IP;
+
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&ss;
+	if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+		return IPPROTO_IP;
+
+	return IPPROTO_IPV6;
+}
+
+struct osc_client *osc_client_new(const char *node, const char *service,
+                                  const struct addrinfo *hints)
+{
+	struct addrinfo ai = {
+		.ai_flags = AI_V4MAPPED | AI_ADDRCONFIG,
+		.ai_family = AF_UNSPEC,
+	};
+
+	if (hints)
+		memcpy(&ai, hints, sizeof(ai));
+
+	ai.ai_socktype = SOCK_DGRAM;
+
+	struct addrinfo *res, *rp;
+	if (getaddrinfo(node, service, &ai, &res))
+		return NULL;
+
+	int fd;
+	for (rp = res; rp; rp = rp->ai_next) {
+		fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+
+		if (fd < 0)
+			continue;
+
+		if (connect(fd, rp->ai_addr, rp->ai_addrlen) != 0) {
+			close(fd);
+			continue;
+		}
+
+		break;
+	}
+
+	freeaddrinfo(res);
+
+	if (!rp)
+		return NULL;
+
+	struct osc_client *rv = osc_mem_calloc(sizeof(*rv), 1);
+
+	rv->allocator = osc_allocator_current();
+	rv->fd = fd;
+	rv->level = osc_client_level(fd);
+	rv->queue_endp = &rv->queue;
+	return rv;
+}
+
+/* Connect to a Unix domain socket of the SOCK_DGRAM or SOCK_SEQPACKET
+ * type, see osc_server_add_unix_listener. */
+struct osc_client *osc_client_new_unix(const char *path, int type)
+{
+	struct sockaddr_un sun;
+	socklen_t len = osc_unix_addr(&sun, path);
+
+	if (!len)
+		return NULL;
+
+	int fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (connect(fd, (struct sockaddr*)&sun, len)) {
+		close(fd);
+		return NULL;
+	}
+
+	struct osc_client *rv = osc_mem_calloc(sizeof(*rv), 1);
+
+	rv->allocator = osc_allocator_current();
+	rv->fd = fd;
+	rv->level = osc_client_level(fd);
+	rv->queue_endp = &rv->queue;
+	return rv;
+}
+
+void osc_client_free(struct osc_client *client)
+{
+	if (!client)
+		return;
+
+	OSC_ALLOCATOR_SCOPE(client->allocator);
+
+	while (client->queue) {
+		struct osc_datagram *d = client->queue;
+		client->queue = d->next;
+		osc_mem_free(d);
+	}
+
+	close(client->fd);
+	osc_mem_free(client->bundle);
+	osc_mem_free(client);
+}
+
+/* Configure hop limit, loopback and outgoing interface for a client
+ * whose destination is a multicast group. ifname may be NULL to leave
+ * the choice of interface to the routing table. */
+int osc_client_set_multicast(struct osc_client *client, int ttl, bool loop,
+                             const char *ifname)
+{
+	int ifindex = 0;
+	int on = loop;
+
+	if (ifname) {
+		ifindex = if_nametoindex(ifname);
+		if (!ifindex)
+			return -1;
+	}
+
+	if (client->level == IPPROTO_IPV6) {
+		if (setsockopt(client->fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+		               &ttl, sizeof(ttl))
+		    || setsockopt(client->fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP,
+		                  &on, sizeof(on))
+		    || setsockopt(client->fd, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+		                  &ifindex, sizeof(ifindex)))
+			return -1;
+		return 0;
+	}
+
+	struct ip_mreqn mreq = {
+		.imr_ifindex = ifindex
+	};
+
+	if (setsockopt(client->fd, IPPROTO_IP, IP_MULTICAST_TTL,
+	               &ttl, sizeof(ttl))
+	    || setsockopt(client->fd, IPPROTO_IP, IP_MULTICAST_LOOP,
+	                  &on, sizeof(on))
+	    || setsockopt(client->fd, IPPROTO_IP, IP_MULTICAST_IF,
+	                  &mreq, sizeof(mreq)))
+		return -1;
+
+	return 0;
+}
+
+/* Enable coalescing of sent packets into bundles of at most mtu bytes.
+ * A pending bundle is sent at the latest deadline_us after its first
+ * element was queued, or only when full/flushed if deadline_us is 0.
+ * Setting mtu to 0 disables coalescing. */
+int osc_client_set_bundling(struct osc_client *client, size_t mtu,
+                            unsigned long deadline_us)
+{
+	OSC_ALLOCATOR_SCOPE(client->allocator);
+
+	if (mtu && mtu < OSC_BUNDLE_HEADER_LEN + 8) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (osc_client_flush(client))
+		return -1;
+
+	unsigned char *bundle = NULL;
+	if (mtu) {
+		bundle = osc_mem_realloc(client->bundle, mtu);
+		if (!bundle)
+			return -1;
+	} else {
+		osc_mem_free(client->bundle);
+	}
+
+	client->bundle = bundle;
+	client->mtu = mtu;
+	client->deadline_ns = (uint64_t)deadline_us * 1000;
+	return 0;
+}
+
+/* Limit the rate at which datagrams are sent to rate per second, with
+ * up to burst datagrams sent back to back. Datagrams exceeding the rate
+ * are queued and sent by osc_client_run. A rate of 0 disables pacing. */
+int osc_client_set_pacing(struct osc_client *client, unsigned rate,
+                          unsigned burst)
+{
+	if (rate && !burst) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	client->interval_ns = rate ? 1000000000ULL / rate : 0;
+	client->burst_ns = rate ? (burst - 1) * client->interval_ns : 0;
+	client->tat = 0;
+	return osc_client_run(client);
+}
+
+static bool osc_client_conforms(struct osc_client *client, uint64_t now)
+{
+	return now + client->burst_ns >= client->tat;
+}
+
+static int osc_client_transmit_now(struct osc_client *client,
+                                   const void *data, size_t len, uint64_t now)
+{
+	if (client->interval_ns) {
+		if (client->tat < now)
+			client->tat = now;
+		client->tat += client->interval_ns;
+	}
+
+	while (send(client->fd, data, len, 0) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int osc_client_transmit(struct osc_client *client,
+                               const void *data, size_t len)
+{
+	OSC_ALLOCATOR_SCOPE(client->allocator);
+
+	uint64_t now = client->interval_ns ? osc_time_ns() : 0;
+
+	if (!client->queue && osc_client_conforms(client, now))
+		return osc_client_transmit_now(client, data, len, now);
+
+	if (client->queue_len >= OSC_CLIENT_QUEUE_MAX) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	struct osc_datagram *d = osc_mem_alloc(sizeof(*d) + len);
+	if (!d)
+		return -1;
+
+	d->next = NULL;
+	d->len = len;
+	memcpy(d->data, data, len);
+
+	*client->queue_endp = d;
+	client->queue_endp = &d->next;
+	client->queue_len++;
+	return 0;
+}
+
+int osc_client_flush(struct osc_client *client)
+{
+	if (!client->bundle_count)
+		return 0;
+
+	const unsigned char *data = client->bundle;
+	size_t len = client->bundle_len;
+
+	/* A bundle with a single element is sent as just that element */
+	if (client->bundle_count == 1) {
+		data += OSC_BUNDLE_HEADER_LEN + 4;
+		len -= OSC_BUNDLE_HEADER_LEN + 4;
+	}
+
+	client->bundle_len = 0;
+	client->bundle_count = 0;
+	return osc_client_transmit(client, data, len);
+}
+
+int osc_client_send(struct osc_client *client, const void *data, size_t len)
+{
+	if (osc_client_run(client))
+		return -1;
+
+	if (!client->mtu)
+		return osc_client_transmit(client, data, len);
+
+	/* Packets which don't fit into a bundle are sent on their own,
+	 * after everything that has been queued before them. */
+	if (len % 4 || OSC_BUNDLE_HEADER_LEN + 4 + len > client->mtu) {
+		if (osc_client_flush(client))
+			return -1;
+		return osc_client_transmit(client, data, len);
+	}
+
+	if (client->bundle_len + 4 + len > client->mtu) {
+		if (osc_client_flush(client))
+			return -1;
+	}
+
+	if (!client->bundle_count) {
+		memcpy(client->bundle, osc_bundle_header, OSC_BUNDLE_HEADER_LEN);
+		client->bundle_len = OSC_BUNDLE_HEADER_LEN;
+		client->bundle_due = osc_time_ns() + client->deadline_ns;
+	}
+
+	uint32_t size = htonl(len);
+	memcpy(client->bundle + client->bundle_len, &size, 4);
+	memcpy(client->bundle + client->bundle_len + 4, data, len);
+	client->bundle_len += 4 + len;
+	client->bundle_count++;
+
+	/* No room left for even the smallest message */
+	if (client->bundle_len + 8 > client->mtu)
+		return osc_client_flush(client);
+
+	return 0;
+}
+
+/* Sends queued datagrams as far as pacing allows and the pending bundle
+ * if its deadline has passed. Meant to be called when
+ * osc_client_timeout has elapsed. While datagrams are held back by
+ * pacing, the pending bundle stays open to collect further packets. */
+int osc_client_run(struct osc_client *client)
+{
+	OSC_ALLOCATOR_SCOPE(client->allocator);
+
+	uint64_t now = osc_time_ns();
+	int rv = 0;
+
+	while (client->queue && osc_client_conforms(client, now)) {
+		struct osc_datagram *d = client->queue;
+
+		if (osc_client_transmit_now(client, d->data, d->len, now))
+			rv = -1;
+
+		client->queue = d->next;
+		if (!client->queue)
+			client->queue_endp = &client->queue;
+		client->queue_len--;
+		osc_mem_free(d);
+	}
+
+	if (rv)
+		return rv;
+
+	if (!client->queue && client->bundle_count && client->deadline_ns
+	    && now >= client->bundle_due)
+		return osc_client_flush(client);
+
+	return 0;
+}
+
+/* Microseconds until osc_client_run needs to be called, -1 if never */
+long osc_client_timeout(struct osc_client *client)
+{
+	uint64_t due;
+
+	if (client->queue)
+		due = client->tat - client->burst_ns;
+	else if (client->bundle_count && client->deadline_ns)
+		due = client->bundle_due;
+	else
+		return -1;
+
+	uint64_t now = osc_time_ns();
+	if (now >= due)
+		return 0;
+
+	return (due - now + 999) / 1000;
+}
+
+int osc_client_fd(struct osc_client *client)
+{
+	return client->fd;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef OSCCLIENT_H
+#define OSCCLIENT_H
+
+struct osc_client;
+
+struct osc_client *osc_client_new(const char *node, const char *service,
+                                  const struct addrinfo *hints);
+struct osc_client *osc_client_new_unix(const char *path, int type);
+void osc_client_free(struct osc_client *client);
+int osc_client_set_multicast(struct osc_client *client, int ttl, bool loop,
+                             const char *ifname);
+int osc_client_set_bundling(struct osc_client *client, size_t mtu,
+                            unsigned long deadline_us);
+int osc_client_set_pacing(struct osc_client *client, unsigned rate,
+                          unsigned burst);
+int osc_client_send(struct osc_client *client, const void *data, size_t len);
+int osc_client_flush(struct osc_client *client);
+int osc_client_run(struct osc_client *client);
+long osc_client_timeout(struct osc_client *client);
+int osc_client_fd(struct osc_client *client);
+
+#endif
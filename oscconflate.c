@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "oscconflate.h"
+#include "oscalloc.h"
+#include "oscutils.h"
+
+#define OSC_CONFLATE_BUCKETS 256
+#define OSC_CONFLATE_POOL_MAX 64
+#define OSC_CONFLATE_SIZE_MIN 64
+
+/* Packets queued in order of arrival, except that a message to an
+ * address marked as conflatable takes the place of a queued one to the
+ * same address. Only the latest value of such an address is
+ * dispatched, at the position where its first one was queued. */
+struct osc_conflate {
+	char **addresses;
+	unsigned address_count;
+
+	struct osc_conflate_packet *queue;
+	struct osc_conflate_packet **queue_endp;
+	size_t queued;
+
+	struct osc_conflate_packet *buckets[OSC_CONFLATE_BUCKETS];
+
+	/* Released packets, with their buffers, for reuse */
+	struct osc_conflate_packet *pool;
+	unsigned pool_count;
+};
+
+struct osc_conflate *osc_conflate_new(void)
+{
+	struct osc_conflate *rv = osc_mem_calloc(sizeof(*rv), 1);
+	if (!rv)
+		return NULL;
+
+	rv->queue_endp = &rv->queue;
+	return rv;
+}
+
+static void osc_conflate_packet_free(struct osc_conflate_packet *p)
+{
+	osc_mem_free(p->data);
+	osc_mem_free(p);
+}
+
+void osc_conflate_free(struct osc_conflate *c)
+{
+	if (!c)
+		return;
+
+	while (c->queue) {
+		struct osc_conflate_packet *next = c->queue->next;
+
+		osc_conflate_packet_free(c->queue);
+		c->queue = next;
+	}
+
+	while (c->pool) {
+		struct osc_conflate_packet *next = c->pool->next;
+
+		osc_conflate_packet_free(c->pool);
+		c->pool = next;
+	}
+
+	for (unsigned i = 0; i < c->address_count; i++)
+		osc_mem_free(c->addresses[i]);
+	osc_mem_free(c->addresses);
+	osc_mem_free(c);
+}
+
+/* Conflate messages to address, or to any address below it if it ends
+ * with a slash. Messages to different addresses below it are kept
+ * apart. */
+int osc_conflate_add_address(struct osc_conflate *c, const char *address)
+{
+	if (address[0] != '/') {
+		errno = EINVAL;
+		return -1;
+	}
+
+	char **addresses = osc_mem_realloc(c->addresses,
+	                           (c->address_count + 1) * sizeof(*addresses));
+	if (!addresses)
+		return -1;
+	c->addresses = addresses;
+
+	addresses[c->address_count] = osc_mem_strdup(address);
+	if (!addresses[c->address_count])
+		return -1;
+	c->address_count++;
+	return 0;
+}
+
+/* Length of the address a message starts with, 0 if there is none */
+static size_t osc_conflate_address_len(const unsigned char *data, size_t len)
+{
+	if (!len || data[0] != '/')
+		return 0;
+
+	const unsigned char *end = memchr(data, '\0', len);
+	return end ? (size_t)(end - data) : 0;
+}
+
+static uint32_t osc_conflate_hash(const unsigned char *address, size_t len)
+{
+	uint32_t hash = 2166136261U;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= address[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static struct osc_conflate_packet **osc_conflate_find(struct osc_conflate *c,
+                                                      uint32_t hash,
+                                                      const unsigned char *data,
+                                                      size_t address_len)
+{
+	struct osc_conflate_packet **pp = &c->buckets[hash % OSC_CONFLATE_BUCKETS];
+
+	for (; *pp; pp = &(*pp)->hash_next) {
+		struct osc_conflate_packet *p = *pp;
+
+		if (p->hash == hash && p->len > address_len
+		    && !memcmp(p->data, data, address_len + 1))
+			break;
+	}
+
+	return pp;
+}
+
+static int osc_conflate_fill(struct osc_conflate_packet *p,
+                             const struct sockaddr *src_addr,
+                             const struct ucred *cred, const void *data,
+                             size_t len, uint64_t rx_timestamp)
+{
+	if (len > p->size) {
+		size_t size = p->size ? p->size : OSC_CONFLATE_SIZE_MIN;
+		while (size < len)
+			size *= 2;
+
+		unsigned char *buf = osc_mem_realloc(p->data, size);
+		if (!buf)
+			return -1;
+		p->data = buf;
+		p->size = size;
+	}
+
+	memcpy(p->data, data, len);
+	p->len = len;
+	p->rx_timestamp = rx_timestamp;
+
+	p->src_addr = NULL;
+	if (src_addr) {
+		socklen_t addr_len = sizeof(src_addr->sa_family);
+
+		if (src_addr->sa_family == AF_INET)
+			addr_len = sizeof(struct sockaddr_in);
+		else if (src_addr->sa_family == AF_INET6)
+			addr_len = sizeof(struct sockaddr_in6);
+		else if (src_addr->sa_family == AF_UNIX)
+			addr_len = sizeof(struct sockaddr_un);
+		memcpy(&p->addr, src_addr, addr_len);
+		p->src_addr = (struct sockaddr*)&p->addr;
+	}
+
+	p->cred = NULL;
+	if (cred) {
+		p->cred_buf = *cred;
+		p->cred = &p->cred_buf;
+	}
+
+	return 0;
+}
+
+/* Queue a copy of a packet. Returns 1 if it replaced a queued message
+ * to the same conflatable address, 0 if it was queued at the end. */
+int osc_conflate_enqueue(struct osc_conflate *c, const struct sockaddr *src_addr,
+                         const struct ucred *cred, const void *data, size_t len,
+                         uint64_t rx_timestamp)
+{
+	size_t address_len = osc_conflate_address_len(data, len);
+	bool conflatable = address_len
+	                   && osc_address_listed(c->addresses, c->address_count,
+	                                         data, len);
+	uint32_t hash = 0;
+
+	if (conflatable) {
+		hash = osc_conflate_hash(data, address_len);
+
+		struct osc_conflate_packet **pp = osc_conflate_find(c, hash, data,
+		                                                    address_len);
+		if (*pp) {
+			if (osc_conflate_fill(*pp, src_addr, cred, data, len,
+			                      rx_timestamp))
+				return -1;
+			return 1;
+		}
+	}
+
+	struct osc_conflate_packet *p = c->pool;
+	if (p) {
+		c->pool = p->next;
+		c->pool_count--;
+	} else {
+		p = osc_mem_calloc(sizeof(*p), 1);
+		if (!p)
+			return -1;
+	}
+
+	if (osc_conflate_fill(p, src_addr, cred, data, len, rx_timestamp)) {
+		osc_conflate_packet_free(p);
+		return -1;
+	}
+
+	p->next = NULL;
+	p->hash = hash;
+	p->hashed = conflatable;
+	if (conflatable) {
+		struct osc_conflate_packet **bucket;
+
+		bucket = &c->buckets[hash % OSC_CONFLATE_BUCKETS];
+		p->hash_next = *bucket;
+		*bucket = p;
+	}
+
+	*c->queue_endp = p;
+	c->queue_endp = &p->next;
+	c->queued++;
+	return 0;
+}
+
+/* The oldest queued packet, or NULL if there is none. Later messages to
+ * its address are queued anew. It has to be passed to
+ * osc_conflate_release afterwards. */
+struct osc_conflate_packet *osc_conflate_dequeue(struct osc_conflate *c)
+{
+	struct osc_conflate_packet *p = c->queue;
+
+	if (!p)
+		return NULL;
+
+	c->queue = p->next;
+	if (!c->queue)
+		c->queue_endp = &c->queue;
+	c->queued--;
+
+	if (p->hashed) {
+		struct osc_conflate_packet **pp;
+
+		pp = &c->buckets[p->hash % OSC_CONFLATE_BUCKETS];
+		while (*pp != p)
+			pp = &(*pp)->hash_next;
+		*pp = p->hash_next;
+		p->hashed = false;
+	}
+
+	return p;
+}
+
+void osc_conflate_release(struct osc_conflate *c, struct osc_conflate_packet *p)
+{
+	if (c->pool_count >= OSC_CONFLATE_POOL_MAX) {
+		osc_conflate_packet_free(p);
+		return;
+	}
+
+	p->next = c->pool;
+	c->pool = p;
+	c->pool_count++;
+}
+
+size_t osc_conflate_queued(struct osc_conflate *c)
+{
+	return c->queued;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef OSCCONFLATE_H
+#define OSCCONFLATE_H
+
+struct osc_conflate;
+
+struct osc_conflate_packet {
+	struct osc_conflate_packet *next;
+	struct osc_conflate_packet *hash_next;
+	const struct sockaddr *src_addr;
+	const struct ucred *cred;
+	uint64_t rx_timestamp;
+	size_t len;
+	size_t size;
+	unsigned char *data;
+
+	/* Hash of the address of a conflated message, which is queued in
+	 * its bucket */
+	uint32_t hash;
+	bool hashed;
+
+	struct sockaddr_storage addr;
+	struct ucred cred_buf;
+};
+
+struct osc_conflate *osc_conflate_new(void);
+void osc_conflate_free(struct osc_conflate *c);
+int osc_conflate_add_address(struct osc_conflate *c, const char *address);
+int osc_conflate_enqueue(struct osc_conflate *c, const struct sockaddr *src_addr,
+                         const struct ucred *cred, const void *data, size_t len,
+                         uint64_t rx_timestamp);
+struct osc_conflate_packet *osc_conflate_dequeue(struct osc_conflate *c);
+void osc_conflate_release(struct osc_conflate *c, struct osc_conflate_packet *p);
+size_t osc_conflate_queued(struct osc_conflate *c);
+
+#endif
@@ -21,6 +21,7 @@
  */
 #include "cosc.h"
 #include "oscdispatcher.h"
+#include "oscalloc.h"
 #include "oscparser.h"
 #include "oscutils.h"
 
@@ -49,34 +50,38 @@ struct osc_container {
 struct osc_method {
 	OSC_NODE_COMMON
 	osc_method callback;
+	osc_method_info callback_info;
 	void *arg;
 };
 
 
 struct osc_dispatcher {
 	struct osc_container *root;
+	const struct osc_allocator *allocator;
 };
 
 static struct osc_container *osc_container_new(const char *name)
 {
 	struct osc_container *rv;
 
-	rv = calloc(sizeof(*rv), 1);
+	rv = osc_mem_calloc(sizeof(*rv), 1);
 	rv->type = OSC_CONTAINER;
-	rv->name = strdup(name);
+	rv->name = osc_mem_strdup(name);
 	rv->endp = &rv->children;
 
 	return rv;
 };
 
-static struct osc_method *osc_method_new(const char *name, osc_method callback, void *arg)
+static struct osc_method *osc_method_new(const char *name, osc_method callback,
+                                         osc_method_info callback_info, void *arg)
 {
 	struct osc_method *rv;
 
-	rv = calloc(sizeof(*rv), 1);
+	rv = osc_mem_calloc(sizeof(*rv), 1);
 	rv->type = OSC_METHOD;
-	rv->name = strdup(name);
+	rv->name = osc_mem_strdup(name);
 	rv->callback = callback;
+	rv->callback_info = callback_info;
 	rv->arg = arg;
 
 	return rv;
@@ -86,15 +91,43 @@ struct osc_dispatcher *osc_dispatcher_new(void)
 {
 	struct osc_dispatcher *rv;
 
-	rv = calloc(sizeof(*rv), 1);
+	rv = osc_mem_calloc(sizeof(*rv), 1);
+	rv->allocator = osc_allocator_current();
 	rv->root = osc_container_new("");
 
 	return rv;
 }
 
-void osc_dispatcher_add_method(struct osc_dispatcher *d, const char *address,
-                               osc_method callback, void *arg)
+static void osc_node_free(struct osc_node *n)
 {
+	while (n) {
+		struct osc_node *next = n->next;
+
+		if (n->type == OSC_CONTAINER)
+			osc_node_free(((struct osc_container *)n)->children);
+		osc_mem_free(n->name);
+		osc_mem_free(n);
+		n = next;
+	}
+}
+
+void osc_dispatcher_free(struct osc_dispatcher *d)
+{
+	if (!d)
+		return;
+
+	OSC_ALLOCATOR_SCOPE(d->allocator);
+
+	osc_node_free((struct osc_node *)d->root);
+	osc_mem_free(d);
+}
+
+static void _osc_dispatcher_add_method(struct osc_dispatcher *d, const char *address,
+                                       osc_method callback,
+                                       osc_method_info callback_info, void *arg)
+{
+	OSC_ALLOCATOR_SCOPE(d->allocator);
+
 	size_t slashes = 0;
 
 	for (const char *p = address; *p; p++) {
@@ -126,7 +159,8 @@ void osc_dispatcher_add_method(struct osc_dispatcher *d, const char *address,
 				/* it's not the last token, so create container */
 				n = (struct osc_node*)osc_container_new(token);
 			} else { /* it is the last token, so create method */
-				n = (struct osc_node*)osc_method_new(token, callback, arg);
+				n = (struct osc_node*)osc_method_new(token, callback,
+				                                     callback_info, arg);
 			}
 			/* Insert created node */
 			*c->endp = n;
@@ -144,18 +178,54 @@ void osc_dispatcher_add_method(struct osc_dispatcher *d, const char *address,
 
 out:
 	for (size_t i = 0; i < token_count; i++)
-		free(tokens[i]);
-	free(tokens);
+		osc_mem_free(tokens[i]);
+	osc_mem_free(tokens);
+}
+
+void osc_dispatcher_add_method(struct osc_dispatcher *d, const char *address,
+                               osc_method callback, void *arg)
+{
+	_osc_dispatcher_add_method(d, address, callback, NULL, arg);
+}
+
+/* Add a method which is also passed the info given to
+ * osc_dispatcher_process_info, or NULL */
+void osc_dispatcher_add_method_info(struct osc_dispatcher *d,
+                                    const char *address,
+                                    osc_method_info callback, void *arg)
+{
+	_osc_dispatcher_add_method(d, address, NULL, callback, arg);
+}
+
+/* The names of the first level of the address space, like "foo" for
+ * methods below /foo/, valid until methods are added. Stores up to max
+ * of them and returns how many there are. */
+size_t osc_dispatcher_roots(struct osc_dispatcher *d, const char **names,
+                            size_t max)
+{
+	size_t count = 0;
+
+	for (struct osc_node *n = d->root->children; n; n = n->next) {
+		if (count < max)
+			names[count] = n->name;
+		count++;
+	}
+
+	return count;
 }
 
 static void _osc_dispatcher_process_message(struct osc_node *n, char **tokens, size_t token_count,
-                                            struct osc_message *msg)
+                                            struct osc_message *msg,
+                                            const struct osc_dispatch_info *info)
 {
 	if (!token_count) {
 		if (n->type != OSC_METHOD)
 			return;
 		struct osc_method *m = (struct osc_method *)n;
-		m->callback(m->arg, msg->arguments);
+		if (m->callback_info)
+			m->callback_info(m->arg, msg->arguments, info);
+		else
+			m->callback(m->arg, msg->arguments);
 		return;
 	}
 
@@ -164,26 +234,38 @@ static void _osc_dispatcher_process_message(struct osc_node *n, char **tokens, s
 
 	for (struct osc_node *c = ((struct osc_container *)n)->children; c; c = c->next) {
 		if (osc_pattern_match(tokens[0], c->name))
-			_osc_dispatcher_process_message(c, tokens + 1, token_count - 1, msg);
+			_osc_dispatcher_process_message(c, tokens + 1, token_count - 1, msg, info);
 	}
 }
 
-static void osc_dispatcher_process_message(struct osc_dispatcher *d, struct osc_message *msg)
+static void osc_dispatcher_process_message(struct osc_dispatcher *d, struct osc_message *msg,
+                                           const struct osc_dispatch_info *info)
 {
+	/* The tokens are gone again before returning, so they are taken
+	 * from the allocator of the caller, like a real-time pool. If that
+	 * is exhausted, the message is dropped. */
 	size_t token_count;
 	char **tokens = osc_addr_split(msg->address->value, &token_count);
+	if (!tokens)
+		return;
 
-	_osc_dispatcher_process_message((struct osc_node *)d->root, tokens, token_count, msg);
+	_osc_dispatcher_process_message((struct osc_node *)d->root, tokens, token_count, msg, info);
 
 	for (size_t i = 0; i < token_count; i++)
-		free(tokens[i]);
-	free(tokens);
+		osc_mem_free(tokens[i]);
+	osc_mem_free(tokens);
 }
 
 void osc_dispatcher_process(struct osc_dispatcher *d, struct osc_element *e)
+{
+	osc_dispatcher_process_info(d, e, NULL);
+}
+
+void osc_dispatcher_process_info(struct osc_dispatcher *d, struct osc_element *e,
+                                 const struct osc_dispatch_info *info)
 {
 	if (e->type == OSC_MESSAGE) {
-		osc_dispatcher_process_message(d, (struct osc_message *)e);
+		osc_dispatcher_process_message(d, (struct osc_message *)e, info);
 	}
 	if (e->type == OSC_BUNDLE) {
 		struct osc_bundle *b = (struct osc_bundle*)e;
@@ -192,6 +274,6 @@ void osc_dispatcher_process(struct osc_dispatcher *d, struct osc_element *e)
 			return;
 
 		for (struct osc_element *i = b->elements; i; i = i->next)
-			osc_dispatcher_process(d, i);
+			osc_dispatcher_process_info(d, i, info);
 	}
 }
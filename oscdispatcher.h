@@ -24,12 +24,36 @@
 
 struct osc_dispatcher;
 struct osc_element;
+struct osc_packet;
+
+/* Where and when the packet being dispatched was received. Times are
+ * in nanoseconds since the epoch, 0 if unknown. cred identifies the
+ * sending process on Unix domain sockets, if asked for. packet holds
+ * the data and parsed tree of packets received by an osc_server, which
+ * a method can keep with osc_packet_ref, and is NULL otherwise. */
+struct osc_dispatch_info {
+	const struct sockaddr *src_addr;
+	const struct ucred *cred;
+	uint64_t rx_timestamp;
+	uint64_t dispatch_timestamp;
+	struct osc_packet *packet;
+};
 
 typedef void (*osc_method)(void *arg, struct osc_element *arguments);
+typedef void (*osc_method_info)(void *arg, struct osc_element *arguments,
+                                const struct osc_dispatch_info *info);
 
 struct osc_dispatcher *osc_dispatcher_new(void);
+void osc_dispatcher_free(struct osc_dispatcher *d);
 void osc_dispatcher_add_method(struct osc_dispatcher *d, const char *address,
                                osc_method callback, void *arg);
+void osc_dispatcher_add_method_info(struct osc_dispatcher *d,
+                                    const char *address,
+                                    osc_method_info callback, void *arg);
+size_t osc_dispatcher_roots(struct osc_dispatcher *d, const char **names,
+                            size_t max);
 void osc_dispatcher_process(struct osc_dispatcher *d, struct osc_element *e);
+void osc_dispatcher_process_info(struct osc_dispatcher *d, struct osc_element *e,
+                                 const struct osc_dispatch_info *info);
 
 #endif
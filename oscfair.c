@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "oscfair.h"
+#include "oscalloc.h"
+#include "oscutils.h"
+
+#define OSC_FAIR_BUCKETS 1024
+#define OSC_FAIR_SOURCES_MAX 4096
+
+/* Sources are told apart by address family, port and address. Unix
+ * domain sources by a hash of their path, those without one share the
+ * same key. */
+struct osc_fair_key {
+	sa_family_t family;
+	uint16_t port;
+	uint8_t addr[16];
+};
+
+struct osc_fair_source {
+	struct osc_fair_source *hash_next;
+	struct osc_fair_source *active_next;
+	struct osc_fair_key key;
+	struct sockaddr_storage addr;
+
+	struct osc_fair_packet *queue;
+	struct osc_fair_packet **queue_endp;
+	size_t queue_len;
+	bool active;
+
+	/* Packets handed out by osc_fair_dequeue and not yet released,
+	 * which point to addr */
+	unsigned busy;
+
+	/* Bytes the source may still be served in the current round */
+	size_t deficit;
+
+	/* Theoretical arrival time of the rate limit, see oscclient.c */
+	uint64_t tat;
+};
+
+/* Packets queued per source, served by deficit round robin: sources
+ * with packets take turns, each sending up to quantum bytes per turn
+ * and carrying over what it could not use. Optionally each source is
+ * limited to a rate, packets exceeding it are dropped on arrival. */
+struct osc_fair {
+	size_t quantum;
+	size_t queue_limit;
+	uint64_t interval_ns;
+	uint64_t burst_ns;
+
+	struct osc_fair_source *buckets[OSC_FAIR_BUCKETS];
+	unsigned source_count;
+	size_t queued;
+
+	struct osc_fair_source *active;
+	struct osc_fair_source *active_last;
+};
+
+struct osc_fair *osc_fair_new(void)
+{
+	struct osc_fair *rv = osc_mem_calloc(sizeof(*rv), 1);
+	if (!rv)
+		return NULL;
+
+	rv->quantum = 1500;
+	rv->queue_limit = 64;
+	return rv;
+}
+
+static void osc_fair_source_free(struct osc_fair_source *s)
+{
+	while (s->queue) {
+		struct osc_fair_packet *next = s->queue->next;
+
+		osc_mem_free(s->queue);
+		s->queue = next;
+	}
+	osc_mem_free(s);
+}
+
+/* Packets still handed out must have been released before */
+void osc_fair_free(struct osc_fair *f)
+{
+	if (!f)
+		return;
+
+	for (unsigned i = 0; i < OSC_FAIR_BUCKETS; i++) {
+		while (f->buckets[i]) {
+			struct osc_fair_source *next = f->buckets[i]->hash_next;
+
+			osc_fair_source_free(f->buckets[i]);
+			f->buckets[i] = next;
+		}
+	}
+	osc_mem_free(f);
+}
+
+/* Serve each source up to quantum bytes per round and queue up to
+ * queue_limit packets per source. quantum should be at least the size
+ * of a typical packet. */
+int osc_fair_set_limits(struct osc_fair *f, size_t quantum, size_t queue_limit)
+{
+	if (!quantum || !queue_limit) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	f->quantum = quantum;
+	f->queue_limit = queue_limit;
+	return 0;
+}
+
+/* Limit each source to rate packets per second, with bursts of up to
+ * burst packets. A rate of 0 removes the limit. */
+int osc_fair_set_rate(struct osc_fair *f, unsigned rate, unsigned burst)
+{
+	if (rate && !burst) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	f->interval_ns = rate ? 1000000000ULL / rate : 0;
+	f->burst_ns = rate ? (burst - 1) * f->interval_ns : 0;
+	return 0;
+}
+
+static socklen_t osc_fair_key_init(struct osc_fair_key *key,
+                                   const struct sockaddr *sa)
+{
+	memset(key, 0, sizeof(*key));
+	if (!sa)
+		return 0;
+
+	key->family = sa->sa_family;
+	if (sa->sa_family == AF_INET) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in*)sa;
+
+		key->port = sin->sin_port;
+		memcpy(key->addr, &sin->sin_addr, sizeof(sin->sin_addr));
+		return sizeof(*sin);
+	}
+
+	if (sa->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)sa;
+
+		key->port = sin6->sin6_port;
+		memcpy(key->addr, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+		return sizeof(*sin6);
+	}
+
+	if (sa->sa_family == AF_UNIX) {
+		const struct sockaddr_un *sun = (const struct sockaddr_un*)sa;
+		uint64_t hash = 14695981039346656037ULL;
+
+		for (size_t i = 0; i < sizeof(sun->sun_path); i++) {
+			hash ^= (unsigned char)sun->sun_path[i];
+			hash *= 1099511628211ULL;
+		}
+		memcpy(key->addr, &hash, sizeof(hash));
+		return sizeof(*sun);
+	}
+
+	return sizeof(sa->sa_family);
+}
+
+static unsigned osc_fair_hash(const struct osc_fair_key *key)
+{
+	const unsigned char *p = (const unsigned char*)key;
+	uint32_t hash = 2166136261U;
+
+	for (size_t i = 0; i < sizeof(*key); i++) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+
+	return hash & (OSC_FAIR_BUCKETS - 1);
+}
+
+/* A source holding no packets and no longer limited by its rate is in
+ * the same state as one not seen before and can be forgotten */
+static bool osc_fair_source_idle(struct osc_fair_source *s, uint64_t now)
+{
+	return !s->queue_len && !s->busy && s->tat <= now;
+}
+
+static void osc_fair_forget(struct osc_fair *f, struct osc_fair_source *s)
+{
+	struct osc_fair_source **sp = &f->buckets[osc_fair_hash(&s->key)];
+
+	while (*sp != s)
+		sp = &(*sp)->hash_next;
+	*sp = s->hash_next;
+
+	f->source_count--;
+	osc_fair_source_free(s);
+}
+
+static void osc_fair_sweep(struct osc_fair *f, uint64_t now)
+{
+	for (unsigned i = 0; i < OSC_FAIR_BUCKETS; i++) {
+		struct osc_fair_source **sp = &f->buckets[i];
+
+		while (*sp) {
+			struct osc_fair_source *s = *sp;
+
+			if (osc_fair_source_idle(s, now)) {
+				*sp = s->hash_next;
+				f->source_count--;
+				osc_fair_source_free(s);
+			} else {
+				sp = &s->hash_next;
+			}
+		}
+	}
+}
+
+static struct osc_fair_source *osc_fair_lookup(struct osc_fair *f,
+                                               const struct sockaddr *sa,
+                                               uint64_t now)
+{
+	struct osc_fair_key key;
+	socklen_t len = osc_fair_key_init(&key, sa);
+	unsigned hash = osc_fair_hash(&key);
+	struct osc_fair_source *s;
+
+	for (s = f->buckets[hash]; s; s = s->hash_next) {
+		if (!memcmp(&s->key, &key, sizeof(key)))
+			return s;
+	}
+
+	/* Spoofed source addresses must not exhaust memory */
+	if (f->source_count >= OSC_FAIR_SOURCES_MAX) {
+		osc_fair_sweep(f, now);
+		if (f->source_count >= OSC_FAIR_SOURCES_MAX) {
+			errno = ENOBUFS;
+			return NULL;
+		}
+	}
+
+	s = osc_mem_calloc(sizeof(*s), 1);
+	if (!s)
+		return NULL;
+
+	s->key = key;
+	if (sa)
+		memcpy(&s->addr, sa, len);
+	s->queue_endp = &s->queue;
+	s->hash_next = f->buckets[hash];
+	f->buckets[hash] = s;
+	f->source_count++;
+	return s;
+}
+
+/* Queue a copy of a packet received from src_addr. Fails with EAGAIN
+ * if the source exceeds its rate and with ENOBUFS if its queue is
+ * full, so that the packet is dropped. */
+int osc_fair_enqueue(struct osc_fair *f, const struct sockaddr *src_addr,
+                     const void *data, size_t len, uint64_t rx_timestamp)
+{
+	uint64_t now = f->interval_ns ? osc_time_ns() : 0;
+	struct osc_fair_source *s = osc_fair_lookup(f, src_addr, now);
+
+	if (!s)
+		return -1;
+
+	if (f->interval_ns) {
+		if (now + f->burst_ns < s->tat) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	if (s->queue_len >= f->queue_limit) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	struct osc_fair_packet *p = osc_mem_alloc(sizeof(*p) + len);
+	if (!p)
+		return -1;
+
+	if (f->interval_ns) {
+		if (s->tat < now)
+			s->tat = now;
+		s->tat += f->interval_ns;
+	}
+
+	p->next = NULL;
+	p->source = s;
+	p->src_addr = src_addr ? (struct sockaddr*)&s->addr : NULL;
+	p->rx_timestamp = rx_timestamp;
+	p->len = len;
+	memcpy(p->data, data, len);
+
+	*s->queue_endp = p;
+	s->queue_endp = &p->next;
+	s->queue_len++;
+	f->queued++;
+
+	if (!s->active) {
+		s->active = true;
+		s->deficit = 0;
+		s->active_next = NULL;
+		if (f->active_last)
+			f->active_last->active_next = s;
+		else
+			f->active = s;
+		f->active_last = s;
+	}
+
+	return 0;
+}
+
+/* The next packet to process, or NULL if none is queued. It has to be
+ * passed to osc_fair_release afterwards. */
+struct osc_fair_packet *osc_fair_dequeue(struct osc_fair *f)
+{
+	while (f->active) {
+		struct osc_fair_source *s = f->active;
+		struct osc_fair_packet *p = s->queue;
+
+		if (p->len <= s->deficit) {
+			s->deficit -= p->len;
+			s->queue = p->next;
+			if (!s->queue)
+				s->queue_endp = &s->queue;
+			s->queue_len--;
+			s->busy++;
+			f->queued--;
+
+			if (!s->queue_len) {
+				s->active = false;
+				f->active = s->active_next;
+				if (!f->active)
+					f->active_last = NULL;
+			}
+			return p;
+		}
+
+		/* Its turn is over, move it to the end of the round */
+		s->deficit += f->quantum;
+		if (s->active_next) {
+			f->active = s->active_next;
+			s->active_next = NULL;
+			f->active_last->active_next = s;
+			f->active_last = s;
+		}
+	}
+
+	return NULL;
+}
+
+void osc_fair_release(struct osc_fair *f, struct osc_fair_packet *p)
+{
+	struct osc_fair_source *s = p->source;
+
+	osc_mem_free(p);
+	s->busy--;
+	if (osc_fair_source_idle(s, f->interval_ns ? osc_time_ns() : 0))
+		osc_fair_forget(f, s);
+}
+
+size_t osc_fair_queued(struct osc_fair *f)
+{
+	return f->queued;
+}
+
+unsigned osc_fair_sources(struct osc_fair *f)
+{
+	return f->source_count;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef OSCFAIR_H
+#define OSCFAIR_H
+
+struct osc_fair;
+struct osc_fair_source;
+
+struct osc_fair_packet {
+	struct osc_fair_packet *next;
+	struct osc_fair_source *source;
+	const struct sockaddr *src_addr;
+	uint64_t rx_timestamp;
+	size_t len;
+	unsigned char data[];
+};
+
+struct osc_fair *osc_fair_new(void);
+void osc_fair_free(struct osc_fair *f);
+int osc_fair_set_limits(struct osc_fair *f, size_t quantum, size_t queue_limit);
+int osc_fair_set_rate(struct osc_fair *f, unsigned rate, unsigned burst);
+int osc_fair_enqueue(struct osc_fair *f, const struct sockaddr *src_addr,
+                     const void *data, size_t len, uint64_t rx_timestamp);
+struct osc_fair_packet *osc_fair_dequeue(struct osc_fair *f);
+void osc_fair_release(struct osc_fair *f, struct osc_fair_packet *p);
+size_t osc_fair_queued(struct osc_fair *f);
+unsigned osc_fair_sources(struct osc_fair *f);
+
+#endif
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "oscfilter.h"
+#include "oscalloc.h"
+
+/* Filters of UDP sockets see the UDP header before the payload */
+#define OSC_FILTER_PAYLOAD 8
+/* Longer names are only compared up to this length */
+#define OSC_FILTER_NAME_MAX 64
+#define OSC_FILTER_ACCEPT 0xffffffff
+#define OSC_FILTER_BLOCK_TESTS 32
+
+/* Sources are kept as the words of their address in host order, IPv4
+ * ones in the first word */
+struct osc_filter_source {
+	int family;
+	uint32_t addr[4];
+	unsigned prefix;
+};
+
+/* A classic BPF program for SO_ATTACH_FILTER, letting through packets
+ * from the allowed sources whose address starts with the name of one
+ * of the first level containers or methods of a dispatcher, or whose
+ * first part is a pattern, and all bundles. Conditional jumps only
+ * reach 255 instructions ahead, so every test skips to the end of its
+ * own block when it fails and farther targets are reached with BPF_JA. */
+struct osc_filter {
+	struct osc_filter_source *sources;
+	unsigned source_count;
+
+	struct sock_filter *code;
+	unsigned len;
+	unsigned size;
+	bool overflow;
+
+	/* Instructions jumping to the end of the current block */
+	unsigned skips[OSC_FILTER_BLOCK_TESTS];
+	unsigned skip_count;
+};
+
+struct osc_filter *osc_filter_new(void)
+{
+	return osc_mem_calloc(sizeof(struct osc_filter), 1);
+}
+
+void osc_filter_free(struct osc_filter *f)
+{
+	if (!f)
+		return;
+
+	osc_mem_free(f->sources);
+	osc_mem_free(f->code);
+	osc_mem_free(f);
+}
+
+/* Only let through packets from addr, or from the network of the
+ * first prefix bits of it. IPv4 sources also apply to IPv4 packets
+ * received by IPv6 sockets. */
+int osc_filter_allow_source(struct osc_filter *f, const struct sockaddr *addr,
+                            unsigned prefix)
+{
+	struct osc_filter_source src = {
+		.family = addr->sa_family,
+		.prefix = prefix
+	};
+	const unsigned char *bytes;
+	unsigned words;
+
+	if (addr->sa_family == AF_INET) {
+		bytes = (const unsigned char*)&((struct sockaddr_in*)addr)->sin_addr;
+		words = 1;
+	} else if (addr->sa_family == AF_INET6) {
+		const struct in6_addr *a6 = &((struct sockaddr_in6*)addr)->sin6_addr;
+
+		bytes = a6->s6_addr;
+		words = 4;
+		if (IN6_IS_ADDR_V4MAPPED(a6)) {
+			src.family = AF_INET;
+			src.prefix = (prefix > 96) ? prefix - 96 : 0;
+			bytes += 12;
+			words = 1;
+		}
+	} else {
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+
+	if (src.prefix > words * 32) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (unsigned i = 0; i < words; i++) {
+		uint32_t word;
+
+		memcpy(&word, bytes + 4 * i, sizeof(word));
+		src.addr[i] = ntohl(word);
+	}
+
+	struct osc_filter_source *sources = osc_mem_realloc(f->sources,
+	                            (f->source_count + 1) * sizeof(*sources));
+	if (!sources)
+		return -1;
+
+	f->sources = sources;
+	f->sources[f->source_count++] = src;
+	return 0;
+}
+
+static unsigned osc_filter_emit(struct osc_filter *f, uint16_t code,
+                                uint8_t jt, uint8_t jf, uint32_t k)
+{
+	if (f->len == f->size) {
+		unsigned size = f->size ? 2 * f->size : 64;
+		struct sock_filter *c = osc_mem_realloc(f->code, size * sizeof(*c));
+
+		if (!c) {
+			f->overflow = true;
+			return f->len;
+		}
+		f->code = c;
+		f->size = size;
+	}
+
+	f->code[f->len] = (struct sock_filter){ code, jt, jf, k };
+	return f->len++;
+}
+
+/* A test which falls through if true and skips the block otherwise */
+static void osc_filter_test(struct osc_filter *f, uint16_t code, uint32_t k)
+{
+	unsigned idx = osc_filter_emit(f, BPF_JMP | code | BPF_K, 0, 0, k);
+
+	if (f->skip_count < OSC_FILTER_BLOCK_TESTS)
+		f->skips[f->skip_count++] = idx;
+	else
+		f->overflow = true;
+}
+
+static void osc_filter_end_block(struct osc_filter *f)
+{
+	for (unsigned i = 0; i < f->skip_count; i++) {
+		unsigned idx = f->skips[i];
+
+		if (f->len - idx - 1 > 255 || idx >= f->size)
+			f->overflow = true;
+		else
+			f->code[idx].jf = f->len - idx - 1;
+	}
+	f->skip_count = 0;
+}
+
+static void osc_filter_jump(struct osc_filter *f, unsigned from, unsigned to)
+{
+	if (from < f->size)
+		f->code[from].k = to - from - 1;
+}
+
+/* Compare len bytes at offset with s, a word at a time */
+static void osc_filter_compare(struct osc_filter *f, unsigned offset,
+                               const unsigned char *s, size_t len)
+{
+	for (size_t i = 0; i < len; ) {
+		uint32_t k = 0;
+		unsigned n = (len - i >= 4) ? 4 : (len - i >= 2) ? 2 : 1;
+
+		for (unsigned j = 0; j < n; j++)
+			k = (k << 8) | s[i + j];
+
+		osc_filter_emit(f, BPF_LD | BPF_ABS | ((n == 4) ? BPF_W
+		                : (n == 2) ? BPF_H : BPF_B), 0, 0, offset + i);
+		osc_filter_test(f, BPF_JEQ, k);
+		i += n;
+	}
+}
+
+/* Jumps to the end of the source checks for each allowed source of
+ * family. The network header is IPv4 or IPv6 by the packet, not by
+ * the socket. */
+static void osc_filter_sources(struct osc_filter *f, int family,
+                               unsigned *allowed, unsigned *allowed_count)
+{
+	unsigned offset = SKF_NET_OFF + ((family == AF_INET) ? 12 : 8);
+
+	for (unsigned i = 0; i < f->source_count; i++) {
+		const struct osc_filter_source *src = &f->sources[i];
+
+		if (src->family != family)
+			continue;
+
+		for (unsigned w = 0; w * 32 < src->prefix; w++) {
+			unsigned bits = src->prefix - w * 32;
+			uint32_t mask = (bits >= 32) ? 0xffffffff
+			                : ~(0xffffffff >> bits);
+
+			osc_filter_emit(f, BPF_LD | BPF_W | BPF_ABS, 0, 0, offset + 4 * w);
+			osc_filter_emit(f, BPF_ALU | BPF_AND | BPF_K, 0, 0, mask);
+			osc_filter_test(f, BPF_JEQ, src->addr[w] & mask);
+		}
+		allowed[(*allowed_count)++] = osc_filter_emit(f, BPF_JMP | BPF_JA, 0, 0, 0);
+		osc_filter_end_block(f);
+	}
+
+	osc_filter_emit(f, BPF_RET | BPF_K, 0, 0, 0);
+}
+
+/* Let through addresses with one of ?*[{ in their first part, which
+ * may match any of the names. Only the first max bytes are looked at:
+ * a pattern starting later can't match a name that long, or has the
+ * truncated name of its block as prefix. */
+static void osc_filter_patterns(struct osc_filter *f, size_t max)
+{
+	unsigned exits[OSC_FILTER_NAME_MAX];
+
+	for (size_t i = 0; i <= max; i++) {
+		unsigned offset = OSC_FILTER_PAYLOAD + 1 + i;
+
+		osc_filter_emit(f, BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+		osc_filter_emit(f, BPF_JMP | BPF_JGE | BPF_K, 0, 8, offset + 1);
+		osc_filter_emit(f, BPF_LD | BPF_B | BPF_ABS, 0, 0, offset);
+		osc_filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, 6, 0, '/');
+		osc_filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, 5, 0, 0);
+		osc_filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, 3, 0, '?');
+		osc_filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, 2, 0, '*');
+		osc_filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, '[');
+		osc_filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, 0, 2, '{');
+		osc_filter_emit(f, BPF_RET | BPF_K, 0, 0, OSC_FILTER_ACCEPT);
+		exits[i] = osc_filter_emit(f, BPF_JMP | BPF_JA, 0, 0, 0);
+	}
+
+	for (size_t i = 0; i <= max; i++)
+		osc_filter_jump(f, exits[i], f->len);
+}
+
+/* Generate the program for the given first level names. Fails with
+ * E2BIG if it would not fit into BPF_MAXINSNS instructions. */
+int osc_filter_build(struct osc_filter *f, const char **roots, size_t count)
+{
+	static const unsigned char bundle[] = "#bundle";
+	unsigned char name[OSC_FILTER_NAME_MAX];
+	size_t longest = 0;
+
+	f->len = 0;
+	f->skip_count = 0;
+	f->overflow = false;
+
+	if (f->source_count) {
+		unsigned *allowed = osc_mem_alloc(f->source_count * sizeof(*allowed));
+		unsigned allowed_count = 0;
+
+		if (!allowed)
+			return -1;
+
+		osc_filter_emit(f, BPF_LD | BPF_B | BPF_ABS, 0, 0, SKF_NET_OFF);
+		osc_filter_emit(f, BPF_ALU | BPF_RSH | BPF_K, 0, 0, 4);
+		osc_filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 6);
+		unsigned to_v6 = osc_filter_emit(f, BPF_JMP | BPF_JA, 0, 0, 0);
+		osc_filter_sources(f, AF_INET, allowed, &allowed_count);
+		osc_filter_jump(f, to_v6, f->len);
+		osc_filter_sources(f, AF_INET6, allowed, &allowed_count);
+
+		for (unsigned i = 0; i < allowed_count; i++)
+			osc_filter_jump(f, allowed[i], f->len);
+		osc_mem_free(allowed);
+	}
+
+	/* Bundles are let through as a whole */
+	osc_filter_emit(f, BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+	osc_filter_test(f, BPF_JGE, OSC_FILTER_PAYLOAD + sizeof(bundle));
+	osc_filter_compare(f, OSC_FILTER_PAYLOAD, bundle, sizeof(bundle));
+	osc_filter_emit(f, BPF_RET | BPF_K, 0, 0, OSC_FILTER_ACCEPT);
+	osc_filter_end_block(f);
+
+	/* The name has to be followed by a slash or the end of the address,
+	 * the length is checked first as loads past the end drop the packet */
+	for (size_t i = 0; i < count; i++) {
+		size_t len = strlen(roots[i]) + 1;
+		bool whole = (len <= OSC_FILTER_NAME_MAX);
+
+		if (!whole)
+			len = OSC_FILTER_NAME_MAX;
+		if (len - 1 > longest)
+			longest = len - 1;
+		name[0] = '/';
+		memcpy(name + 1, roots[i], len - 1);
+
+		osc_filter_emit(f, BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+		osc_filter_test(f, BPF_JGE, OSC_FILTER_PAYLOAD + len + whole);
+		osc_filter_compare(f, OSC_FILTER_PAYLOAD, name, len);
+		if (whole) {
+			osc_filter_emit(f, BPF_LD | BPF_B | BPF_ABS, 0, 0,
+			                OSC_FILTER_PAYLOAD + len);
+			osc_filter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, '/');
+			osc_filter_test(f, BPF_JEQ, 0);
+		}
+		osc_filter_emit(f, BPF_RET | BPF_K, 0, 0, OSC_FILTER_ACCEPT);
+		osc_filter_end_block(f);
+	}
+
+	osc_filter_patterns(f, longest);
+	osc_filter_emit(f, BPF_RET | BPF_K, 0, 0, 0);
+
+	if (f->overflow || f->len > BPF_MAXINSNS) {
+		f->len = 0;
+		errno = E2BIG;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Attach the program last built to a UDP socket, replacing its filter,
+ * or remove the filter if f is NULL or building the program failed */
+int osc_filter_attach(struct osc_filter *f, int fd)
+{
+	if (!f || !f->len) {
+		int dummy = 0;
+
+		if (setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof(dummy))
+		    && errno != ENOENT)
+			return -1;
+		return 0;
+	}
+
+	struct sock_fprog prog = {
+		.len = f->len,
+		.filter = f->code
+	};
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
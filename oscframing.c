@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "oscframing.h"
+
+#define SLIP_END 0300
+#define SLIP_ESC 0333
+#define SLIP_ESC_END 0334
+#define SLIP_ESC_ESC 0335
+
+size_t osc_frame_size(enum osc_framing framing, const void *data, size_t len)
+{
+	if (framing == OSC_FRAMING_LENGTH)
+		return 4 + len;
+
+	size_t rv = 2 + len;
+	const unsigned char *p = data;
+
+	for (size_t i = 0; i < len; i++) {
+		if (p[i] == SLIP_END || p[i] == SLIP_ESC)
+			rv++;
+	}
+
+	return rv;
+}
+
+/* Encode data into frame, which has to provide osc_frame_size bytes */
+void osc_frame_encode(enum osc_framing framing, const void *data, size_t len,
+                      void *frame)
+{
+	unsigned char *out = frame;
+
+	if (framing == OSC_FRAMING_LENGTH) {
+		uint32_t size = htonl(len);
+		memcpy(out, &size, 4);
+		memcpy(out + 4, data, len);
+		return;
+	}
+
+	const unsigned char *p = data;
+
+	*out++ = SLIP_END;
+	for (size_t i = 0; i < len; i++) {
+		switch (p[i]) {
+		case SLIP_END:
+			*out++ = SLIP_ESC;
+			*out++ = SLIP_ESC_END;
+			break;
+		case SLIP_ESC:
+			*out++ = SLIP_ESC;
+			*out++ = SLIP_ESC_ESC;
+			break;
+		default:
+			*out++ = p[i];
+		}
+	}
+	*out++ = SLIP_END;
+}
+
+/* Length prefixes announcing frames of more than max bytes, prefix
+ * included, are malformed. SLIP frames are bounded by the buffer of
+ * the caller. */
+void osc_deframer_init(struct osc_deframer *d, enum osc_framing framing,
+                       size_t max)
+{
+	memset(d, 0, sizeof(*d));
+	d->framing = framing;
+	d->max = max;
+}
+
+/* Look for the end of the frame starting at buf, which holds len
+ * bytes. Returns the number of bytes the complete frame takes up,
+ * setting packet and packet_len to its contents, which lie within buf.
+ * Returns 0 if more bytes are needed and -1 on a malformed frame. */
+ssize_t osc_deframer_next(struct osc_deframer *d, void *buf, size_t len,
+                          void **packet, size_t *packet_len)
+{
+	unsigned char *p = buf;
+
+	if (d->framing == OSC_FRAMING_LENGTH) {
+		if (!d->need) {
+			if (len < 4)
+				return 0;
+
+			uint32_t size;
+			memcpy(&size, p, 4);
+			size = ntohl(size);
+			if (d->max < 4 || size > d->max - 4) {
+				errno = EMSGSIZE;
+				return -1;
+			}
+			d->need = 4 + (size_t)size;
+		}
+
+		if (len < d->need)
+			return 0;
+
+		ssize_t rv = d->need;
+		*packet = p + 4;
+		*packet_len = d->need - 4;
+		d->need = 0;
+		return rv;
+	}
+
+	/* SLIP decodes in place, behind the position it reads from */
+	while (d->in < len) {
+		unsigned char c = p[d->in];
+
+		if (c == SLIP_END) {
+			d->in++;
+			if (!d->out)
+				continue; /* Start of a frame or an empty one */
+
+			ssize_t rv = d->in;
+			*packet = p;
+			*packet_len = d->out;
+			d->in = d->out = 0;
+			return rv;
+		}
+
+		if (c == SLIP_ESC) {
+			if (d->in + 1 == len)
+				return 0;
+
+			switch (p[d->in + 1]) {
+			case SLIP_ESC_END:
+				c = SLIP_END;
+				break;
+			case SLIP_ESC_ESC:
+				c = SLIP_ESC;
+				break;
+			default:
+				errno = EPROTO;
+				return -1;
+			}
+			d->in++;
+		}
+
+		p[d->out++] = c;
+		d->in++;
+	}
+
+	return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef OSCFRAMING_H
+#define OSCFRAMING_H
+
+enum osc_framing {
+	OSC_FRAMING_LENGTH, /* OSC 1.0, packets prefixed by their int32 size */
+	OSC_FRAMING_SLIP,   /* OSC 1.1, packets encoded as double ended SLIP */
+};
+
+/* Incremental decoder of a stream of frames. The caller keeps the
+ * received bytes of the current frame at the start of its buffer and
+ * passes them again, with newly received ones appended, until the
+ * frame is complete. */
+struct osc_deframer {
+	enum osc_framing framing;
+	size_t in;   /* raw bytes of the current frame already looked at */
+	size_t out;  /* SLIP: bytes decoded from those, in place */
+	size_t need; /* length prefix: size of the whole frame, once known */
+	size_t max;  /* length prefix: largest frame accepted */
+};
+
+size_t osc_frame_size(enum osc_framing framing, const void *data, size_t len);
+void osc_frame_encode(enum osc_framing framing, const void *data, size_t len,
+                      void *frame);
+void osc_deframer_init(struct osc_deframer *d, enum osc_framing framing,
+                       size_t max);
+ssize_t osc_deframer_next(struct osc_deframer *d, void *buf, size_t len,
+                          void **packet, size_t *packet_len);
+
+#endif
@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "osciouring.h"
+#include "oscalloc.h"
+
+#ifdef IORING_RECV_MULTISHOT
+
+#define OSC_URING_ENTRIES 64
+#define OSC_URING_CQ_ENTRIES 1024
+#define OSC_URING_BGID 0
+
+/* A ring receiving datagrams with one multishot recvmsg per socket into
+ * buffers picked by the kernel from a provided buffer ring. Driven by
+ * the raw system calls, so it works without liburing. */
+struct osc_uring {
+	int fd;
+
+	void *sq_ptr;
+	size_t sq_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned sqe_tail;
+	unsigned sqe_submitted;
+
+	void *cq_ptr;
+	size_t cq_size;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	unsigned buf_count;
+	uint16_t br_tail;
+	unsigned char *bufs;
+	size_t buf_size;
+
+	/* Template of all recvmsg requests. The kernel places a struct
+	 * io_uring_recvmsg_out, msg_namelen bytes of source address,
+	 * msg_controllen bytes of ancillary data and then the payload
+	 * into each buffer. */
+	struct msghdr msg;
+};
+
+static int osc_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int osc_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                           unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+	               flags, NULL, 0);
+}
+
+static int osc_uring_register(int fd, unsigned opcode, void *arg,
+                              unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int osc_uring_map(struct osc_uring *ring, struct io_uring_params *p)
+{
+	ring->sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ring->cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = 0;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, ring->fd,
+	                    IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		return -1;
+	}
+
+	if (ring->cq_size) {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+		                    MAP_SHARED | MAP_POPULATE, ring->fd,
+		                    IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			return -1;
+		}
+	} else {
+		ring->cq_ptr = ring->sq_ptr;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		return -1;
+	}
+
+	unsigned char *sq = ring->sq_ptr;
+	ring->sq_head = (unsigned*)(sq + p->sq_off.head);
+	ring->sq_tail = (unsigned*)(sq + p->sq_off.tail);
+	ring->sq_mask = *(unsigned*)(sq + p->sq_off.ring_mask);
+	ring->sq_entries = p->sq_entries;
+	ring->sq_array = (unsigned*)(sq + p->sq_off.array);
+	ring->sqe_tail = ring->sqe_submitted = *ring->sq_tail;
+
+	unsigned char *cq = ring->cq_ptr;
+	ring->cq_head = (unsigned*)(cq + p->cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + p->cq_off.tail);
+	ring->cq_mask = *(unsigned*)(cq + p->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + p->cq_off.cqes);
+	return 0;
+}
+
+/* Hand buffer bid back to the kernel, visible after osc_uring_publish */
+static void osc_uring_recycle(struct osc_uring *ring, uint16_t bid)
+{
+	struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (ring->buf_count - 1)];
+
+	buf->addr = (uintptr_t)(ring->bufs + (size_t)bid * ring->buf_size);
+	buf->len = ring->buf_size;
+	buf->bid = bid;
+	ring->br_tail++;
+}
+
+static void osc_uring_publish(struct osc_uring *ring)
+{
+	__atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+static int osc_uring_init_buffers(struct osc_uring *ring, unsigned count,
+                                  size_t size)
+{
+	struct io_uring_buf_reg reg = {};
+
+	ring->buf_count = count;
+	ring->buf_size = sizeof(struct io_uring_recvmsg_out)
+	                 + ring->msg.msg_namelen + ring->msg.msg_controllen + size;
+	ring->bufs = osc_mem_alloc(count * ring->buf_size);
+	if (!ring->bufs)
+		return -1;
+
+	/* The buffer ring has to be page aligned */
+	ring->br_size = count * sizeof(struct io_uring_buf);
+	ring->br = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE,
+	                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->br == MAP_FAILED) {
+		ring->br = NULL;
+		return -1;
+	}
+
+	reg.ring_addr = (uintptr_t)ring->br;
+	reg.ring_entries = count;
+	reg.bgid = OSC_URING_BGID;
+	if (osc_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+		return -1;
+
+	for (unsigned i = 0; i < count; i++)
+		osc_uring_recycle(ring, i);
+	osc_uring_publish(ring);
+	return 0;
+}
+
+static int osc_uring_submit(struct osc_uring *ring, unsigned min_complete)
+{
+	unsigned to_submit = ring->sqe_tail - ring->sqe_submitted;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	/* Completions of the multishot requests are posted by task work,
+	 * which runs on any entry into the kernel. */
+	int rv = osc_uring_enter(ring->fd, to_submit, min_complete,
+	                         IORING_ENTER_GETEVENTS);
+	if (rv < 0)
+		return -1;
+
+	ring->sqe_submitted += rv;
+	return 0;
+}
+
+static struct io_uring_sqe *osc_uring_get_sqe(struct osc_uring *ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (ring->sqe_tail - head >= ring->sq_entries) {
+		if (osc_uring_submit(ring, 0))
+			return NULL;
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sqe_tail - head >= ring->sq_entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+
+	unsigned idx = ring->sqe_tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	ring->sqe_tail++;
+	return sqe;
+}
+
+static int osc_uring_queue_recv(struct osc_uring *ring, int fd, int flags)
+{
+	struct io_uring_sqe *sqe = osc_uring_get_sqe(ring);
+
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)&ring->msg;
+	sqe->len = 1;
+	sqe->msg_flags = flags;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = OSC_URING_BGID;
+	sqe->user_data = fd;
+	return 0;
+}
+
+/* Multishot recvmsg was added after the buffer rings. Issued with
+ * MSG_DONTWAIT on an empty socket, it completes at once either with
+ * EAGAIN or with EINVAL if the kernel does not know it. */
+static int osc_uring_probe(struct osc_uring *ring)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	int rv = -1;
+
+	if (fd < 0)
+		return -1;
+
+	if (osc_uring_queue_recv(ring, fd, MSG_DONTWAIT)
+	    || osc_uring_submit(ring, 0))
+		goto out;
+
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		errno = ENOSYS;
+		goto out;
+	}
+
+	int res = ring->cqes[head & ring->cq_mask].res;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	if (res == -EAGAIN)
+		rv = 0;
+	else
+		errno = (res < 0) ? -res : ENOSYS;
+
+out:
+	close(fd);
+	return rv;
+}
+
+/* Set up a ring with buf_count buffers for datagrams of up to buf_size
+ * bytes and control_size bytes of ancillary data. buf_count has to be a
+ * power of two up to 32768. Fails with ENOSYS or EINVAL where io_uring
+ * or one of the required features is not available. */
+struct osc_uring *osc_uring_new(unsigned buf_count, size_t buf_size,
+                                size_t control_size)
+{
+	struct io_uring_params p = {
+		.flags = IORING_SETUP_CQSIZE,
+		.cq_entries = OSC_URING_CQ_ENTRIES,
+	};
+
+	if (!buf_count || buf_count > 32768 || (buf_count & (buf_count - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct osc_uring *rv = osc_mem_calloc(sizeof(*rv), 1);
+	if (!rv)
+		return NULL;
+
+	rv->msg.msg_namelen = sizeof(struct sockaddr_storage);
+	rv->msg.msg_controllen = control_size;
+
+	rv->fd = osc_uring_setup(OSC_URING_ENTRIES, &p);
+	if (rv->fd < 0
+	    || osc_uring_map(rv, &p)
+	    || osc_uring_init_buffers(rv, buf_count, buf_size)
+	    || osc_uring_probe(rv)) {
+		int err = errno;
+
+		osc_uring_free(rv);
+		errno = err;
+		return NULL;
+	}
+
+	return rv;
+}
+
+void osc_uring_free(struct osc_uring *ring)
+{
+	if (!ring)
+		return;
+
+	/* Closing the ring cancels all requests and releases the
+	 * registered buffer ring */
+	if (ring->fd >= 0)
+		close(ring->fd);
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_size);
+	if (ring->br)
+		munmap(ring->br, ring->br_size);
+	osc_mem_free(ring->bufs);
+	osc_mem_free(ring);
+}
+
+/* Start receiving from fd. The socket must stay open as long as the
+ * ring is in use. */
+int osc_uring_add_recv(struct osc_uring *ring, int fd)
+{
+	if (osc_uring_queue_recv(ring, fd, 0))
+		return -1;
+	return osc_uring_submit(ring, 0);
+}
+
+/* Process the available completions, first waiting for one if wait is
+ * set, but handle at most max datagrams. Returns the number handled,
+ * or -1 on error. */
+int osc_uring_run(struct osc_uring *ring, bool wait, unsigned max,
+                  osc_uring_handler handler, void *arg)
+{
+	if (osc_uring_submit(ring, wait ? 1 : 0))
+		return (errno == EINTR) ? 0 : -1;
+
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	int count = 0;
+	int err = 0;
+
+	for (; head != tail && (unsigned)count < max; head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+		int fd = cqe->user_data;
+
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			unsigned char *buf = ring->bufs + (size_t)bid * ring->buf_size;
+			struct io_uring_recvmsg_out *out = (void*)buf;
+			size_t offset = sizeof(*out) + ring->msg.msg_namelen
+			                + ring->msg.msg_controllen;
+			size_t len = out->payloadlen;
+
+			/* Truncated datagrams report their full length */
+			if (len > ring->buf_size - offset)
+				len = ring->buf_size - offset;
+
+			if (cqe->res >= 0) {
+				struct msghdr msg = {
+					.msg_name = out + 1,
+					.msg_namelen = out->namelen,
+					.msg_control = (unsigned char*)(out + 1)
+					               + ring->msg.msg_namelen,
+					.msg_controllen = out->controllen,
+					.msg_flags = out->flags,
+				};
+
+				if (msg.msg_namelen > ring->msg.msg_namelen)
+					msg.msg_namelen = 0;
+				if (msg.msg_controllen > ring->msg.msg_controllen)
+					msg.msg_controllen = ring->msg.msg_controllen;
+				handler(arg, fd, buf + offset, len, &msg);
+				count++;
+			}
+			osc_uring_recycle(ring, bid);
+		}
+
+		if (cqe->flags & IORING_CQE_F_MORE)
+			continue;
+
+		/* The request ended, e.g. because it ran out of buffers
+		 * while we were busy */
+		if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EINTR
+		    && cqe->res != -EAGAIN) {
+			err = -cqe->res;
+			continue;
+		}
+
+		if (osc_uring_queue_recv(ring, fd, 0))
+			err = errno;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	osc_uring_publish(ring);
+
+	/* Requests re-armed above must be submitted now, or the ring
+	 * would not become readable for them */
+	if (ring->sqe_tail != ring->sqe_submitted && osc_uring_submit(ring, 0)
+	    && !err)
+		err = errno;
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return count;
+}
+
+int osc_uring_fd(struct osc_uring *ring)
+{
+	return ring->fd;
+}
+
+#else
+
+struct osc_uring *osc_uring_new(unsigned buf_count, size_t buf_size,
+                                size_t control_size)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void osc_uring_free(struct osc_uring *ring)
+{
+}
+
+int osc_uring_add_recv(struct osc_uring *ring, int fd)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int osc_uring_run(struct osc_uring *ring, bool wait, unsigned max,
+                  osc_uring_handler handler, void *arg)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int osc_uring_fd(struct osc_uring *ring)
+{
+	return -1;
+}
+
+#endif
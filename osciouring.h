@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef OSCIOURING_H
+#define OSCIOURING_H
+
+struct osc_uring;
+
+/* Called for each datagram received from fd, with msg describing its
+ * source address and ancillary data. The buffer is handed back to the
+ * kernel once the handler returns. */
+typedef void (*osc_uring_handler)(void *arg, int fd, const void *data,
+                                  size_t len, struct msghdr *msg);
+
+struct osc_uring *osc_uring_new(unsigned buf_count, size_t buf_size,
+                                size_t control_size);
+void osc_uring_free(struct osc_uring *ring);
+int osc_uring_add_recv(struct osc_uring *ring, int fd);
+int osc_uring_run(struct osc_uring *ring, bool wait, unsigned max,
+                  osc_uring_handler handler, void *arg);
+int osc_uring_fd(struct osc_uring *ring);
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "oscpacket.h"
+#include "oscalloc.h"
+#include "oscparser.h"
+
+/* A received packet and the tree parsed from it, shared by reference.
+ * Neither changes while the packet is referenced. bytes points to the
+ * packet where it was received until the first osc_packet_ref copies it
+ * to data. */
+struct osc_packet {
+	struct osc_packet_pool *pool;
+	struct osc_packet *next;
+	unsigned refs;
+	struct osc_element *root;
+	const unsigned char *bytes;
+	size_t size;
+	size_t len;
+	unsigned char data[];
+};
+
+/* Buffers of packets, taken and parsed into by one thread, the owner.
+ * Packets released by the owner go back to the free list directly,
+ * those released by other threads are pushed to the returned list,
+ * which the owner takes over as a whole once the free list is empty.
+ * Their trees are freed by the owner, with its allocator. kept counts
+ * the packets still referenced after the owner dropped its reference. */
+struct osc_packet_pool {
+	size_t size;
+	struct osc_packet *free;
+	struct osc_packet *returned;
+	unsigned kept;
+};
+
+/* Keep p from returning to its pool until osc_packet_unref. Valid from
+ * any thread on a packet referenced by the caller, like the one passed
+ * to a method in its struct osc_dispatch_info. The first reference is
+ * taken by the method, on the thread dispatching it, and copies the
+ * packet out of the receive buffer. Returns p. */
+struct osc_packet *osc_packet_ref(struct osc_packet *p)
+{
+	if (p->bytes != p->data) {
+		memcpy(p->data, p->bytes, p->len);
+		p->bytes = p->data;
+	}
+
+	__atomic_fetch_add(&p->refs, 1, __ATOMIC_RELAXED);
+	return p;
+}
+
+/* Drop a reference taken with osc_packet_ref, from any thread, without
+ * locks or allocations. All references have to be dropped before the
+ * server which received the packet stops its workers or is freed, and
+ * before it starts workers or changes to or from real-time mode. */
+void osc_packet_unref(struct osc_packet *p)
+{
+	if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	struct osc_packet_pool *pool = p->pool;
+
+	p->next = __atomic_load_n(&pool->returned, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&pool->returned, &p->next, p, true,
+	                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	__atomic_sub_fetch(&pool->kept, 1, __ATOMIC_RELEASE);
+}
+
+/* The packet as received */
+const void *osc_packet_data(const struct osc_packet *p, size_t *len)
+{
+	if (len)
+		*len = p->len;
+	return p->bytes;
+}
+
+/* The message or bundle parsed from the packet */
+const struct osc_element *osc_packet_element(const struct osc_packet *p)
+{
+	return p->root;
+}
+
+/* Buffers are allocated with room for at least size bytes */
+struct osc_packet_pool *osc_packet_pool_new(size_t size)
+{
+	struct osc_packet_pool *rv = osc_mem_calloc(sizeof(*rv), 1);
+
+	if (rv)
+		rv->size = size;
+	return rv;
+}
+
+static void osc_packet_clear(struct osc_packet *p)
+{
+	if (p->root)
+		osc_free(p->root);
+	p->root = NULL;
+}
+
+static void osc_packet_list_free(struct osc_packet *p)
+{
+	while (p) {
+		struct osc_packet *next = p->next;
+
+		osc_packet_clear(p);
+		osc_mem_free(p);
+		p = next;
+	}
+}
+
+/* The pool may only be freed once osc_packet_pool_kept is 0 */
+void osc_packet_pool_free(struct osc_packet_pool *pool)
+{
+	if (!pool)
+		return;
+
+	osc_packet_list_free(pool->free);
+	osc_packet_list_free(__atomic_exchange_n(&pool->returned, NULL,
+	                                         __ATOMIC_ACQUIRE));
+	osc_mem_free(pool);
+}
+
+static struct osc_packet *osc_packet_get(struct osc_packet_pool *pool,
+                                         size_t len)
+{
+	if (!pool->free)
+		pool->free = __atomic_exchange_n(&pool->returned, NULL,
+		                                 __ATOMIC_ACQUIRE);
+
+	struct osc_packet *p = pool->free;
+	if (p) {
+		pool->free = p->next;
+		osc_packet_clear(p);
+		if (p->size >= len)
+			return p;
+		osc_mem_free(p);
+	}
+
+	size_t size = (len > pool->size) ? len : pool->size;
+	p = osc_mem_alloc(sizeof(*p) + size);
+	if (!p)
+		return NULL;
+
+	p->pool = pool;
+	p->root = NULL;
+	p->size = size;
+	return p;
+}
+
+/* Parse data into a packet with a buffer of the pool, by the owner of
+ * the pool. data is copied to the buffer only if the packet is kept
+ * with osc_packet_ref, until then it has to stay as it is. The packet
+ * has one reference, which the owner drops with osc_packet_pool_put.
+ * Returns NULL if the packet could not be parsed, without a log if
+ * there was no buffer. */
+struct osc_packet *osc_packet_parse(struct osc_packet_pool *pool,
+                                    const void *data, size_t len, char **log)
+{
+	struct osc_packet *p = osc_packet_get(pool, len);
+
+	if (!p) {
+		if (log)
+			*log = NULL;
+		return NULL;
+	}
+
+	p->bytes = data;
+	p->len = len;
+	p->refs = 1;
+	p->root = osc_parse_packet(data, len, log);
+	if (!p->root) {
+		p->next = pool->free;
+		pool->free = p;
+		return NULL;
+	}
+
+	return p;
+}
+
+/* Drop the reference of the owner. Unless other threads still hold
+ * one, the tree is freed and the buffer ready for the next packet. */
+void osc_packet_pool_put(struct osc_packet_pool *pool, struct osc_packet *p)
+{
+	if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL)) {
+		__atomic_add_fetch(&pool->kept, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	osc_packet_clear(p);
+	p->next = pool->free;
+	pool->free = p;
+}
+
+/* The number of packets of the pool other threads still hold, as seen
+ * by its owner. Dropping the last reference to a packet is the last
+ * access of another thread to the pool. */
+unsigned osc_packet_pool_kept(struct osc_packet_pool *pool)
+{
+	return pool ? __atomic_load_n(&pool->kept, __ATOMIC_ACQUIRE) : 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef OSCPACKET_H
+#define OSCPACKET_H
+
+struct osc_element;
+struct osc_packet;
+struct osc_packet_pool;
+
+struct osc_packet *osc_packet_ref(struct osc_packet *p);
+void osc_packet_unref(struct osc_packet *p);
+const void *osc_packet_data(const struct osc_packet *p, size_t *len);
+const struct osc_element *osc_packet_element(const struct osc_packet *p);
+
+struct osc_packet_pool *osc_packet_pool_new(size_t size);
+void osc_packet_pool_free(struct osc_packet_pool *pool);
+struct osc_packet *osc_packet_parse(struct osc_packet_pool *pool,
+                                    const void *data, size_t len, char **log);
+void osc_packet_pool_put(struct osc_packet_pool *pool, struct osc_packet *p);
+unsigned osc_packet_pool_kept(struct osc_packet_pool *pool);
+
+#endif
@@ -21,6 +21,7 @@
  */
 #include "cosc.h"
 #include "oscparser.h"
+#include "oscalloc.h"
 #include "oscfloat.h"
 
 struct osc_formatter_state {
@@ -54,7 +55,7 @@ static void osc_format_print(struct osc_formatter_state *s, unsigned indent, con
 static void osc_free_simple(struct osc_element *e)
 {
 	osc_free(e->next);
-	free(e);
+	osc_mem_free(e);
 }
 
 static void osc_free_message(struct osc_message *m)
@@ -75,14 +76,14 @@ static void osc_free_bundle(struct osc_bundle *b)
 
 static void osc_free_string(struct osc_string *s)
 {
-	free(s->value);
+	osc_mem_free(s->value);
 	s->type = OSC_ELEMENT;
 	osc_free(s);
 }
 
 static void osc_free_blob(struct osc_blob *b)
 {
-	free(b->value);
+	osc_mem_free(b->value);
 	b->type = OSC_ELEMENT;
 	osc_free(b);
 }
@@ -119,6 +120,17 @@ void osc_free(union osc_element_ptr ptr)
 	}
 }
 
+/* Zeroed memory for an element, which may run out with a real-time
+ * pool */
+static void *osc_parse_alloc(struct osc_parser_state *s, size_t size)
+{
+	void *rv = osc_mem_calloc(size, 1);
+
+	if (!rv)
+		osc_format_print(&s->f, 0, "Out of memory.\n");
+	return rv;
+}
+
 static struct osc_int32 *osc_parse_int32(struct osc_parser_state *s)
 {
 	struct osc_int32 *rv = NULL;
@@ -134,7 +146,9 @@ static struct osc_int32 *osc_parse_int32(struct osc_parser_state *s)
 	s->ptr += 4;
 	s->len -= 4;
 
-	rv = calloc(sizeof(*rv), 1);
+	rv = osc_parse_alloc(s, sizeof(*rv));
+	if (!rv)
+		return NULL;
 	rv->type = OSC_INT32;
 	rv->value = ntohl(tmp);
 	return rv;
@@ -150,7 +164,9 @@ static struct osc_float32 *osc_parse_float32(struct osc_parser_state *s)
 		return NULL;
 	}
 
-	rv = calloc(sizeof(*rv), 1);
+	rv = osc_parse_alloc(s, sizeof(*rv));
+	if (!rv)
+		return NULL;
 	rv->type = OSC_FLOAT32;
 	rv->value = osc_unpack_float((unsigned char*)s->ptr);
 	s->ptr += 4;
@@ -168,7 +184,9 @@ static struct osc_string *osc_parse_string(struct osc_parser_state *s)
 
 	while (len < s->len) {
 		if (*(s->ptr + len) == '\0') {
-			rv = calloc(sizeof(*rv), 1);
+			rv = osc_parse_alloc(s, sizeof(*rv));
+			if (!rv)
+				return NULL;
 			rv->type = OSC_STRING;
 			break;
 		}
@@ -180,7 +198,12 @@ static struct osc_string *osc_parse_string(struct osc_parser_state *s)
 		return NULL;
 	}
 
-	rv->value = strdup((char*)s->ptr);
+	rv->value = osc_mem_strdup((char*)s->ptr);
+	if (!rv->value) {
+		osc_format_print(&s->f, 0, "Out of memory.\n");
+		osc_free(rv);
+		return NULL;
+	}
 
 	len += 1; /* Account for terminator byte. */
 	size_t padded = len + ((4 - (len % 4)) % 4);
@@ -226,7 +249,9 @@ static struct osc_message *osc_parse_message(struct osc_parser_state *s, struct
 		goto out;
 	}
 
-	rv = calloc(sizeof(*rv), 1);
+	rv = osc_parse_alloc(s, sizeof(*rv));
+	if (!rv)
+		goto out;
 	rv->type = OSC_MESSAGE;
 	rv->address = addr;
 
@@ -278,7 +303,9 @@ static struct osc_timetag *osc_parse_timetag(struct osc_parser_state *s)
 		return NULL;
 	}
 
-	rv = calloc(sizeof(*rv), 1);
+	rv = osc_parse_alloc(s, sizeof(*rv));
+	if (!rv)
+		return NULL;
 	rv->type = OSC_TIMETAG;
 
 	memcpy(&tmp, s->ptr, 4);
@@ -312,7 +339,11 @@ static struct osc_bundle *osc_parse_bundle(struct osc_parser_state *s)
 	if (!tag)
 		return NULL;
 
-	struct osc_bundle *rv = calloc(sizeof(*rv), 1);
+	struct osc_bundle *rv = osc_parse_alloc(s, sizeof(*rv));
+	if (!rv) {
+		osc_free(tag);
+		return NULL;
+	}
 	rv->type = OSC_BUNDLE;
 	rv->timetag = tag;
 
@@ -335,8 +366,9 @@ static struct osc_bundle *osc_parse_bundle(struct osc_parser_state *s)
 		s->ptr += i->value;
 		s->len -= i->value;
 
-		osc_format_print(&s->f, 0, "<subparser>\n%s</subparser>\n", log);
-		free(log);
+		osc_format_print(&s->f, 0, "<subparser>\n%s</subparser>\n",
+		                 log ? log : "");
+		osc_mem_free(log);
 
 		if (!*atnext)
 			goto out;
@@ -362,12 +394,15 @@ struct osc_element *osc_parse_packet(const void *data, size_t len, char **log)
 		.len = len,
 	};
 
+	/* Without memory for the log, parsing goes on without it */
 	if (log) {
-		logbuf = malloc(8192);
-		logbuf[0] = '\0';
+		logbuf = osc_mem_alloc(8192);
 		*log = logbuf;
-		s.f.pos = logbuf;
-		s.f.end = logbuf + 8192;
+		if (logbuf) {
+			logbuf[0] = '\0';
+			s.f.pos = logbuf;
+			s.f.end = logbuf + 8192;
+		}
 	}
 
 	/* Packet is either a bundle or a message, both start with a string */
@@ -388,6 +423,18 @@ struct osc_element *osc_parse_packet(const void *data, size_t len, char **log)
 	return (struct osc_element*)osc_parse_message(&s, head);
 }
 
+/* Returns the address of the message in data without parsing it, or
+ * NULL if data does not start with a terminated address. */
+const char *osc_packet_address(const void *data, size_t len)
+{
+	const char *address = data;
+
+	if (!len || address[0] != '/' || !memchr(address, '\0', len))
+		return NULL;
+
+	return address;
+}
+
 static void _osc_format(struct osc_formatter_state *s, unsigned indent,
                         union osc_element_ptr ptr);
 
@@ -105,6 +105,7 @@ union osc_element_ptr {
 
 void osc_free(union osc_element_ptr ptr);
 struct osc_element *osc_parse_packet(const void *data, size_t len, char **log);
+const char *osc_packet_address(const void *data, size_t len);
 const char *osc_format(union osc_element_ptr ptr);
 
 #endif
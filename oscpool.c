@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "oscpool.h"
+#include "oscalloc.h"
+
+/* Blocks of 32 bytes to 64 KiB, in powers of two */
+#define OSC_POOL_MIN_SHIFT 5
+#define OSC_POOL_CLASSES 12
+
+/* Precedes the data of each block, which stays 16 byte aligned */
+struct osc_pool_block {
+	struct osc_pool_block *next;
+	size_t cls;
+	unsigned char data[];
+};
+
+/* Memory allocated up front and handed out in blocks of fixed sizes,
+ * without locks or system calls, by one thread at a time. Every class
+ * of blocks gets an equal share of it. Memory from other allocators is
+ * given back to the allocator in use when the pool was created. */
+struct osc_pool {
+	struct osc_allocator allocator;
+	const struct osc_allocator *fallback;
+	unsigned char *mem;
+	size_t size;
+	struct osc_pool_block *free[OSC_POOL_CLASSES];
+	struct osc_pool_stats stats;
+};
+
+static size_t osc_pool_class_size(unsigned cls)
+{
+	return (size_t)1 << (cls + OSC_POOL_MIN_SHIFT);
+}
+
+/* OSC_POOL_CLASSES if size is larger than any block */
+static unsigned osc_pool_class(size_t size)
+{
+	unsigned cls = 0;
+
+	while (cls < OSC_POOL_CLASSES && osc_pool_class_size(cls) < size)
+		cls++;
+	return cls;
+}
+
+static bool osc_pool_owns(const struct osc_pool *pool, const void *ptr)
+{
+	const unsigned char *p = ptr;
+
+	return p >= pool->mem && p < pool->mem + pool->size;
+}
+
+static struct osc_pool_block *osc_pool_block(void *ptr)
+{
+	return (struct osc_pool_block*)((unsigned char*)ptr
+	                                - offsetof(struct osc_pool_block, data));
+}
+
+/* A larger block is taken if those of the right size are used up */
+static void *osc_pool_alloc(void *ctx, size_t size)
+{
+	struct osc_pool *pool = ctx;
+	struct osc_pool_block *b = NULL;
+
+	for (unsigned cls = osc_pool_class(size); cls < OSC_POOL_CLASSES; cls++) {
+		b = pool->free[cls];
+		if (b) {
+			pool->free[cls] = b->next;
+			break;
+		}
+	}
+
+	if (!b) {
+		pool->stats.failures++;
+		assert(!"real-time pool exhausted");
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pool->stats.allocs++;
+	pool->stats.used += osc_pool_class_size(b->cls);
+	if (pool->stats.used > pool->stats.max_used)
+		pool->stats.max_used = pool->stats.used;
+	return b->data;
+}
+
+static void osc_pool_release(struct osc_pool *pool, struct osc_pool_block *b)
+{
+	pool->stats.used -= osc_pool_class_size(b->cls);
+	b->next = pool->free[b->cls];
+	pool->free[b->cls] = b;
+}
+
+static void *osc_pool_realloc(void *ctx, void *ptr, size_t size)
+{
+	struct osc_pool *pool = ctx;
+
+	if (!ptr)
+		return osc_pool_alloc(ctx, size);
+
+	/* Growing memory allocated before the pool took over allocates
+	 * outside of it */
+	if (!osc_pool_owns(pool, ptr)) {
+		pool->stats.failures++;
+		assert(!"real-time pool bypassed");
+		return pool->fallback->realloc(pool->fallback->ctx, ptr, size);
+	}
+
+	struct osc_pool_block *b = osc_pool_block(ptr);
+	if (size <= osc_pool_class_size(b->cls))
+		return ptr;
+
+	void *rv = osc_pool_alloc(ctx, size);
+	if (!rv)
+		return NULL;
+
+	memcpy(rv, ptr, osc_pool_class_size(b->cls));
+	osc_pool_release(pool, b);
+	return rv;
+}
+
+static void osc_pool_dealloc(void *ctx, void *ptr)
+{
+	struct osc_pool *pool = ctx;
+
+	if (!ptr)
+		return;
+
+	if (osc_pool_owns(pool, ptr))
+		osc_pool_release(pool, osc_pool_block(ptr));
+	else
+		pool->fallback->free(pool->fallback->ctx, ptr);
+}
+
+/* A pool of size bytes, all of which are written to so that no page
+ * faults are left for later */
+struct osc_pool *osc_pool_new(size_t size)
+{
+	struct osc_pool *rv = osc_mem_calloc(sizeof(*rv), 1);
+	if (!rv)
+		return NULL;
+
+	rv->mem = osc_mem_alloc_aligned(64, size);
+	if (!rv->mem) {
+		osc_mem_free(rv);
+		return NULL;
+	}
+
+	memset(rv->mem, 0, size);
+	rv->size = size;
+	rv->fallback = osc_allocator_current();
+	rv->allocator.alloc = osc_pool_alloc;
+	rv->allocator.realloc = osc_pool_realloc;
+	rv->allocator.free = osc_pool_dealloc;
+	rv->allocator.ctx = rv;
+
+	/* What does not fit into a share is left to the next class */
+	unsigned char *p = rv->mem;
+	for (unsigned cls = 0; cls < OSC_POOL_CLASSES; cls++) {
+		size_t block = sizeof(struct osc_pool_block) + osc_pool_class_size(cls);
+		unsigned char *end = (cls == OSC_POOL_CLASSES - 1) ? rv->mem + size
+		                     : rv->mem + size / OSC_POOL_CLASSES * (cls + 1);
+
+		while (p + block <= end) {
+			struct osc_pool_block *b = (struct osc_pool_block*)p;
+
+			b->cls = cls;
+			b->next = rv->free[cls];
+			rv->free[cls] = b;
+			p += block;
+		}
+	}
+
+	return rv;
+}
+
+/* Everything allocated from the pool is gone with it */
+void osc_pool_free(struct osc_pool *pool)
+{
+	if (!pool)
+		return;
+
+	OSC_ALLOCATOR_SCOPE(pool->fallback);
+
+	osc_mem_free_aligned(pool->mem);
+	osc_mem_free(pool);
+}
+
+/* The pool as allocator, see osc_use_allocator */
+const struct osc_allocator *osc_pool_allocator(struct osc_pool *pool)
+{
+	return &pool->allocator;
+}
+
+void osc_pool_get_stats(struct osc_pool *pool, struct osc_pool_stats *stats)
+{
+	*stats = pool->stats;
+}
@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "oscrelay.h"
+#include "oscalloc.h"
+#include "oscparser.h"
+#include "oscutils.h"
+
+#define OSC_RELAY_BATCH 32
+#define OSC_RELAY_BUFSIZE 8192
+#define OSC_RELAY_MAX_DESTINATIONS 64
+#define OSC_RELAY_MAX_ELEMENTS 256
+#define OSC_RELAY_MAX_TX 256
+#define OSC_RELAY_MAX_IOV 1024
+
+/* Routes match addresses by prefix, each token of the route being a
+ * pattern for the corresponding token of the address. */
+struct osc_route {
+	struct osc_route *next;
+	char **tokens;
+	size_t token_count;
+	uint64_t destinations;
+};
+
+struct osc_relay_destination {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+};
+
+/* Bundle element including its size prefix */
+struct osc_relay_element {
+	const unsigned char *data;
+	size_t len;
+	uint64_t destinations;
+};
+
+struct osc_relay {
+	int fd;
+	int family;
+
+	struct osc_relay_destination destinations[OSC_RELAY_MAX_DESTINATIONS];
+	size_t destination_count;
+	struct osc_route *routes;
+	struct osc_route **routes_endp;
+
+	unsigned char (*rx_buf)[OSC_RELAY_BUFSIZE];
+	struct iovec rx_iov[OSC_RELAY_BATCH];
+	struct mmsghdr rx_msg[OSC_RELAY_BATCH];
+
+	/* Outgoing datagrams, referencing the data being processed */
+	struct mmsghdr tx_msg[OSC_RELAY_MAX_TX];
+	size_t tx_count;
+	struct iovec tx_iov[OSC_RELAY_MAX_IOV];
+	size_t iov_count;
+
+	struct osc_relay_element elements[OSC_RELAY_MAX_ELEMENTS];
+
+	const struct osc_allocator *allocator;
+};
+
+struct osc_relay *osc_relay_new(const char *node, const char *service,
+                                const struct addrinfo *hints)
+{
+	int fd = osc_socket_bind(node, service, hints, SOCK_DGRAM);
+
+	if (fd < 0)
+		return NULL;
+
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	if (getsockname(fd, (struct sockaddr*)&ss, &len)) {
+		close(fd);
+		return NULL;
+	}
+
+	struct osc_relay *rv = osc_mem_calloc(sizeof(*rv), 1);
+
+	rv->allocator = osc_allocator_current();
+	rv->fd = fd;
+	rv->family = ss.ss_family;
+	rv->routes_endp = &rv->routes;
+	rv->rx_buf = osc_mem_calloc(OSC_RELAY_BATCH, sizeof(*rv->rx_buf));
+
+	for (size_t i = 0; i < OSC_RELAY_BATCH; i++) {
+		rv->rx_iov[i].iov_base = rv->rx_buf[i];
+		rv->rx_iov[i].iov_len = sizeof(rv->rx_buf[i]);
+		rv->rx_msg[i].msg_hdr.msg_iov = &rv->rx_iov[i];
+		rv->rx_msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return rv;
+}
+
+void osc_relay_free(struct osc_relay *relay)
+{
+	if (!relay)
+		return;
+
+	OSC_ALLOCATOR_SCOPE(relay->allocator);
+
+	while (relay->routes) {
+		struct osc_route *r = relay->routes;
+		relay->routes = r->next;
+
+		for (size_t i = 0; i < r->token_count; i++)
+			osc_mem_free(r->tokens[i]);
+		osc_mem_free(r->tokens);
+		osc_mem_free(r);
+	}
+
+	close(relay->fd);
+	osc_mem_free(relay->rx_buf);
+	osc_mem_free(relay);
+}
+
+int osc_relay_add_destination(struct osc_relay *relay, const char *node,
+                              const char *service)
+{
+	struct addrinfo ai = {
+		.ai_family = relay->family,
+		.ai_socktype = SOCK_DGRAM,
+	};
+	struct addrinfo *res;
+
+	if (relay->destination_count >= OSC_RELAY_MAX_DESTINATIONS) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	if (relay->family == AF_INET6)
+		ai.ai_flags |= AI_V4MAPPED;
+
+	if (getaddrinfo(node, service, &ai, &res))
+		return -1;
+
+	struct osc_relay_destination *d;
+	d = &relay->destinations[relay->destination_count];
+	memcpy(&d->addr, res->ai_addr, res->ai_addrlen);
+	d->addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return relay->destination_count++;
+}
+
+int osc_relay_add_route(struct osc_relay *relay, const char *pattern,
+                        int destination)
+{
+	OSC_ALLOCATOR_SCOPE(relay->allocator);
+
+	if (pattern[0] != '/' || destination < 0
+	    || (size_t)destination >= relay->destination_count) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct osc_route *r = osc_mem_calloc(sizeof(*r), 1);
+	if (!r)
+		return -1;
+
+	r->tokens = osc_addr_split(pattern, &r->token_count);
+	if (!r->tokens) {
+		osc_mem_free(r);
+		return -1;
+	}
+	r->destinations = 1ULL << destination;
+
+	/* A trailing slash doesn't add a token, so "/" matches anything */
+	if (r->token_count && !r->tokens[r->token_count - 1][0])
+		osc_mem_free(r->tokens[--r->token_count]);
+
+	*relay->routes_endp = r;
+	relay->routes_endp = &r->next;
+	return 0;
+}
+
+int osc_relay_set_blocking(struct osc_relay *relay, bool blocking)
+{
+	return osc_socket_set_blocking(relay->fd, blocking);
+}
+
+static bool osc_route_match(struct osc_route *r, const char *address)
+{
+	const char *pos = address + 1;
+	char token[256];
+
+	for (size_t i = 0; i < r->token_count; i++) {
+		const char *end = strchrnul(pos, '/');
+
+		if ((size_t)(end - pos) >= sizeof(token))
+			return false;
+
+		memcpy(token, pos, end - pos);
+		token[end - pos] = '\0';
+
+		if (!osc_pattern_match(r->tokens[i], token))
+			return false;
+
+		if (!*end)
+			return i == r->token_count - 1;
+		pos = end + 1;
+	}
+
+	return true;
+}
+
+static uint64_t osc_relay_lookup(struct osc_relay *relay, const char *address)
+{
+	uint64_t rv = 0;
+
+	for (struct osc_route *r = relay->routes; r; r = r->next) {
+		if ((r->destinations & ~rv) && osc_route_match(r, address))
+			rv |= r->destinations;
+	}
+
+	return rv;
+}
+
+static bool osc_relay_is_bundle(const unsigned char *data, size_t len)
+{
+	return len >= 16 && !memcmp(data, "#bundle", 8);
+}
+
+/* Returns the destinations of all messages in a packet, or none if the
+ * packet is malformed. */
+static uint64_t osc_relay_route(struct osc_relay *relay,
+                                const unsigned char *data, size_t len)
+{
+	const char *address = osc_packet_address(data, len);
+
+	if (address)
+		return osc_relay_lookup(relay, address);
+
+	if (!osc_relay_is_bundle(data, len))
+		return 0;
+
+	uint64_t rv = 0;
+	for (size_t pos = 16; pos < len;) {
+		uint32_t size;
+
+		if (len - pos < 4)
+			return 0;
+		memcpy(&size, data + pos, 4);
+		size = ntohl(size);
+		pos += 4;
+
+		if (size > len - pos)
+			return 0;
+		rv |= osc_relay_route(relay, data + pos, size);
+		pos += size;
+	}
+
+	return rv;
+}
+
+/* Returns room for iov_count iovecs of a new outgoing datagram */
+static struct iovec *osc_relay_reserve(struct osc_relay *relay, size_t iov_count)
+{
+	if (relay->tx_count >= OSC_RELAY_MAX_TX
+	    || relay->iov_count + iov_count > OSC_RELAY_MAX_IOV)
+		osc_relay_flush(relay);
+
+	return &relay->tx_iov[relay->iov_count];
+}
+
+static void osc_relay_commit(struct osc_relay *relay, unsigned destination,
+                             size_t iov_count)
+{
+	struct osc_relay_destination *d = &relay->destinations[destination];
+	struct msghdr *hdr = &relay->tx_msg[relay->tx_count++].msg_hdr;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->msg_name = &d->addr;
+	hdr->msg_namelen = d->addrlen;
+	hdr->msg_iov = &relay->tx_iov[relay->iov_count];
+	hdr->msg_iovlen = iov_count;
+	relay->iov_count += iov_count;
+}
+
+static void osc_relay_forward(struct osc_relay *relay, uint64_t destinations,
+                              const unsigned char *data, size_t len)
+{
+	for (unsigned d = 0; destinations; d++, destinations >>= 1) {
+		if (!(destinations & 1))
+			continue;
+
+		struct iovec *iov = osc_relay_reserve(relay, 1);
+		iov->iov_base = (void*)data;
+		iov->iov_len = len;
+		osc_relay_commit(relay, d, 1);
+	}
+}
+
+/* Forward a bundle so that each destination receives the elements
+ * routed to it, under the original bundle header. */
+static void osc_relay_forward_bundle(struct osc_relay *relay,
+                                     const unsigned char *data, size_t len)
+{
+	struct osc_relay_element *elements = relay->elements;
+	uint64_t any = 0, all = ~0ULL;
+	size_t count = 0;
+
+	for (size_t pos = 16; pos < len; count++) {
+		uint32_t size;
+
+		if (len - pos < 4)
+			return;
+		memcpy(&size, data + pos, 4);
+		size = ntohl(size);
+
+		if (size > len - pos - 4)
+			return;
+
+		if (count >= OSC_RELAY_MAX_ELEMENTS) {
+			osc_relay_forward(relay, osc_relay_route(relay, data, len),
+			                  data, len);
+			return;
+		}
+
+		elements[count].data = data + pos;
+		elements[count].len = 4 + size;
+		elements[count].destinations = osc_relay_route(relay, data + pos + 4, size);
+		any |= elements[count].destinations;
+		all &= elements[count].destinations;
+		pos += 4 + size;
+	}
+
+	/* Destinations receiving every element get the original packet */
+	osc_relay_forward(relay, any & all, data, len);
+	any &= ~all;
+
+	for (unsigned d = 0; any; d++, any >>= 1) {
+		if (!(any & 1))
+			continue;
+
+		struct iovec *iov = osc_relay_reserve(relay, count + 1);
+		size_t iov_count = 1;
+
+		iov[0].iov_base = (void*)data;
+		iov[0].iov_len = 16;
+
+		for (size_t i = 0; i < count; i++) {
+			if (!(elements[i].destinations & (1ULL << d)))
+				continue;
+
+			struct iovec *last = &iov[iov_count - 1];
+			if ((unsigned char*)last->iov_base + last->iov_len == elements[i].data) {
+				last->iov_len += elements[i].len;
+				continue;
+			}
+
+			iov[iov_count].iov_base = (void*)elements[i].data;
+			iov[iov_count].iov_len = elements[i].len;
+			iov_count++;
+		}
+
+		osc_relay_commit(relay, d, iov_count);
+	}
+}
+
+/* Queue data for forwarding. The data is referenced, not copied, and
+ * has to stay valid until the next osc_relay_flush. */
+void osc_relay_process(struct osc_relay *relay, const void *data, size_t len)
+{
+	const char *address = osc_packet_address(data, len);
+
+	if (address) {
+		osc_relay_forward(relay, osc_relay_lookup(relay, address), data, len);
+		return;
+	}
+
+	if (osc_relay_is_bundle(data, len))
+		osc_relay_forward_bundle(relay, data, len);
+}
+
+int osc_relay_flush(struct osc_relay *relay)
+{
+	size_t done = 0;
+	int rv = 0;
+
+	while (done < relay->tx_count) {
+		int sent = sendmmsg(relay->fd, relay->tx_msg + done,
+		                    relay->tx_count - done, 0);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			rv = -1;
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+				break;
+			sent = 1; /* Skip the datagram which could not be sent */
+		}
+		done += sent;
+	}
+
+	relay->tx_count = 0;
+	relay->iov_count = 0;
+	return rv;
+}
+
+int osc_relay_run(struct osc_relay *relay)
+{
+	while (1) {
+		int count = recvmmsg(relay->fd, relay->rx_msg, OSC_RELAY_BATCH,
+		                     MSG_WAITFORONE, NULL);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+				return 0;
+			return 1;
+		}
+
+		for (int i = 0; i < count; i++) {
+			if (relay->rx_msg[i].msg_hdr.msg_flags & MSG_TRUNC)
+				continue;
+			osc_relay_process(relay, relay->rx_buf[i],
+			                  relay->rx_msg[i].msg_len);
+		}
+
+		osc_relay_flush(relay);
+	}
+}
+
+int osc_relay_fd(struct osc_relay *relay)
+{
+	return relay->fd;
+}
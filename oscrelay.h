@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef OSCRELAY_H
+#define OSCRELAY_H
+
+struct osc_relay;
+
+struct osc_relay *osc_relay_new(const char *node, const char *service,
+                                const struct addrinfo *hints);
+void osc_relay_free(struct osc_relay *relay);
+int osc_relay_add_destination(struct osc_relay *relay, const char *node,
+                              const char *service);
+int osc_relay_add_route(struct osc_relay *relay, const char *pattern,
+                        int destination);
+int osc_relay_set_blocking(struct osc_relay *relay, bool blocking);
+void osc_relay_process(struct osc_relay *relay, const void *data, size_t len);
+int osc_relay_flush(struct osc_relay *relay);
+int osc_relay_run(struct osc_relay *relay);
+int osc_relay_fd(struct osc_relay *relay);
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "oscring.h"
+#include "oscalloc.h"
+
+#define OSC_RING_ALIGN 8
+#define OSC_RING_HEADER OSC_RING_ALIGN
+#define OSC_RING_WRAP UINT32_MAX
+#define OSC_RING_RECORD(len) \
+	(OSC_RING_HEADER + (((len) + OSC_RING_ALIGN - 1) & ~(size_t)(OSC_RING_ALIGN - 1)))
+
+/* A lock-free ring of variable sized records for one producer and one
+ * consumer thread. Each record is its uint32 length followed by the
+ * data, a record which does not fit before the end of the buffer is
+ * preceded by a wrap marker. Positions grow without bound and are
+ * masked on access. Both sides keep a private position and a cached
+ * copy of the other side's, so the shared ones are only touched once
+ * per record and when the cache runs out. */
+struct osc_ring {
+	size_t size;
+	unsigned char *buf;
+	int fd;
+
+	/* Producer */
+	size_t tail __attribute__((aligned(64)));
+	size_t ptail;
+	size_t head_cache;
+	uint64_t written;
+
+	/* Consumer */
+	size_t head __attribute__((aligned(64)));
+	size_t chead;
+	size_t tail_cache;
+	uint64_t read;
+	int waiting;
+};
+
+/* Allocate a ring of at least size bytes, rounded up to a power of
+ * two. Records take 8 bytes in addition to their length. */
+struct osc_ring *osc_ring_new(size_t size)
+{
+	struct osc_ring *rv = osc_mem_alloc_aligned(64, sizeof(*rv));
+
+	if (!rv)
+		return NULL;
+	memset(rv, 0, sizeof(*rv));
+
+	rv->size = 64;
+	while (rv->size < size)
+		rv->size *= 2;
+
+	rv->buf = osc_mem_alloc(rv->size);
+	rv->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (!rv->buf || rv->fd < 0) {
+		osc_ring_free(rv);
+		return NULL;
+	}
+
+	return rv;
+}
+
+void osc_ring_free(struct osc_ring *ring)
+{
+	if (!ring)
+		return;
+
+	if (ring->fd >= 0)
+		close(ring->fd);
+	osc_mem_free(ring->buf);
+	osc_mem_free_aligned(ring);
+}
+
+/* Producer: get space for a record of up to len bytes, or NULL if the
+ * ring is too full. Nothing is visible to the consumer before
+ * osc_ring_commit. */
+void *osc_ring_reserve(struct osc_ring *ring, size_t len)
+{
+	size_t need = OSC_RING_RECORD(len);
+	size_t pos = ring->ptail & (ring->size - 1);
+	size_t skip = (ring->size - pos < need) ? ring->size - pos : 0;
+
+	if (len >= OSC_RING_WRAP)
+		return NULL;
+
+	if (ring->size - (ring->ptail - ring->head_cache) < skip + need) {
+		ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (ring->size - (ring->ptail - ring->head_cache) < skip + need)
+			return NULL;
+	}
+
+	if (skip) {
+		*(uint32_t*)(ring->buf + pos) = OSC_RING_WRAP;
+		ring->ptail += skip;
+		pos = 0;
+	}
+
+	return ring->buf + pos + OSC_RING_HEADER;
+}
+
+/* Producer: publish the last reserved record with its actual length,
+ * which must not exceed the reserved one */
+void osc_ring_commit(struct osc_ring *ring, size_t len)
+{
+	*(uint32_t*)(ring->buf + (ring->ptail & (ring->size - 1))) = len;
+	ring->ptail += OSC_RING_RECORD(len);
+
+	__atomic_store_n(&ring->tail, ring->ptail, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->written, ring->written + 1, __ATOMIC_RELAXED);
+}
+
+/* Producer: wake the consumer if it is waiting. Should be called after
+ * a batch of records has been committed. */
+void osc_ring_notify(struct osc_ring *ring)
+{
+	uint64_t one = 1;
+
+	if (__atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST)) {
+		if (write(ring->fd, &one, sizeof(one)) < 0) {
+			/* The counter is already set */
+		}
+	}
+}
+
+/* Consumer: the oldest record, or NULL if the ring is empty */
+const void *osc_ring_peek(struct osc_ring *ring, size_t *len)
+{
+	if (ring->chead == ring->tail_cache) {
+		ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (ring->chead == ring->tail_cache)
+			return NULL;
+	}
+
+	size_t pos = ring->chead & (ring->size - 1);
+	uint32_t rlen = *(uint32_t*)(ring->buf + pos);
+
+	if (rlen == OSC_RING_WRAP) {
+		ring->chead += ring->size - pos;
+		pos = 0;
+		rlen = *(uint32_t*)ring->buf;
+	}
+
+	*len = rlen;
+	return ring->buf + pos + OSC_RING_HEADER;
+}
+
+/* Consumer: release the record returned by osc_ring_peek */
+void osc_ring_consume(struct osc_ring *ring)
+{
+	uint32_t rlen = *(uint32_t*)(ring->buf + (ring->chead & (ring->size - 1)));
+
+	ring->chead += OSC_RING_RECORD(rlen);
+	__atomic_store_n(&ring->head, ring->chead, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->read, ring->read + 1, __ATOMIC_RELAXED);
+}
+
+/* Consumer: announce that it is going to wait for osc_ring_fd to
+ * become readable. Returns false if records arrived in the meantime
+ * and the ring should be read instead. */
+bool osc_ring_prepare_wait(struct osc_ring *ring)
+{
+	uint64_t count;
+
+	if (read(ring->fd, &count, sizeof(count)) < 0) {
+		/* Nothing was pending */
+	}
+
+	__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != ring->chead) {
+		__atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	return true;
+}
+
+/* Number of records in the ring, safe to call from any thread */
+size_t osc_ring_count(struct osc_ring *ring)
+{
+	uint64_t read = __atomic_load_n(&ring->read, __ATOMIC_RELAXED);
+	uint64_t written = __atomic_load_n(&ring->written, __ATOMIC_RELAXED);
+
+	return (written > read) ? written - read : 0;
+}
+
+int osc_ring_fd(struct osc_ring *ring)
+{
+	return ring->fd;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef OSCRING_H
+#define OSCRING_H
+
+struct osc_ring;
+
+struct osc_ring *osc_ring_new(size_t size);
+void osc_ring_free(struct osc_ring *ring);
+
+void *osc_ring_reserve(struct osc_ring *ring, size_t len);
+void osc_ring_commit(struct osc_ring *ring, size_t len);
+void osc_ring_notify(struct osc_ring *ring);
+
+const void *osc_ring_peek(struct osc_ring *ring, size_t *len);
+void osc_ring_consume(struct osc_ring *ring);
+bool osc_ring_prepare_wait(struct osc_ring *ring);
+
+size_t osc_ring_count(struct osc_ring *ring);
+int osc_ring_fd(struct osc_ring *ring);
+
+#endif
@@ -21,24 +21,486 @@
  */
 #include "cosc.h"
 #include "oscserver.h"
+#include "oscalloc.h"
+#include "oscconflate.h"
 #include "oscdispatcher.h"
+#include "oscfair.h"
+#include "oscfilter.h"
+#include "osciouring.h"
+#include "oscpacket.h"
 #include "oscparser.h"
+#include "oscpool.h"
+#include "oscring.h"
+#include "oscshed.h"
+#include "oscshm.h"
 #include "oscutils.h"
 
-struct osc_server {
+#define OSC_SERVER_BUFSIZE 8192
+#define OSC_SERVER_DATAGRAM_MAX 65536
+#define OSC_SERVER_BATCH_MAX 1024
+#define OSC_SERVER_EVENTS 16
+#define OSC_SERVER_URING_BUFS 256
+#define OSC_SERVER_CONTROL 128
+#define OSC_SERVER_CONFLATE_MAX 256
+
+/* Buffers to receive a batch of datagrams with a single recvmmsg */
+struct osc_rx {
+	unsigned size;
+	size_t buf_size;
+	unsigned char *buf;
+	struct iovec *iov;
+	struct sockaddr_storage *names;
+	unsigned char *control;
+	struct mmsghdr *msg;
+};
+
+/* A datagram queued by the receive thread of a pipeline, followed by
+ * its source address padded to 8 bytes and its data */
+struct osc_queued {
+	uint64_t rx_timestamp;
+	uint64_t enqueue_ns;
+	uint32_t len;
+	uint32_t src_len;
+	bool protect;
+	bool has_cred;
+	struct ucred cred;
+	unsigned char data[];
+};
+
+#define OSC_QUEUED_SRC_SPACE(len) (((len) + 7) & ~(size_t)7)
+
+struct osc_socket {
 	int fd;
+	bool ready;
+
+	/* SOCK_SEQPACKET sockets are listening for connections or
+	 * connected to a client, and closed when the client is gone. */
+	int family;
+	bool listening;
+	bool connection;
+
+	/* A shared memory ring, with a duplicate of its eventfd as fd. Busy
+	 * polled rings are never waited for and always marked ready. */
+	struct osc_shm *shm;
+	bool busy;
+
+	/* Last drop count reported by the kernel with SO_RXQ_OVFL */
+	uint32_t drops;
+};
+
+/* An event loop over one socket per listening address, with the state
+ * to receive from them. The first worker is run by osc_server_run
+ * until osc_server_start_workers runs each worker in its own thread.
+ * With a pipeline, the first worker is its receive thread. */
+struct osc_worker {
+	struct osc_server *server;
+	int epfd;
+	struct osc_socket *socks;
+	unsigned sock_count;
+
+	/* Sockets which had an event and may still hold data */
+	unsigned ready_count;
+	unsigned next_ready;
+	unsigned busy_count;
+
+	int cpu;
+	bool running;
+	pthread_t thread;
+	struct osc_rx rx;
+	struct osc_uring *uring;
+	struct osc_ring *ring;
+	struct osc_fair *fair;
+	struct osc_conflate *conflate;
+	struct osc_pool *pool;
+	struct osc_packet_pool *packets;
+	struct osc_server_stats stats;
+};
+
+/* Limits of a single osc_server_poll, none for osc_server_run */
+struct osc_budget {
+	unsigned packets;
+	uint64_t deadline;
+	bool charged;
+};
+
+static const struct osc_budget osc_budget_unlimited = {
+	.packets = UINT_MAX,
+	.deadline = UINT64_MAX,
+};
+
+/* Socket options set through the server, applied again to the sockets
+ * created by osc_server_add_listener and osc_server_start_workers */
+struct osc_sockopt {
+	int level;
+	int name;
+	int value;
+};
+
+struct osc_server {
 	bool blocking;
 	struct osc_dispatcher *dispatcher;
+	unsigned batch_size;
+
+	/* Larger datagrams are dropped. With GRO the receive buffers are
+	 * large enough for all datagrams coalesced by the kernel. */
+	size_t max_datagram;
+	bool gro;
+
+	struct osc_worker *workers;
+	unsigned worker_count;
+
+	struct osc_sockopt *sockopts;
+	unsigned sockopt_count;
+
+	/* Fair queueing of each worker, off if fair_quantum is 0 */
+	size_t fair_quantum;
+	size_t fair_queue_limit;
+	unsigned source_rate;
+	unsigned source_burst;
+
+	/* Addresses whose messages are conflated by each worker, or by
+	 * osc_server_run for a pipeline */
+	char **conflate_addresses;
+	unsigned conflate_count;
+
+	/* Counted by osc_server_run while a receive thread feeds it */
+	struct osc_server_stats dispatch_stats;
+
+	/* Shedding of packets queued by the receive thread of a pipeline */
+	struct osc_shed *shed;
+
+	/* Socket filter generated from the methods, attached to the UDP
+	 * sockets while kernel_filter is set, and until it is detached
+	 * again after being unset */
+	struct osc_filter *filter;
+	bool kernel_filter;
+	bool filter_attached;
+
+	/* Real-time mode, off if pool_size is 0 */
+	size_t pool_size;
+	int rt_priority;
+	uint64_t spin_ns;
+
+	const struct osc_allocator *allocator;
 };
 
+/* Some progress is made on any budget, however short its time */
+static bool osc_budget_spent(const struct osc_budget *b)
+{
+	if (!b->packets)
+		return true;
+	return b->charged && b->deadline != UINT64_MAX
+	       && osc_time_ns() >= b->deadline;
+}
+
+static void osc_budget_charge(struct osc_budget *b, unsigned packets)
+{
+	if (b->packets != UINT_MAX)
+		b->packets -= packets;
+	if (packets)
+		b->charged = true;
+}
+
+static void osc_rx_free(struct osc_rx *rx)
+{
+	osc_mem_free(rx->buf);
+	osc_mem_free(rx->iov);
+	osc_mem_free(rx->names);
+	osc_mem_free(rx->control);
+	osc_mem_free(rx->msg);
+	rx->size = 0;
+}
+
+static int osc_rx_init(struct osc_rx *rx, unsigned size, size_t buf_size)
+{
+	rx->buf = osc_mem_alloc((size_t)size * buf_size);
+	rx->iov = osc_mem_calloc(size, sizeof(*rx->iov));
+	rx->names = osc_mem_calloc(size, sizeof(*rx->names));
+	rx->control = osc_mem_alloc((size_t)size * OSC_SERVER_CONTROL);
+	rx->msg = osc_mem_calloc(size, sizeof(*rx->msg));
+	rx->size = size;
+	rx->buf_size = buf_size;
+
+	if (!rx->buf || !rx->iov || !rx->names || !rx->control || !rx->msg) {
+		osc_rx_free(rx);
+		return -1;
+	}
+
+	for (unsigned i = 0; i < size; i++) {
+		rx->iov[i].iov_base = rx->buf + (size_t)i * buf_size;
+		rx->iov[i].iov_len = buf_size;
+		rx->msg[i].msg_hdr.msg_iov = &rx->iov[i];
+		rx->msg[i].msg_hdr.msg_iovlen = 1;
+		rx->msg[i].msg_hdr.msg_name = &rx->names[i];
+		rx->msg[i].msg_hdr.msg_control = rx->control + (size_t)i * OSC_SERVER_CONTROL;
+	}
+
+	return 0;
+}
+
+static size_t osc_server_buf_size(const struct osc_server *server)
+{
+	return server->gro ? OSC_SERVER_DATAGRAM_MAX : server->max_datagram;
+}
+
+/* In real-time mode, a worker receives, parses and queues packets with
+ * memory from its pool only */
+static const struct osc_allocator *osc_worker_allocator(const struct osc_worker *w)
+{
+	return w->pool ? osc_pool_allocator(w->pool) : w->server->allocator;
+}
+
+static int osc_worker_configure_packets(struct osc_worker *w)
+{
+	OSC_ALLOCATOR_SCOPE(osc_worker_allocator(w));
+
+	if (w->packets)
+		return 0;
+
+	w->packets = osc_packet_pool_new(w->server->max_datagram);
+	return w->packets ? 0 : -1;
+}
+
+static int osc_worker_init(struct osc_worker *w, struct osc_server *server)
+{
+	w->server = server;
+	w->cpu = -1;
+	w->epfd = epoll_create1(0);
+	return (w->epfd < 0) ? -1 : 0;
+}
+
+static void osc_worker_close_fds(struct osc_worker *w)
+{
+	for (unsigned i = 0; i < w->sock_count; i++) {
+		if (w->socks[i].fd >= 0)
+			close(w->socks[i].fd);
+	}
+	osc_mem_free(w->socks);
+	w->socks = NULL;
+	w->sock_count = 0;
+	w->ready_count = 0;
+	w->next_ready = 0;
+	w->busy_count = 0;
+}
+
+static void osc_worker_free_queues(struct osc_worker *w)
+{
+	OSC_ALLOCATOR_SCOPE(osc_worker_allocator(w));
+
+	osc_fair_free(w->fair);
+	w->fair = NULL;
+	osc_conflate_free(w->conflate);
+	w->conflate = NULL;
+	osc_packet_pool_free(w->packets);
+	w->packets = NULL;
+}
+
+static void osc_worker_close(struct osc_worker *w)
+{
+	/* The ring holds references to the sockets */
+	osc_uring_free(w->uring);
+	w->uring = NULL;
+	osc_worker_free_queues(w);
+	osc_worker_close_fds(w);
+	osc_pool_free(w->pool);
+	w->pool = NULL;
+
+	if (w->epfd >= 0)
+		close(w->epfd);
+	w->epfd = -1;
+}
+
+/* Unix domain sockets only get socket level options, and credentials
+ * are only passed on them */
+static bool osc_sockopt_applies(const struct osc_socket *sock, int level,
+                                int name)
+{
+	if (sock->fd < 0 || sock->shm)
+		return false;
+	if (sock->family == AF_UNIX)
+		return level == SOL_SOCKET;
+	return level != SOL_SOCKET || name != SO_PASSCRED;
+}
+
+/* Sockets are drained completely on each edge triggered event. Returns
+ * the index of the socket, which takes the place of a closed one if
+ * there is any. */
+static int osc_worker_insert(struct osc_worker *w,
+                             const struct osc_socket *sock)
+{
+	unsigned idx;
+
+	for (idx = 0; idx < w->sock_count; idx++) {
+		if (w->socks[idx].fd < 0)
+			break;
+	}
+
+	if (idx == w->sock_count) {
+		struct osc_socket *socks = osc_mem_realloc(w->socks,
+		                                   (idx + 1) * sizeof(*socks));
+		if (!socks)
+			return -1;
+		w->socks = socks;
+	}
+
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLET,
+		.data.u32 = idx
+	};
+
+	if (osc_socket_set_blocking(sock->fd, false)
+	    || epoll_ctl(w->epfd, EPOLL_CTL_ADD, sock->fd, &ev))
+		return -1;
+
+	if (w->uring && !sock->shm && osc_uring_add_recv(w->uring, sock->fd))
+		return -1;
+
+	w->socks[idx] = *sock;
+	if (idx == w->sock_count)
+		w->sock_count++;
+	if (sock->ready)
+		w->ready_count++;
+	if (sock->busy)
+		w->busy_count++;
+	return idx;
+}
+
+static bool osc_socket_filterable(const struct osc_socket *sock)
+{
+	return sock->fd >= 0 && !sock->shm
+	       && (sock->family == AF_INET || sock->family == AF_INET6);
+}
+
+static int osc_worker_add_fd(struct osc_worker *w, int fd)
+{
+	struct osc_socket sock = {
+		.fd = fd
+	};
+	socklen_t len = sizeof(sock.family);
+	if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &sock.family, &len))
+		return -1;
+
+	for (unsigned i = 0; i < w->server->sockopt_count; i++) {
+		struct osc_sockopt *o = &w->server->sockopts[i];
+
+		if (osc_sockopt_applies(&sock, o->level, o->name)
+		    && setsockopt(fd, o->level, o->name, &o->value, sizeof(o->value)))
+			return -1;
+	}
+
+	if (w->server->kernel_filter && osc_socket_filterable(&sock)
+	    && osc_filter_attach(w->server->filter, fd))
+		return -1;
+
+	return osc_worker_insert(w, &sock);
+}
+
+/* A busy polled ring starts out ready and stays so */
+static int osc_worker_add_shm(struct osc_worker *w, struct osc_shm *shm,
+                              bool busy)
+{
+	struct osc_socket sock = {
+		.fd = fcntl(osc_shm_event_fd(shm), F_DUPFD_CLOEXEC, 0),
+		.shm = shm,
+		.busy = busy,
+		.ready = busy,
+	};
+
+	if (sock.fd < 0)
+		return -1;
+
+	int idx = osc_worker_insert(w, &sock);
+	if (idx < 0)
+		close(sock.fd);
+	return idx;
+}
+
+/* Close a connection or ring, leaving its place to the next one */
+static void osc_worker_close_fd(struct osc_worker *w, unsigned idx)
+{
+	struct osc_socket *sock = &w->socks[idx];
+
+	/* The ring keeps its eventfd open */
+	if (sock->shm)
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, sock->fd, NULL);
+	close(sock->fd);
+	sock->fd = -1;
+	sock->shm = NULL;
+	if (sock->ready) {
+		sock->ready = false;
+		w->ready_count--;
+	}
+	if (sock->busy) {
+		sock->busy = false;
+		w->busy_count--;
+	}
+}
+
 struct osc_server *osc_server_new(const char *node, const char *service,
                                   const struct addrinfo *hints)
 {
+	struct osc_server *rv = osc_mem_calloc(sizeof(*rv), 1);
+
+	rv->allocator = osc_allocator_current();
+	rv->workers = osc_mem_calloc(1, sizeof(*rv->workers));
+	rv->worker_count = 1;
+	rv->blocking = true;
+	rv->batch_size = 1;
+	rv->max_datagram = OSC_SERVER_BUFSIZE;
+	rv->dispatcher = osc_dispatcher_new();
+	rv->shed = osc_shed_new();
+
+	if (!rv->shed || osc_worker_init(&rv->workers[0], rv)
+	    || osc_rx_init(&rv->workers[0].rx, 1, OSC_SERVER_BUFSIZE)
+	    || osc_worker_configure_packets(&rv->workers[0])
+	    || osc_server_add_listener(rv, node, service, hints)) {
+		osc_server_free(rv);
+		return NULL;
+	}
+
+	return rv;
+}
+
+void osc_server_free(struct osc_server *server)
+{
+	if (!server)
+		return;
+
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	osc_server_stop_pipeline(server);
+	osc_server_stop_workers(server);
+	osc_worker_close(&server->workers[0]);
+	osc_rx_free(&server->workers[0].rx);
+	osc_mem_free(server->workers);
+	osc_mem_free(server->sockopts);
+	for (unsigned i = 0; i < server->conflate_count; i++)
+		osc_mem_free(server->conflate_addresses[i]);
+	osc_mem_free(server->conflate_addresses);
+	osc_dispatcher_free(server->dispatcher);
+	osc_shed_free(server->shed);
+	osc_filter_free(server->filter);
+	osc_mem_free(server);
+}
+
+/* Bind to every address node/service resolves to, e.g. to both the IPv4
+ * and the IPv6 wildcard address. May be called to serve further
+ * addresses and ports, as long as no worker threads are running. */
+int osc_server_add_listener(struct osc_server *server, const char *node,
+                            const char *service, const struct addrinfo *hints)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
 	struct addrinfo ai = {
 		.ai_flags = AI_V4MAPPED | AI_ADDRCONFIG,
 		.ai_family = AF_UNSPEC,
 	};
 
+	if (server->worker_count > 1 || server->workers[0].running) {
+		errno = EBUSY;
+		return -1;
+	}
+
 	if (hints)
 		memcpy(&ai, hints, sizeof(ai));
 
@@ -47,91 +509,2238 @@ struct osc_server *osc_server_new(const char *node, const char *service,
 
 	struct addrinfo *res, *rp;
 	if (getaddrinfo(node, service, &ai, &res))
-		return NULL;
+		return -1;
 
-	int fd;
+	/* IPv6 sockets must leave IPv4 to the IPv4 sockets */
+	bool have_ipv4 = false;
+	for (rp = res; rp; rp = rp->ai_next) {
+		if (rp->ai_family == AF_INET)
+			have_ipv4 = true;
+	}
+
+	unsigned bound = 0;
 	for (rp = res; rp; rp = rp->ai_next) {
-		fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		int fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
 
 		if (fd < 0)
 			continue;
 
 		int on = 1;
 		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (rp->ai_family == AF_INET6 && have_ipv4)
+			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
 
-		if (bind(fd, rp->ai_addr, rp->ai_addrlen) != 0) {
+		if (bind(fd, rp->ai_addr, rp->ai_addrlen) != 0
+		    || osc_worker_add_fd(&server->workers[0], fd) < 0) {
 			close(fd);
 			continue;
 		}
 
-		break;
+		bound++;
 	}
 
 	freeaddrinfo(res);
+	return bound ? 0 : -1;
+}
 
-	if (!rp)
-		return NULL;
+/* Bind to a Unix domain socket at path, or in the abstract namespace
+ * if path starts with '@'. type is SOCK_DGRAM, or SOCK_SEQPACKET to
+ * accept connections, each of which is served like a datagram socket.
+ * Connections are not served through io_uring. */
+int osc_server_add_unix_listener(struct osc_server *server, const char *path,
+                                 int type)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
 
-	struct osc_server *rv = calloc(sizeof(*rv), 1);
+	struct osc_worker *w = &server->workers[0];
+	struct sockaddr_un sun;
+	socklen_t len = osc_unix_addr(&sun, path);
 
-	rv->fd = fd;
-	rv->blocking = true;
-	rv->dispatcher = osc_dispatcher_new();
+	if (server->worker_count > 1 || w->running) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (type != SOCK_DGRAM && (type != SOCK_SEQPACKET || w->uring)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!len)
+		return -1;
+
+	int fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (bind(fd, (struct sockaddr*)&sun, len)
+	    || (type == SOCK_SEQPACKET && listen(fd, SOMAXCONN))) {
+		close(fd);
+		return -1;
+	}
+
+	int idx = osc_worker_add_fd(w, fd);
+	if (idx < 0) {
+		close(fd);
+		return -1;
+	}
+
+	w->socks[idx].listening = (type == SOCK_SEQPACKET);
+	return 0;
+}
+
+/* Consume packets from a shared memory ring, which must outlive the
+ * server or be removed first. Packets are dispatched from the shared
+ * memory itself. With busy_poll, the ring is checked on every round
+ * instead of being waited for, so producers never have to wake the
+ * server. osc_server_run then does not block but spins. A ring whose
+ * producers wrote a record past its end is removed and counted in
+ * shm_corrupt. */
+int osc_server_add_shm(struct osc_server *server, struct osc_shm *shm,
+                       bool busy_poll)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	struct osc_worker *w = &server->workers[0];
+
+	if (server->worker_count > 1 || w->running) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (w->uring) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return (osc_worker_add_shm(w, shm, busy_poll) < 0) ? -1 : 0;
+}
+
+int osc_server_remove_shm(struct osc_server *server, struct osc_shm *shm)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	struct osc_worker *w = &server->workers[0];
+
+	if (server->worker_count > 1 || w->running) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	for (unsigned i = 0; i < w->sock_count; i++) {
+		if (w->socks[i].shm == shm) {
+			osc_worker_close_fd(w, i);
+			return 0;
+		}
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+/* Attach the socket filter, generated again, to all UDP sockets, or
+ * remove it. Without a filter, which does not fit, everything is let
+ * through. */
+static int osc_server_update_filter(struct osc_server *server)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	int rv = 0;
+
+	if (!server->kernel_filter && !server->filter_attached)
+		return 0;
+
+	if (server->kernel_filter) {
+		size_t count = osc_dispatcher_roots(server->dispatcher, NULL, 0);
+		const char **roots = osc_mem_calloc(count + 1, sizeof(*roots));
+
+		if (!roots)
+			return -1;
+
+		osc_dispatcher_roots(server->dispatcher, roots, count);
+		rv = osc_filter_build(server->filter, roots, count);
+		osc_mem_free(roots);
+	}
+
+	for (unsigned i = 0; i < server->worker_count; i++) {
+		struct osc_worker *w = &server->workers[i];
+
+		for (unsigned j = 0; j < w->sock_count; j++) {
+			if (osc_socket_filterable(&w->socks[j])
+			    && osc_filter_attach(server->kernel_filter ? server->filter : NULL,
+			                         w->socks[j].fd))
+				rv = -1;
+		}
+	}
+
+	/* Sockets failing to detach are tried again next time */
+	server->filter_attached = server->kernel_filter || rv;
 	return rv;
 }
 
-void osc_server_add_method(struct osc_server *server, const char *address,
-                           osc_method callback, void *arg)
+/* Methods are dispatched from worker threads without locking, so they
+ * have to be added before osc_server_start_workers. Fails with EBUSY
+ * while workers run. */
+int osc_server_add_method(struct osc_server *server, const char *address,
+                          osc_method callback, void *arg)
 {
+	struct osc_worker *w = &server->workers[0];
+
+	if (server->worker_count > 1 || (w->running && !w->ring)) {
+		errno = EBUSY;
+		return -1;
+	}
+
 	osc_dispatcher_add_method(server->dispatcher, address, callback, arg);
+	osc_server_update_filter(server);
+	return 0;
 }
 
-int osc_server_set_blocking(struct osc_server *server, bool blocking)
+/* Add a method which is also told where and when the packet was
+ * received and when its dispatch started. The receive time is only
+ * known with timestamping enabled. */
+int osc_server_add_method_info(struct osc_server *server, const char *address,
+                               osc_method_info callback, void *arg)
 {
-	int flags = fcntl(server->fd, F_GETFL);
+	struct osc_worker *w = &server->workers[0];
 
-	if (flags < 0)
+	if (server->worker_count > 1 || (w->running && !w->ring)) {
+		errno = EBUSY;
 		return -1;
+	}
 
-	if (blocking)
-		flags &= ~(O_NONBLOCK);
-	else
-		flags |= O_NONBLOCK;
+	osc_dispatcher_add_method_info(server->dispatcher, address, callback, arg);
+	osc_server_update_filter(server);
+	return 0;
+}
+
+/* Drop packets in the kernel, before they are copied to the server,
+ * unless their address starts with the first part of the address of a
+ * method, e.g. /foo/ for a method /foo/bar, or they are bundles. Meant
+ * for shared ports, on which most packets are for others. The filter
+ * is generated again when methods are added. Messages addressed with
+ * a pattern in their first part are let through. Applies to UDP
+ * sockets, with GRO only to the first datagram of those coalesced. */
+int osc_server_set_kernel_filter(struct osc_server *server, bool enable)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	if (enable && !server->filter) {
+		server->filter = osc_filter_new();
+		if (!server->filter)
+			return -1;
+	}
+
+	server->kernel_filter = enable;
+	return osc_server_update_filter(server);
+}
+
+/* With the kernel filter, only let through packets from the numeric
+ * address node, or from its network of the first prefix bits. Further
+ * sources add to the ones allowed. */
+int osc_server_allow_source(struct osc_server *server, const char *node,
+                            unsigned prefix)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
 
-	if (fcntl(server->fd, F_SETFL, flags) < 0)
+	struct addrinfo ai = {
+		.ai_flags = AI_NUMERICHOST,
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_DGRAM,
+	};
+	struct addrinfo *res;
+
+	if (!server->filter) {
+		server->filter = osc_filter_new();
+		if (!server->filter)
+			return -1;
+	}
+
+	if (getaddrinfo(node, NULL, &ai, &res)) {
+		errno = EINVAL;
 		return -1;
+	}
 
-	return 0;
+	int rv = osc_filter_allow_source(server->filter, res->ai_addr, prefix);
+	freeaddrinfo(res);
+	if (rv)
+		return -1;
+
+	return osc_server_update_filter(server);
 }
 
-int osc_server_run(struct osc_server *server)
+/* Join the multicast group given as numeric address on the interface
+ * ifname, or on the interface chosen by the routing table if NULL. */
+int osc_server_join_group(struct osc_server *server, const char *group,
+                          const char *ifname)
 {
-	while (1) {
-		char buf[8192];
-		ssize_t bytes = recvfrom(server->fd, buf, sizeof(buf), 0, NULL, NULL);
-		if (bytes < 0) {
-			if (errno == EINTR)
+	struct addrinfo ai = {
+		.ai_flags = AI_NUMERICHOST,
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_DGRAM,
+	};
+	struct addrinfo *res;
+	struct group_req req = {};
+
+	if (ifname) {
+		req.gr_interface = if_nametoindex(ifname);
+		if (!req.gr_interface)
+			return -1;
+	}
+
+	if (getaddrinfo(group, NULL, &ai, &res)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(&req.gr_group, res->ai_addr, res->ai_addrlen);
+	int family = res->ai_family;
+	int level = (family == AF_INET6) ? IPPROTO_IPV6 : IPPROTO_IP;
+	freeaddrinfo(res);
+
+	/* Join on every socket which can receive the group's family */
+	unsigned joined = 0;
+	for (unsigned i = 0; i < server->worker_count; i++) {
+		struct osc_worker *w = &server->workers[i];
+
+		for (unsigned j = 0; j < w->sock_count; j++) {
+			struct sockaddr_storage ss;
+			socklen_t len = sizeof(ss);
+			int v6only = 0;
+			socklen_t optlen = sizeof(v6only);
+
+			if (!osc_sockopt_applies(&w->socks[j], level,
+			                         MCAST_JOIN_GROUP))
 				continue;
-			if (errno == EWOULDBLOCK || errno == EAGAIN)
-				return 0;
-			return 1;
-		}
+			if (getsockname(w->socks[j].fd, (struct sockaddr*)&ss, &len))
+				return -1;
+			if (ss.ss_family == AF_INET6)
+				getsockopt(w->socks[j].fd, IPPROTO_IPV6, IPV6_V6ONLY,
+				           &v6only, &optlen);
 
-		char *log;
-		struct osc_element *e = osc_parse_packet(buf, bytes, &log);
-		if (!e) {
-			fprintf(stderr, "Could not parse packet:<parser>\n%s<endparser>\n", log);
-			free(log);
-			continue;
+			if (ss.ss_family != family
+			    && (family != AF_INET || v6only))
+				continue;
+
+			if (setsockopt(w->socks[j].fd, level, MCAST_JOIN_GROUP,
+			               &req, sizeof(req)))
+				return -1;
+			joined++;
+		}
+	}
+
+	if (!joined) {
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Buffer sizes are read back doubled, the forced ones like the others */
+static int osc_sockopt_get(int fd, int level, int name, int *value)
+{
+	socklen_t len = sizeof(*value);
+
+	if (level == SOL_SOCKET && (name == SO_RCVBUF || name == SO_RCVBUFFORCE
+	                            || name == SO_SNDBUF || name == SO_SNDBUFFORCE)) {
+		name = (name == SO_RCVBUF || name == SO_RCVBUFFORCE) ? SO_RCVBUF
+		                                                      : SO_SNDBUF;
+		if (getsockopt(fd, level, name, value, &len))
+			return -1;
+		*value /= 2;
+		return 0;
+	}
+
+	return getsockopt(fd, level, name, value, &len);
+}
+
+/* Try an option on a socket of the kind it applies to, so one the
+ * kernel rejects is not left for osc_server_add_listener to fail on */
+static int osc_sockopt_probe(int level, int name, int value)
+{
+	int family = AF_INET;
+
+	if (level == SOL_SOCKET && name == SO_PASSCRED)
+		family = AF_UNIX;
+	else if (level == IPPROTO_IPV6)
+		family = AF_INET6;
+
+	int fd = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	int rv = setsockopt(fd, level, name, &value, sizeof(value));
+	int err = errno;
+	close(fd);
+	errno = err;
+	return rv;
+}
+
+/* Set the option back to the values before on the first count sockets
+ * it applies to */
+static void osc_server_restore_sockopt(struct osc_server *server, int level,
+                                       int name, const int *prev,
+                                       unsigned count)
+{
+	unsigned k = 0;
+
+	for (unsigned i = 0; i < server->worker_count; i++) {
+		struct osc_worker *w = &server->workers[i];
+
+		for (unsigned j = 0; j < w->sock_count && k < count; j++) {
+			if (osc_sockopt_applies(&w->socks[j], level, name)) {
+				setsockopt(w->socks[j].fd, level, name,
+				           &prev[k], sizeof(prev[k]));
+				k++;
+			}
+		}
+	}
+}
+
+/* Set an integer socket option on every socket of the server and on
+ * the ones created later on. E.g. SO_BUSY_POLL to busy poll the
+ * device queue for a number of microseconds before sleeping. If a
+ * socket rejects it, the others are set back and nothing is stored.
+ * Without sockets it applies to, it is tried on a temporary one. */
+int osc_server_set_sockopt(struct osc_server *server, int level, int name,
+                           int value)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	/* Room for the option is made first, so it is stored once set */
+	unsigned opt;
+	for (opt = 0; opt < server->sockopt_count; opt++) {
+		if (server->sockopts[opt].level == level
+		    && server->sockopts[opt].name == name)
+			break;
+	}
+
+	if (opt == server->sockopt_count) {
+		struct osc_sockopt *sockopts = osc_mem_realloc(server->sockopts,
+		                                       (opt + 1) * sizeof(*sockopts));
+		if (!sockopts)
+			return -1;
+		server->sockopts = sockopts;
+	}
+
+	unsigned count = 0;
+	for (unsigned i = 0; i < server->worker_count; i++)
+		count += server->workers[i].sock_count;
+
+	int *prev = osc_mem_calloc(count + 1, sizeof(*prev));
+	if (!prev)
+		return -1;
+
+	unsigned applied = 0;
+	for (unsigned i = 0; i < server->worker_count; i++) {
+		struct osc_worker *w = &server->workers[i];
+
+		for (unsigned j = 0; j < w->sock_count; j++) {
+			int fd = w->socks[j].fd;
+
+			if (!osc_sockopt_applies(&w->socks[j], level, name))
+				continue;
+
+			if (osc_sockopt_get(fd, level, name, &prev[applied])
+			    || setsockopt(fd, level, name, &value, sizeof(value))) {
+				int err = errno;
+				osc_server_restore_sockopt(server, level, name,
+				                           prev, applied);
+				osc_mem_free(prev);
+				errno = err;
+				return -1;
+			}
+			applied++;
+		}
+	}
+	osc_mem_free(prev);
+
+	if (!applied && osc_sockopt_probe(level, name, value))
+		return -1;
+
+	if (opt == server->sockopt_count)
+		server->sockopt_count++;
+	server->sockopts[opt] = (struct osc_sockopt) {
+		.level = level,
+		.name = name,
+		.value = value
+	};
+	return 0;
+}
+
+/* Set the size of the socket receive buffers in bytes. Beyond the
+ * net.core.rmem_max limit if the process has CAP_NET_ADMIN. */
+int osc_server_set_rcvbuf(struct osc_server *server, int size)
+{
+	if (!osc_server_set_sockopt(server, SOL_SOCKET, SO_RCVBUFFORCE, size))
+		return 0;
+	if (errno != EPERM)
+		return -1;
+	return osc_server_set_sockopt(server, SOL_SOCKET, SO_RCVBUF, size);
+}
+
+/* Have the kernel report how many datagrams it dropped, e.g. because
+ * the receive buffer was full, and count them in the statistics. The
+ * counts arrive with the next datagram received after a drop. */
+int osc_server_set_drop_counting(struct osc_server *server, bool enable)
+{
+	return osc_server_set_sockopt(server, SOL_SOCKET, SO_RXQ_OVFL, enable);
+}
+
+/* Have the kernel pass the process, user and group id of the sender
+ * along with datagrams received on Unix domain sockets. Methods added
+ * with osc_server_add_method_info get them as cred of the info,
+ * except with fair queueing. */
+int osc_server_set_credentials(struct osc_server *server, bool enable)
+{
+	return osc_server_set_sockopt(server, SOL_SOCKET, SO_PASSCRED, enable);
+}
+
+/* Have the kernel timestamp datagrams on arrival, or with hardware
+ * timestamps where the network interface has them enabled. Hardware
+ * timestamps are taken from the interface's clock, which need not be
+ * synchronized to the system clock. */
+int osc_server_set_timestamping(struct osc_server *server,
+                                enum osc_timestamping mode)
+{
+	int flags = 0;
+
+	if (mode == OSC_TIMESTAMP_HARDWARE)
+		flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE
+		        | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+	if (osc_server_set_sockopt(server, SOL_SOCKET, SO_TIMESTAMPING, flags))
+		return -1;
+	return osc_server_set_sockopt(server, SOL_SOCKET, SO_TIMESTAMPNS,
+	                              mode == OSC_TIMESTAMP_SOFTWARE);
+}
+
+/* In non-blocking mode, osc_server_run returns once all sockets have
+ * been drained. The sockets themselves are always non-blocking. */
+int osc_server_set_blocking(struct osc_server *server, bool blocking)
+{
+	server->blocking = blocking;
+	return 0;
+}
+
+static int osc_server_resize_rx(struct osc_server *server, unsigned size,
+                                size_t buf_size)
+{
+	struct osc_rx rx;
+
+	if (osc_rx_init(&rx, size, buf_size))
+		return -1;
+
+	osc_rx_free(&server->workers[0].rx);
+	server->workers[0].rx = rx;
+	return 0;
+}
+
+/* Receive up to size datagrams per system call */
+int osc_server_set_batch_size(struct osc_server *server, unsigned size)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	if (!size || size > OSC_SERVER_BATCH_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (server->workers[0].running) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (osc_server_resize_rx(server, size, osc_server_buf_size(server)))
+		return -1;
+
+	server->batch_size = size;
+	return 0;
+}
+
+/* Receive datagrams of up to size bytes, at most 64 KiB. Larger ones
+ * are dropped and counted as truncated instead of being parsed in
+ * part. Each slot of a receive batch takes a buffer of this size. */
+int osc_server_set_max_datagram(struct osc_server *server, size_t size)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	if (!size || size > OSC_SERVER_DATAGRAM_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (server->worker_count > 1 || server->workers[0].running
+	    || server->workers[0].uring) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (!server->gro && osc_server_resize_rx(server, server->batch_size, size))
+		return -1;
+
+	server->max_datagram = size;
+	return 0;
+}
+
+/* Let the kernel coalesce bursts of same-size UDP datagrams from one
+ * sender into one receive, which the server splits up again. Saves the
+ * per datagram cost of the receive path at high rates, at the price of
+ * 64 KiB receive buffers per slot of a batch. */
+int osc_server_set_gro(struct osc_server *server, bool enable)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	if (server->worker_count > 1 || server->workers[0].running
+	    || server->workers[0].uring) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/* The buffers grow before and shrink after the kernel coalesces */
+	if (enable) {
+		if (osc_server_resize_rx(server, server->batch_size,
+		                         OSC_SERVER_DATAGRAM_MAX))
+			return -1;
+		if (osc_server_set_sockopt(server, SOL_UDP, UDP_GRO, 1)) {
+			osc_server_resize_rx(server, server->batch_size,
+			                     osc_server_buf_size(server));
+			return -1;
+		}
+	} else {
+		if (osc_server_set_sockopt(server, SOL_UDP, UDP_GRO, 0))
+			return -1;
+		if (server->gro)
+			osc_server_resize_rx(server, server->batch_size,
+			                     server->max_datagram);
+	}
+
+	server->gro = enable;
+	return 0;
+}
+
+/* Parse into a packet of the worker, which methods can keep a
+ * reference to instead of copying what they need. The datagram is
+ * parsed where it was received, shared memory included, and only
+ * copied to the packet's buffer if a method keeps it. */
+static void osc_server_dispatch(struct osc_worker *w,
+                                struct osc_server_stats *stats,
+                                const struct osc_server_datagram *dg)
+{
+	char *log;
+	struct osc_packet *p = osc_packet_parse(w->packets, dg->data, dg->len,
+	                                        &log);
+	if (!p) {
+		stats->parse_errors++;
+		fprintf(stderr, "Could not parse packet:<parser>\n%s<endparser>\n",
+		        log ? log : "");
+		osc_mem_free(log);
+		return;
+	}
+
+	osc_mem_free(log);
+
+	struct osc_dispatch_info info = {
+		.src_addr = dg->src_addr,
+		.cred = dg->cred,
+		.rx_timestamp = dg->rx_timestamp,
+		.dispatch_timestamp = osc_realtime_ns(),
+		.packet = p,
+	};
+	osc_dispatcher_process_info(w->server->dispatcher,
+	                            (struct osc_element*)osc_packet_element(p),
+	                            &info);
+	osc_packet_pool_put(w->packets, p);
+}
+
+/* The checks done by the receive thread of a pipeline, cheap enough to
+ * not slow it down. Anything else is up to the parser. */
+static bool osc_packet_plausible(const unsigned char *data, size_t len)
+{
+	if (!len || len % 4)
+		return false;
+	if (data[0] == '/')
+		return true;
+	return len >= 16 && !memcmp(data, "#bundle", 8);
+}
+
+static socklen_t osc_sockaddr_len(const struct sockaddr *sa)
+{
+	if (!sa)
+		return 0;
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		return sizeof(struct sockaddr_in);
+	case AF_INET6:
+		return sizeof(struct sockaddr_in6);
+	case AF_UNIX:
+		return sizeof(struct sockaddr_un);
+	default:
+		return sizeof(sa->sa_family);
+	}
+}
+
+static void osc_worker_enqueue(struct osc_worker *w,
+                               const struct osc_server_datagram *dg)
+{
+	if (!osc_packet_plausible(dg->data, dg->len)) {
+		w->stats.parse_errors++;
+		return;
+	}
+
+	bool protect = osc_shed_protected(w->server->shed, dg->data, dg->len);
+	if (!protect && !osc_shed_admit(w->server->shed, osc_ring_count(w->ring))) {
+		w->stats.shed_newest++;
+		return;
+	}
+
+	socklen_t src_len = osc_sockaddr_len(dg->src_addr);
+	size_t src_space = OSC_QUEUED_SRC_SPACE(src_len);
+	size_t record_len = sizeof(struct osc_queued) + src_space + dg->len;
+
+	struct osc_queued *q = osc_ring_reserve(w->ring, record_len);
+	if (!q) {
+		w->stats.ring_overflows++;
+		return;
+	}
+
+	q->rx_timestamp = dg->rx_timestamp;
+	q->enqueue_ns = osc_time_ns();
+	q->len = dg->len;
+	q->protect = protect;
+	q->src_len = src_len;
+	q->has_cred = (dg->cred != NULL);
+	if (dg->cred)
+		q->cred = *dg->cred;
+	memcpy(q->data, dg->src_addr, src_len);
+	memcpy(q->data + src_space, dg->data, dg->len);
+	osc_ring_commit(w->ring, record_len);
+
+	uint64_t occupancy = osc_ring_count(w->ring);
+	if (occupancy > w->stats.ring_max_occupancy)
+		w->stats.ring_max_occupancy = occupancy;
+}
+
+static uint64_t osc_timespec_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/* Account for what the kernel reported along with a datagram and take
+ * its receive timestamp. Returns the size of the datagrams coalesced
+ * into it by GRO, or 0 if it is a single one. */
+static size_t osc_worker_control(struct osc_worker *w, struct osc_socket *sock,
+                                 struct msghdr *msg,
+                                 struct osc_server_datagram *dg)
+{
+	struct cmsghdr *c;
+	size_t segment = 0;
+
+	/* Unix domain addresses are as long as their path, clear what is
+	 * left behind them from earlier ones so they compare equal */
+	if (sock->family == AF_UNIX && msg->msg_namelen
+	    && msg->msg_namelen < sizeof(struct sockaddr_un))
+		memset((char*)msg->msg_name + msg->msg_namelen, 0,
+		       sizeof(struct sockaddr_un) - msg->msg_namelen);
+
+	for (c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+		if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+			int size;
+
+			memcpy(&size, CMSG_DATA(c), sizeof(size));
+			if (size > 0)
+				segment = size;
+			continue;
+		}
+
+		if (c->cmsg_level != SOL_SOCKET)
+			continue;
+
+		if (c->cmsg_type == SO_RXQ_OVFL) {
+			uint32_t drops;
+
+			/* The counter wraps around */
+			memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+			w->stats.kernel_drops += (uint32_t)(drops - sock->drops);
+			sock->drops = drops;
+		} else if (c->cmsg_type == SCM_CREDENTIALS) {
+			dg->cred = (const struct ucred*)CMSG_DATA(c);
+		} else if (c->cmsg_type == SCM_TIMESTAMPNS) {
+			struct timespec ts;
+
+			memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+			dg->rx_timestamp = osc_timespec_ns(&ts);
+		} else if (c->cmsg_type == SCM_TIMESTAMPING) {
+			/* Software, deprecated and raw hardware timestamp */
+			struct timespec ts[3];
+
+			memcpy(ts, CMSG_DATA(c), sizeof(ts));
+			if (ts[2].tv_sec || ts[2].tv_nsec)
+				dg->rx_timestamp = osc_timespec_ns(&ts[2]);
+			else
+				dg->rx_timestamp = osc_timespec_ns(&ts[0]);
+		}
+	}
+
+	return segment;
+}
+
+static void osc_worker_queue_fair(struct osc_worker *w,
+                                  const struct osc_server_datagram *dg)
+{
+	if (!osc_fair_enqueue(w->fair, dg->src_addr, dg->data, dg->len,
+	                      dg->rx_timestamp))
+		return;
+
+	if (errno == EAGAIN)
+		w->stats.source_rate_drops++;
+	else
+		w->stats.source_queue_drops++;
+}
+
+/* Queue a packet for osc_server_dispatch_conflated, replacing an older
+ * message to the same address if it is conflatable */
+static void osc_server_conflate(struct osc_worker *w,
+                                struct osc_server_stats *stats,
+                                const struct osc_server_datagram *dg)
+{
+	int rv = osc_conflate_enqueue(w->conflate, dg->src_addr, dg->cred, dg->data,
+	                              dg->len, dg->rx_timestamp);
+
+	if (rv > 0)
+		stats->conflated++;
+	else if (rv < 0)
+		osc_server_dispatch(w, stats, dg);
+}
+
+static bool osc_server_dispatch_conflated(struct osc_worker *w,
+                                          struct osc_server_stats *stats)
+{
+	struct osc_conflate_packet *p = osc_conflate_dequeue(w->conflate);
+
+	if (!p)
+		return false;
+
+	struct osc_server_datagram dg = {
+		.data = p->data,
+		.len = p->len,
+		.src_addr = p->src_addr,
+		.cred = p->cred,
+		.rx_timestamp = p->rx_timestamp,
+	};
+
+	osc_server_dispatch(w, stats, &dg);
+	osc_conflate_release(w->conflate, p);
+	return true;
+}
+
+/* Dispatch what was left of a batch after conflation */
+static void osc_worker_dispatch_conflated(struct osc_worker *w)
+{
+	while (osc_server_dispatch_conflated(w, &w->stats))
+		;
+}
+
+static void osc_server_process(struct osc_worker *w,
+                               const struct osc_server_datagram *dg)
+{
+	w->stats.packets++;
+	w->stats.bytes += dg->len;
+
+	if (w->ring)
+		osc_worker_enqueue(w, dg);
+	else if (w->fair)
+		osc_worker_queue_fair(w, dg);
+	else if (w->conflate)
+		osc_server_conflate(w, &w->stats, dg);
+	else
+		osc_server_dispatch(w, &w->stats, dg);
+}
+
+/* Process a received datagram, or each of those coalesced into it.
+ * Returns the number of datagrams. */
+static unsigned osc_worker_receive(struct osc_worker *w,
+                                   struct osc_socket *sock,
+                                   struct msghdr *msg,
+                                   struct osc_server_datagram *dg)
+{
+	size_t segment = osc_worker_control(w, sock, msg, dg);
+	const unsigned char *data = dg->data;
+	size_t left = dg->len;
+	unsigned count = 0;
+
+	/* Parsing what fit into the buffer would give garbage */
+	if (msg->msg_flags & MSG_TRUNC) {
+		w->stats.truncated++;
+		return 1;
+	}
+
+	if (!segment)
+		segment = dg->len;
+
+	do {
+		struct osc_server_datagram seg = *dg;
+
+		seg.data = data;
+		seg.len = (left < segment) ? left : segment;
+		if (seg.len > w->server->max_datagram)
+			w->stats.truncated++;
+		else
+			osc_server_process(w, &seg);
+
+		data += seg.len;
+		left -= seg.len;
+		count++;
+	} while (left);
+
+	return count;
+}
+
+/* Process up to max queued packets, the sources taking turns */
+static void osc_worker_dispatch_fair(struct osc_worker *w, unsigned max)
+{
+	struct osc_fair_packet *p;
+
+	while (max-- && (p = osc_fair_dequeue(w->fair))) {
+		struct osc_server_datagram dg = {
+			.data = p->data,
+			.len = p->len,
+			.src_addr = p->src_addr,
+			.rx_timestamp = p->rx_timestamp,
+		};
+
+		osc_server_dispatch(w, &w->stats, &dg);
+		osc_fair_release(w->fair, p);
+	}
+}
+
+/* While the sockets are not drained, leave a backlog of half the queue
+ * limit in which the sources take turns, rather than dispatching each
+ * batch as it was received. The rest goes before waiting. */
+static void osc_worker_dispatch_fair_backlog(struct osc_worker *w)
+{
+	size_t queued = osc_fair_queued(w->fair);
+	size_t backlog = w->server->fair_queue_limit / 2;
+
+	if (queued > backlog)
+		osc_worker_dispatch_fair(w, queued - backlog);
+}
+
+static int osc_worker_configure_conflate(struct osc_worker *w)
+{
+	OSC_ALLOCATOR_SCOPE(osc_worker_allocator(w));
+
+	struct osc_server *server = w->server;
+
+	if (!server->conflate_count || w->conflate)
+		return 0;
+
+	w->conflate = osc_conflate_new();
+	if (!w->conflate)
+		return -1;
+
+	for (unsigned i = 0; i < server->conflate_count; i++) {
+		if (osc_conflate_add_address(w->conflate,
+		                             server->conflate_addresses[i]))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int osc_worker_configure_fair(struct osc_worker *w)
+{
+	OSC_ALLOCATOR_SCOPE(osc_worker_allocator(w));
+
+	struct osc_server *server = w->server;
+
+	if (!server->fair_quantum) {
+		if (w->fair)
+			osc_worker_dispatch_fair(w, UINT_MAX);
+		osc_fair_free(w->fair);
+		w->fair = NULL;
+		return 0;
+	}
+
+	if (!w->fair) {
+		w->fair = osc_fair_new();
+		if (!w->fair)
+			return -1;
+	}
+
+	if (osc_fair_set_limits(w->fair, server->fair_quantum,
+	                        server->fair_queue_limit)
+	    || osc_fair_set_rate(w->fair, server->source_rate,
+	                         server->source_burst))
+		return -1;
+
+	return 0;
+}
+
+static int osc_worker_add_conflation(struct osc_worker *w, const char *address)
+{
+	OSC_ALLOCATOR_SCOPE(osc_worker_allocator(w));
+
+	if (w->conflate)
+		return osc_conflate_add_address(w->conflate, address);
+	return osc_worker_configure_conflate(w);
+}
+
+/* Queue packets by their source address and process the sources in
+ * turns with deficit round robin, each up to quantum bytes per turn.
+ * A flooding source then only delays the others by its turns instead
+ * of by all it has sent. Up to queue_limit packets are queued per
+ * source, further ones are dropped, and while the sockets are being
+ * drained half as many are held back in all. A quantum of 0 returns to
+ * processing packets in order of arrival. Applies to osc_server_run
+ * and to worker threads started afterwards, but not to pipelines. */
+int osc_server_set_fair_queueing(struct osc_server *server, size_t quantum,
+                                 size_t queue_limit)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	if (server->worker_count > 1 || server->workers[0].running
+	    || server->conflate_count) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (quantum && !queue_limit) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	server->fair_quantum = quantum;
+	server->fair_queue_limit = queue_limit;
+	return osc_worker_configure_fair(&server->workers[0]);
+}
+
+/* With fair queueing, drop the packets of sources exceeding rate
+ * packets per second, allowing bursts of up to burst packets. A rate
+ * of 0 removes the limit. */
+int osc_server_set_source_rate(struct osc_server *server, unsigned rate,
+                               unsigned burst)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	if (server->worker_count > 1 || server->workers[0].running) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (rate && !burst) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	server->source_rate = rate;
+	server->source_burst = burst;
+	return osc_worker_configure_fair(&server->workers[0]);
+}
+
+/* Conflate messages to address, or to addresses below it if it ends
+ * with a slash: a message replaces a queued one to the same address
+ * which was not dispatched yet, at its place in the queue. Callbacks
+ * then only see the latest value of each address received in a batch,
+ * or queued by the receive thread of a pipeline, instead of all the
+ * values which piled up. Not together with fair queueing. */
+int osc_server_add_conflation(struct osc_server *server, const char *address)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	struct osc_worker *w = &server->workers[0];
+
+	if (server->worker_count > 1 || w->running || server->fair_quantum) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (address[0] != '/') {
+		errno = EINVAL;
+		return -1;
+	}
+
+	char **addresses = osc_mem_realloc(server->conflate_addresses,
+	                           (server->conflate_count + 1) * sizeof(*addresses));
+	if (!addresses)
+		return -1;
+	server->conflate_addresses = addresses;
+
+	addresses[server->conflate_count] = osc_mem_strdup(address);
+	if (!addresses[server->conflate_count])
+		return -1;
+	server->conflate_count++;
+
+	return osc_worker_add_conflation(w, address);
+}
+
+/* Receive through io_uring instead of recvmmsg, on kernels which
+ * support multishot recvmsg with provided buffer rings. Datagrams are
+ * parsed in place and their buffers given back to the kernel after
+ * dispatch. Applies to osc_server_run only and ends with
+ * osc_server_start_workers. If io_uring is unavailable, this fails
+ * and the server keeps receiving with recvmmsg. */
+int osc_server_set_io_uring(struct osc_server *server, bool enable)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	struct osc_worker *w = &server->workers[0];
+
+	if (server->worker_count > 1 || w->running) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (!enable) {
+		if (!w->uring)
+			return 0;
+
+		osc_uring_free(w->uring);
+		w->uring = NULL;
+
+		/* Modifying the edge triggered events reports sockets
+		 * which were left with data by the ring */
+		for (unsigned i = 0; i < w->sock_count; i++) {
+			struct epoll_event ev = {
+				.events = EPOLLIN | EPOLLET,
+				.data.u32 = i
+			};
+
+			if (w->socks[i].fd < 0)
+				continue;
+			if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, w->socks[i].fd, &ev))
+				return -1;
+		}
+		return 0;
+	}
+
+	if (w->uring)
+		return 0;
+
+	for (unsigned i = 0; i < w->sock_count; i++) {
+		if (w->socks[i].listening || w->socks[i].connection
+		    || w->socks[i].shm) {
+			errno = EOPNOTSUPP;
+			return -1;
+		}
+	}
+
+	struct osc_uring *uring = osc_uring_new(OSC_SERVER_URING_BUFS,
+	                                        osc_server_buf_size(server),
+	                                        OSC_SERVER_CONTROL);
+	if (!uring)
+		return -1;
+
+	for (unsigned i = 0; i < w->sock_count; i++) {
+		if (osc_uring_add_recv(uring, w->socks[i].fd)) {
+			osc_uring_free(uring);
+			return -1;
+		}
+	}
+
+	w->uring = uring;
+	return 0;
+}
+
+/* Dispatch what the queues of a worker still hold */
+static void osc_worker_flush(struct osc_worker *w)
+{
+	OSC_ALLOCATOR_SCOPE(osc_worker_allocator(w));
+
+	if (w->fair)
+		osc_worker_dispatch_fair(w, UINT_MAX);
+	if (w->conflate)
+		osc_worker_dispatch_conflated(w);
+}
+
+/* Real-time mode, for processes in which page faults and waiting for
+ * the allocator's locks cause glitches. Each worker allocates a pool of
+ * pool_size bytes up front, in blocks of 32 bytes to 64 KiB, from which
+ * packets are parsed and queued for fair queueing and conflation. The
+ * memory of the whole process is locked. Worker threads and the receive
+ * thread of a pipeline run with SCHED_FIFO at priority, unless it is 0,
+ * the thread calling osc_server_run is left to the caller. Waiting for
+ * packets spins for spin_ns nanoseconds first, other than with
+ * io_uring; SO_BUSY_POLL can be set with osc_server_set_sockopt.
+ * Allocations the pool cannot serve abort debug builds, otherwise they
+ * fail and are counted in pool_failures. A pool_size of 0 ends the
+ * mode, but memory stays locked. Fails with EBUSY while methods still
+ * hold packets, which live in the pool being replaced. */
+int osc_server_set_realtime(struct osc_server *server, size_t pool_size,
+                            int priority, uint64_t spin_ns)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	struct osc_worker *w = &server->workers[0];
+	struct osc_pool *pool = NULL;
+
+	if (server->worker_count > 1 || w->running
+	    || osc_packet_pool_kept(w->packets)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (priority && (priority < sched_get_priority_min(SCHED_FIFO)
+	                 || priority > sched_get_priority_max(SCHED_FIFO))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (pool_size) {
+		pool = osc_pool_new(pool_size);
+		if (!pool)
+			return -1;
+		if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+			osc_pool_free(pool);
+			return -1;
+		}
+	}
+
+	/* The queues are set up again with memory from the new pool */
+	osc_worker_flush(w);
+	osc_worker_free_queues(w);
+	osc_pool_free(w->pool);
+	w->pool = pool;
+
+	server->pool_size = pool_size;
+	server->rt_priority = priority;
+	server->spin_ns = spin_ns;
+	if (osc_worker_configure_fair(w) || osc_worker_configure_conflate(w)
+	    || osc_worker_configure_packets(w))
+		return -1;
+	return 0;
+}
+
+/* Worker threads may only be cancelled while waiting for packets. In
+ * real-time mode, the worker spins for a while before going to sleep. */
+static int osc_worker_wait(struct osc_worker *w, struct epoll_event *events,
+                           bool block)
+{
+	int count;
+
+	if (block && w->server->spin_ns) {
+		uint64_t deadline = osc_time_ns() + w->server->spin_ns;
+
+		do {
+			count = epoll_wait(w->epfd, events, OSC_SERVER_EVENTS, 0);
+			if (count)
+				return count;
+		} while (osc_time_ns() < deadline);
+	}
+
+	if (w->running)
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+	count = epoll_wait(w->epfd, events, OSC_SERVER_EVENTS, block ? -1 : 0);
+
+	if (w->running)
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	return count;
+}
+
+/* Take the pending connections of a SOCK_SEQPACKET socket */
+static int osc_worker_accept(struct osc_worker *w, unsigned idx)
+{
+	while (1) {
+		int fd = accept4(w->socks[idx].fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+				return 0;
+			return -1;
+		}
+
+		/* May move the sockets */
+		int conn = osc_worker_add_fd(w, fd);
+		if (conn < 0) {
+			close(fd);
+			continue;
+		}
+		w->socks[conn].connection = true;
+	}
+}
+
+/* Process the packets of a shared memory ring in batches the size of
+ * the receive ones */
+static int osc_worker_drain_shm(struct osc_worker *w, unsigned idx,
+                                struct osc_budget *b)
+{
+	struct osc_socket *sock = &w->socks[idx];
+
+	while (1) {
+		if (osc_budget_spent(b))
+			return 1;
+
+		unsigned size = w->rx.size;
+		if (b->packets < size)
+			size = b->packets;
+
+		unsigned count;
+		bool corrupt = false;
+		for (count = 0; count < size; count++) {
+			struct osc_server_datagram dg = { 0 };
+
+			dg.data = osc_shm_peek(sock->shm, &dg.len);
+			if (!dg.data) {
+				corrupt = osc_shm_corrupt(sock->shm);
+				break;
+			}
+
+			osc_server_process(w, &dg);
+			osc_shm_consume(sock->shm);
+		}
+
+		if (count) {
+			w->stats.batches++;
+			if (count == w->rx.size)
+				w->stats.full_batches++;
+			if ((uint64_t)count > w->stats.max_batch)
+				w->stats.max_batch = count;
+		}
+		if (w->ring)
+			osc_ring_notify(w->ring);
+		if (w->fair)
+			osc_worker_dispatch_fair_backlog(w);
+		if (w->conflate)
+			osc_worker_dispatch_conflated(w);
+		osc_budget_charge(b, count);
+
+		if (corrupt) {
+			w->stats.shm_corrupt++;
+			fprintf(stderr, "Shared memory ring corrupted, removing it.\n");
+			osc_worker_close_fd(w, idx);
+			return 0;
+		}
+
+		if (count < size && (sock->busy || osc_shm_prepare_wait(sock->shm)))
+			return 0;
+	}
+}
+
+/* Receive and process datagrams until the socket is empty or the
+ * budget is spent. Returns 0 in the first case, 1 in the second. */
+static int osc_worker_drain(struct osc_worker *w, unsigned idx,
+                            struct osc_budget *b)
+{
+	struct osc_rx *rx = &w->rx;
+
+	if (w->socks[idx].listening)
+		return osc_worker_accept(w, idx);
+	if (w->socks[idx].shm)
+		return osc_worker_drain_shm(w, idx, b);
+
+	while (1) {
+		if (osc_budget_spent(b))
+			return 1;
+
+		unsigned size = rx->size;
+		if (b->packets < size)
+			size = b->packets;
+
+		for (unsigned i = 0; i < size; i++) {
+			rx->msg[i].msg_hdr.msg_namelen = sizeof(rx->names[i]);
+			rx->msg[i].msg_hdr.msg_controllen = OSC_SERVER_CONTROL;
+		}
+
+		int count = recvmmsg(w->socks[idx].fd, rx->msg, size, 0, NULL);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+				return 0;
+			if (w->socks[idx].connection) {
+				osc_worker_close_fd(w, idx);
+				return 0;
+			}
+			return -1;
+		}
+
+		w->stats.batches++;
+		if ((unsigned)count == rx->size)
+			w->stats.full_batches++;
+		if ((uint64_t)count > w->stats.max_batch)
+			w->stats.max_batch = count;
+
+		/* A connection reads as empty messages once closed */
+		bool closed = false;
+		for (int i = 0; i < count; i++) {
+			struct osc_server_datagram dg = {
+				.data = rx->iov[i].iov_base,
+				.len = rx->msg[i].msg_len,
+				.src_addr = (struct sockaddr*)&rx->names[i],
+			};
+
+			if (!dg.len && w->socks[idx].connection) {
+				closed = true;
+				count = i;
+				break;
+			}
+
+			osc_worker_receive(w, &w->socks[idx], &rx->msg[i].msg_hdr, &dg);
+		}
+		if (w->ring)
+			osc_ring_notify(w->ring);
+		if (w->fair)
+			osc_worker_dispatch_fair_backlog(w);
+		if (w->conflate)
+			osc_worker_dispatch_conflated(w);
+		osc_budget_charge(b, count);
+
+		if (closed) {
+			osc_worker_close_fd(w, idx);
+			return 0;
+		}
+
+		/* A partial batch means the socket was empty, anything
+		 * arriving later raises a new event. */
+		if ((unsigned)count < size)
+			return 0;
+	}
+}
+
+/* Drain the sockets which had an event. A socket left with data when
+ * the budget is spent stays marked, and the next round starts after
+ * it so that no socket is favoured. */
+static int osc_worker_drain_ready(struct osc_worker *w, struct osc_budget *b)
+{
+	unsigned start = w->next_ready;
+
+	for (unsigned n = 0; n < w->sock_count && w->ready_count; n++) {
+		unsigned i = (start + n) % w->sock_count;
+
+		if (!w->socks[i].ready)
+			continue;
+
+		int rv = osc_worker_drain(w, i, b);
+		w->next_ready = (i + 1) % w->sock_count;
+		if (rv)
+			return rv;
+
+		/* Unless it was a connection which got closed */
+		if (w->socks[i].ready && !w->socks[i].busy) {
+			w->socks[i].ready = false;
+			w->ready_count--;
+		}
+	}
+
+	return 0;
+}
+
+static void osc_worker_uring_handler(void *arg, int fd, const void *data,
+                                     size_t len, struct msghdr *msg)
+{
+	struct osc_worker *w = arg;
+	struct osc_server_datagram dg = {
+		.data = data,
+		.len = len,
+		.src_addr = msg->msg_namelen ? msg->msg_name : NULL,
+	};
+
+	for (unsigned i = 0; i < w->sock_count; i++) {
+		if (w->socks[i].fd == fd)
+			osc_worker_receive(w, &w->socks[i], msg, &dg);
+	}
+}
+
+static int osc_worker_run_uring(struct osc_worker *w, struct osc_budget *b,
+                                bool block)
+{
+	while (1) {
+		if (osc_budget_spent(b))
+			return 1;
+
+		unsigned max = OSC_SERVER_URING_BUFS;
+		if (b->packets < max)
+			max = b->packets;
+
+		int count = osc_uring_run(w->uring, block, max,
+		                          osc_worker_uring_handler, w);
+		if (count < 0)
+			return -1;
+		osc_budget_charge(b, count);
+
+		if (count) {
+			w->stats.batches++;
+			if ((unsigned)count == OSC_SERVER_URING_BUFS)
+				w->stats.full_batches++;
+			if ((uint64_t)count > w->stats.max_batch)
+				w->stats.max_batch = count;
+		}
+
+		if (w->fair && (unsigned)count < max)
+			osc_worker_dispatch_fair(w, UINT_MAX);
+		else if (w->fair)
+			osc_worker_dispatch_fair_backlog(w);
+		if (w->conflate)
+			osc_worker_dispatch_conflated(w);
+
+		/* Fewer completions than allowed means there were no more */
+		if ((unsigned)count < max && !block)
+			return 0;
+	}
+}
+
+/* Returns 0 once there is nothing left to receive, 1 if the budget was
+ * spent before and -1 on error */
+static int osc_worker_run(struct osc_worker *w, struct osc_budget *b,
+                          bool block)
+{
+	struct epoll_event events[OSC_SERVER_EVENTS];
+
+	if (w->uring)
+		return osc_worker_run_uring(w, b, block);
+
+	while (1) {
+		int rv = osc_worker_drain_ready(w, b);
+		if (rv)
+			return rv;
+
+		if (w->fair)
+			osc_worker_dispatch_fair(w, UINT_MAX);
+
+		/* Busy polled rings are drained on every round */
+		int count = osc_worker_wait(w, events, block && !w->busy_count);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (!count && !(block && w->busy_count))
+			return 0;
+
+		for (int i = 0; i < count; i++) {
+			unsigned idx = events[i].data.u32;
+
+			if (!w->socks[idx].ready) {
+				w->socks[idx].ready = true;
+				w->ready_count++;
+			}
+		}
+	}
+}
+
+/* Returns true if something was queued within the time to spin */
+static bool osc_server_spin_ring(struct osc_server *server,
+                                 struct osc_ring *ring)
+{
+	uint64_t deadline;
+	size_t len;
+
+	if (!server->spin_ns)
+		return false;
+
+	deadline = osc_time_ns() + server->spin_ns;
+	do {
+		if (osc_ring_peek(ring, &len))
+			return true;
+	} while (osc_time_ns() < deadline);
+
+	return false;
+}
+
+/* Dispatch what the receive thread of a pipeline has queued */
+static int osc_server_run_pipeline(struct osc_server *server,
+                                   struct osc_budget *b, bool block)
+{
+	struct osc_worker *w = &server->workers[0];
+	struct osc_ring *ring = w->ring;
+	struct osc_conflate *c = w->conflate;
+	size_t moved = c ? osc_conflate_queued(c) : 0;
+
+	while (1) {
+		size_t len;
+		const struct osc_queued *q = osc_ring_peek(ring, &len);
+
+		/* With conflation, move what is queued over and dispatch in
+		 * between, so that stale values are replaced rather than
+		 * dispatched late. Until the conflation queue has drained,
+		 * no more than OSC_SERVER_CONFLATE_MAX records are moved, so
+		 * that a backlog stays in the ring where it is shed. */
+		if (q && (!c || moved < OSC_SERVER_CONFLATE_MAX)) {
+			if (osc_budget_spent(b))
+				return 1;
+
+			uint64_t now = osc_time_ns();
+			uint64_t delay = now - q->enqueue_ns;
+			osc_shed_record_delay(server->shed, delay);
+			if (!q->protect && osc_shed_drop(server->shed, osc_ring_count(ring),
+			                                 delay, now)) {
+				if (osc_shed_policy(server->shed) == OSC_SHED_CODEL)
+					server->dispatch_stats.shed_codel++;
+				else
+					server->dispatch_stats.shed_oldest++;
+				osc_ring_consume(ring);
+				continue;
+			}
+
+			struct osc_server_datagram dg = {
+				.data = q->data + OSC_QUEUED_SRC_SPACE(q->src_len),
+				.len = q->len,
+				.src_addr = q->src_len ? (struct sockaddr*)q->data : NULL,
+				.cred = q->has_cred ? &q->cred : NULL,
+				.rx_timestamp = q->rx_timestamp,
+			};
+
+			if (c) {
+				osc_server_conflate(w, &server->dispatch_stats, &dg);
+				osc_ring_consume(ring);
+				moved++;
+				continue;
+			}
+
+			osc_server_dispatch(w, &server->dispatch_stats, &dg);
+			osc_ring_consume(ring);
+			osc_budget_charge(b, 1);
+			continue;
+		}
+
+		if (c && osc_conflate_queued(c)) {
+			if (osc_budget_spent(b))
+				return 1;
+
+			osc_server_dispatch_conflated(w, &server->dispatch_stats);
+			osc_budget_charge(b, 1);
+			if (!osc_conflate_queued(c))
+				moved = 0;
+			continue;
+		}
+
+		if (block && osc_server_spin_ring(server, ring))
+			continue;
+		if (!osc_ring_prepare_wait(ring))
+			continue;
+		if (!block)
+			return 0;
+
+		struct pollfd pfd = {
+			.fd = osc_ring_fd(ring),
+			.events = POLLIN
+		};
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -1;
+	}
+}
+
+int osc_server_run(struct osc_server *server)
+{
+	OSC_ALLOCATOR_SCOPE(osc_worker_allocator(&server->workers[0]));
+
+	struct osc_worker *w = &server->workers[0];
+	struct osc_budget b = osc_budget_unlimited;
+	int rv;
+
+	if (w->ring) {
+		rv = osc_server_run_pipeline(server, &b, server->blocking);
+	} else if (server->worker_count > 1 || w->running) {
+		errno = EBUSY;
+		rv = -1;
+	} else {
+		rv = osc_worker_run(w, &b, server->blocking);
+	}
+
+	return (rv < 0) ? 1 : 0;
+}
+
+/* Parse and dispatch a datagram received by other means than the
+ * server's sockets. buf is only used during the call and not copied.
+ * src_addr and rx_timestamp, in nanoseconds since the epoch, describe
+ * where and when it was received and may be NULL and 0 if unknown.
+ * They are passed to methods added with osc_server_add_method_info.
+ * Must not be called concurrently with osc_server_run or
+ * osc_server_poll, and fails with EBUSY while workers run. */
+int osc_server_feed(struct osc_server *server, const void *buf, size_t len,
+                    const struct sockaddr *src_addr, uint64_t rx_timestamp)
+{
+	struct osc_server_datagram dg = {
+		.data = buf,
+		.len = len,
+		.src_addr = src_addr,
+		.rx_timestamp = rx_timestamp,
+	};
+
+	return osc_server_feed_batch(server, &dg, 1);
+}
+
+int osc_server_feed_batch(struct osc_server *server,
+                          const struct osc_server_datagram *dgs,
+                          unsigned count)
+{
+	OSC_ALLOCATOR_SCOPE(osc_worker_allocator(&server->workers[0]));
+
+	struct osc_worker *w = &server->workers[0];
+	struct osc_server_stats *stats = &server->dispatch_stats;
+
+	if (server->worker_count > 1 || (w->running && !w->ring)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	stats->batches++;
+	if ((uint64_t)count > stats->max_batch)
+		stats->max_batch = count;
+
+	struct osc_conflate *c = w->ring ? NULL : w->conflate;
+
+	for (unsigned i = 0; i < count; i++) {
+		stats->packets++;
+		stats->bytes += dgs[i].len;
+		if (c)
+			osc_server_conflate(w, stats, &dgs[i]);
+		else
+			osc_server_dispatch(w, stats, &dgs[i]);
+	}
+
+	while (c && osc_server_dispatch_conflated(w, stats))
+		;
+	return 0;
+}
+
+/* Process at most max_packets packets or for about max_ns nanoseconds,
+ * whichever ends first, without waiting. A limit of 0 means none. The
+ * time is checked between batches, so slow callbacks can overrun it.
+ * Returns 1 if work may be left, which osc_server_fd does not
+ * necessarily signal, 0 if everything was processed and -1 on error. */
+int osc_server_poll(struct osc_server *server, unsigned max_packets,
+                    uint64_t max_ns)
+{
+	OSC_ALLOCATOR_SCOPE(osc_worker_allocator(&server->workers[0]));
+
+	struct osc_worker *w = &server->workers[0];
+	struct osc_budget b = {
+		.packets = max_packets ? max_packets : UINT_MAX,
+		.deadline = max_ns ? osc_time_ns() + max_ns : UINT64_MAX,
+	};
+
+	if (w->ring)
+		return osc_server_run_pipeline(server, &b, false);
+
+	if (server->worker_count > 1 || w->running) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	return osc_worker_run(w, &b, false);
+}
+
+static void *osc_worker_thread(void *arg)
+{
+	struct osc_worker *w = arg;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	osc_use_allocator(w->server->allocator);
+
+	/* Allocated by the already pinned thread so that the buffers are
+	 * placed on its NUMA node. */
+	if (!w->rx.size && osc_rx_init(&w->rx, w->server->batch_size,
+	                               osc_server_buf_size(w->server)))
+		return NULL;
+	if (w->server->pool_size && !w->pool) {
+		w->pool = osc_pool_new(w->server->pool_size);
+		if (!w->pool)
+			return NULL;
+	}
+	if (!w->ring && (osc_worker_configure_fair(w)
+	                 || osc_worker_configure_conflate(w)
+	                 || osc_worker_configure_packets(w)))
+		return NULL;
+
+	/* The pool of the first worker belongs to osc_server_run, the
+	 * receive thread of a pipeline does not allocate */
+	if (!w->ring)
+		osc_use_allocator(osc_worker_allocator(w));
+
+	struct osc_budget b = osc_budget_unlimited;
+	osc_worker_run(w, &b, true);
+	return NULL;
+}
+
+static void osc_worker_start(struct osc_worker *w)
+{
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	if (w->cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+
+	if (w->server->rt_priority) {
+		struct sched_param param = {
+			.sched_priority = w->server->rt_priority
+		};
+
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+
+	w->running = true;
+	int rv = pthread_create(&w->thread, &attr, osc_worker_thread, w);
+	if (rv) {
+		w->running = false;
+		errno = rv;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static void osc_worker_stop(struct osc_worker *w)
+{
+	if (!w->running)
+		return;
+
+	pthread_cancel(w->thread);
+	pthread_join(w->thread, NULL);
+	w->running = false;
+}
+
+/* Shed packets from the queue of a pipeline under overload, see
+ * osc_shed_set_policy. Packets to never-drop addresses are queued and
+ * dispatched as long as the ring has room. Changes only while no
+ * pipeline runs. */
+int osc_server_set_shedding(struct osc_server *server,
+                            enum osc_shed_policy policy, size_t limit,
+                            uint64_t target_ns, uint64_t interval_ns)
+{
+	if (server->workers[0].ring) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	return osc_shed_set_policy(server->shed, policy, limit, target_ns,
+	                           interval_ns);
+}
+
+/* Never shed packets to address, or below it if it ends with a slash */
+int osc_server_add_never_drop(struct osc_server *server, const char *address)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	if (server->workers[0].ring) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	return osc_shed_add_never_drop(server->shed, address);
+}
+
+/* Receive in a thread of its own, pinned to cpu unless it is -1, which
+ * only checks the packets and queues them in a ring of ring_size bytes.
+ * osc_server_run then parses and dispatches them, so slow callbacks no
+ * longer keep the sockets from being drained. Packets not fitting into
+ * the ring are dropped and counted as ring overflows. */
+int osc_server_start_pipeline(struct osc_server *server, size_t ring_size,
+                              int cpu)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	struct osc_worker *w = &server->workers[0];
+
+	if (server->worker_count > 1 || w->running || w->uring || w->fair) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	w->ring = osc_ring_new(ring_size);
+	if (!w->ring)
+		return -1;
+
+	w->cpu = cpu;
+	osc_worker_start(w);
+	if (!w->running) {
+		osc_ring_free(w->ring);
+		w->ring = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Stop the receive thread, packets still queued are discarded */
+void osc_server_stop_pipeline(struct osc_server *server)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	struct osc_worker *w = &server->workers[0];
+
+	if (!w->ring)
+		return;
+
+	osc_worker_stop(w);
+	osc_ring_free(w->ring);
+	w->ring = NULL;
+	w->cpu = -1;
+}
+
+static int osc_server_reuseport_socket(const struct sockaddr_storage *ss,
+                                       socklen_t len, int v6only)
+{
+	int fd = socket(ss->ss_family, SOCK_DGRAM, 0);
+	int on = 1;
+
+	if (fd < 0)
+		return -1;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (ss->ss_family == AF_INET6)
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))
+	    || bind(fd, (const struct sockaddr*)ss, len)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Steer datagrams to workers by a hash of their source address and
+ * port, so each source is always handled by the same worker. The
+ * program runs with the packet data starting after the UDP header. */
+static int osc_server_attach_flow_filter(int fd, unsigned count)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 4),
+		/* IPv6: source port and low 32 bits of the source address */
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_NET_OFF + 40),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 20),
+		BPF_JUMP(BPF_JMP | BPF_JA, 4, 0, 0),
+		/* IPv4: source port after the header of variable length,
+		 * and source address */
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, SKF_NET_OFF),
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+		/* Fold everything into the index of a worker */
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code
+	};
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+	                  &prog, sizeof(prog));
+}
+
+struct osc_listen_addr {
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int v6only;
+
+	/* Unix domain sockets can not be bound again and are handed over
+	 * to the first worker instead, as are shared memory rings */
+	int fd;
+	bool listening;
+	bool connection;
+	struct osc_shm *shm;
+	bool busy;
+};
+
+static void osc_listen_addrs_free(struct osc_listen_addr *addrs, unsigned count)
+{
+	for (unsigned j = 0; j < count; j++) {
+		if (addrs[j].fd >= 0)
+			close(addrs[j].fd);
+	}
+	osc_mem_free(addrs);
+}
+
+/* Add the socket of a to w, returning its index */
+static int osc_listen_addr_add(const struct osc_listen_addr *a,
+                               struct osc_worker *w)
+{
+	int fd;
+
+	if (a->shm)
+		return osc_worker_add_shm(w, a->shm, a->busy);
+
+	if (a->fd >= 0)
+		fd = fcntl(a->fd, F_DUPFD_CLOEXEC, 0);
+	else
+		fd = osc_server_reuseport_socket(&a->ss, a->len, a->v6only);
+	if (fd < 0)
+		return -1;
+
+	int idx = osc_worker_add_fd(w, fd);
+	if (idx < 0) {
+		close(fd);
+		return -1;
+	}
+
+	w->socks[idx].listening = a->listening;
+	w->socks[idx].connection = a->connection;
+	return idx;
+}
+
+/* Replace each server socket by count sockets bound with SO_REUSEPORT
+ * to the same address and serve each set of them by its own thread.
+ * Thread i is pinned to the i-th CPU in cpus, if given. With
+ * flow_affinity, a socket filter keeps datagrams of one source on the
+ * same worker. Group memberships have to be joined again afterwards, as
+ * the original sockets are closed. Options set through the server are
+ * applied to the new sockets. Unix domain sockets and shared memory
+ * rings are served by the first worker alone. Fails with EBUSY while
+ * methods still hold packets received before. */
+int osc_server_start_workers(struct osc_server *server, unsigned count,
+                             const cpu_set_t *cpus, bool flow_affinity)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	struct osc_worker *old = &server->workers[0];
+
+	if (!count || server->worker_count > 1 || old->running) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (osc_packet_pool_kept(old->packets)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/* Addresses are reused with their actual port, in case it was
+	 * chosen by the kernel. */
+	unsigned addr_count = 0;
+	struct osc_listen_addr *addrs = osc_mem_calloc(old->sock_count, sizeof(*addrs));
+	if (!addrs)
+		return -1;
+
+	for (unsigned j = 0; j < old->sock_count; j++) {
+		struct osc_socket *sock = &old->socks[j];
+		struct osc_listen_addr *a = &addrs[addr_count];
+		socklen_t optlen = sizeof(a->v6only);
+
+		if (sock->fd < 0)
+			continue;
+
+		a->fd = -1;
+		addr_count++;
+		if (sock->shm) {
+			a->shm = sock->shm;
+			a->busy = sock->busy;
+			continue;
+		}
+		if (sock->family == AF_UNIX) {
+			a->fd = fcntl(sock->fd, F_DUPFD_CLOEXEC, 0);
+			a->listening = sock->listening;
+			a->connection = sock->connection;
+			if (a->fd < 0) {
+				osc_listen_addrs_free(addrs, addr_count);
+				return -1;
+			}
+			continue;
+		}
+
+		a->len = sizeof(a->ss);
+		if (getsockname(sock->fd, (struct sockaddr*)&a->ss, &a->len)) {
+			osc_listen_addrs_free(addrs, addr_count);
+			return -1;
+		}
+		if (a->ss.ss_family == AF_INET6)
+			getsockopt(sock->fd, IPPROTO_IPV6, IPV6_V6ONLY,
+			           &a->v6only, &optlen);
+	}
+
+	struct osc_worker *workers = osc_mem_calloc(count, sizeof(*workers));
+	if (!workers) {
+		osc_listen_addrs_free(addrs, addr_count);
+		return -1;
+	}
+
+	for (unsigned i = 0; i < count; i++)
+		workers[i].epfd = -1;
+
+	unsigned cpu = 0;
+	for (unsigned i = 0; i < count; i++) {
+		if (osc_worker_init(&workers[i], server))
+			goto err;
+
+		if (!cpus || !CPU_COUNT(cpus))
+			continue;
+
+		while (!CPU_ISSET(cpu % CPU_SETSIZE, cpus))
+			cpu++;
+		workers[i].cpu = cpu % CPU_SETSIZE;
+		cpu++;
+	}
+
+	osc_uring_free(old->uring);
+	old->uring = NULL;
+
+	/* The handed over sockets stay open, so remove them explicitly */
+	for (unsigned j = 0; j < old->sock_count; j++) {
+		if (old->socks[j].fd >= 0
+		    && (old->socks[j].family == AF_UNIX || old->socks[j].shm))
+			epoll_ctl(old->epfd, EPOLL_CTL_DEL, old->socks[j].fd, NULL);
+	}
+	osc_worker_close_fds(old);
+
+	for (unsigned j = 0; j < addr_count; j++) {
+		struct osc_listen_addr *a = &addrs[j];
+		int idx = -1;
+
+		bool single = (a->fd >= 0 || a->shm);
+
+		for (unsigned i = 0; i < (single ? 1 : count); i++) {
+			int rv = osc_listen_addr_add(a, &workers[i]);
+
+			if (rv < 0)
+				goto err;
+			if (!i)
+				idx = rv;
+		}
+
+		if (flow_affinity && !single
+		    && osc_server_attach_flow_filter(workers[0].socks[idx].fd, count))
+			goto err;
+	}
+
+	osc_listen_addrs_free(addrs, addr_count);
+	workers[0].stats = old->stats;
+	osc_worker_close(old);
+	osc_rx_free(&old->rx);
+	osc_mem_free(server->workers);
+	server->workers = workers;
+	server->worker_count = count;
+
+	for (unsigned i = 0; i < count; i++)
+		osc_worker_start(&workers[i]);
+
+	/* Such as without the privileges for SCHED_FIFO */
+	for (unsigned i = 0; i < count; i++) {
+		if (!workers[i].running) {
+			int err = errno;
+
+			osc_server_stop_workers(server);
+			errno = err;
+			return -1;
 		}
+	}
+
+	return 0;
+
+err:
+	for (unsigned i = 0; i < count; i++)
+		osc_worker_close(&workers[i]);
+	osc_mem_free(workers);
+
+	/* Try to get back to serving the previous addresses */
+	osc_worker_close_fds(old);
+	for (unsigned j = 0; j < addr_count; j++)
+		osc_listen_addr_add(&addrs[j], old);
+
+	osc_listen_addrs_free(addrs, addr_count);
+	return -1;
+}
+
+static void osc_stats_add(struct osc_server_stats *to,
+                          const struct osc_server_stats *from)
+{
+	to->packets += from->packets;
+	to->bytes += from->bytes;
+	to->parse_errors += from->parse_errors;
+	to->batches += from->batches;
+	to->full_batches += from->full_batches;
+	if (from->max_batch > to->max_batch)
+		to->max_batch = from->max_batch;
+	if (from->ring_max_occupancy > to->ring_max_occupancy)
+		to->ring_max_occupancy = from->ring_max_occupancy;
+	to->ring_overflows += from->ring_overflows;
+	to->kernel_drops += from->kernel_drops;
+	to->source_rate_drops += from->source_rate_drops;
+	to->source_queue_drops += from->source_queue_drops;
+	to->truncated += from->truncated;
+	to->shm_corrupt += from->shm_corrupt;
+	to->shed_newest += from->shed_newest;
+	to->shed_oldest += from->shed_oldest;
+	to->shed_codel += from->shed_codel;
+	to->conflated += from->conflated;
+}
+
+/* Stop all worker threads, leaving the server with the sockets of the
+ * first one to be used by osc_server_run. */
+void osc_server_stop_workers(struct osc_server *server)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	/* The receive thread of a pipeline is left alone */
+	if (server->workers[0].ring)
+		return;
+
+	for (unsigned i = 0; i < server->worker_count; i++)
+		osc_worker_stop(&server->workers[i]);
+
+	for (unsigned i = 1; i < server->worker_count; i++) {
+		struct osc_worker *w = &server->workers[i];
+
+		osc_stats_add(&server->workers[0].stats, &w->stats);
+		osc_worker_close(w);
+		osc_rx_free(&w->rx);
+	}
+
+	if (!server->workers[0].rx.size)
+		osc_rx_init(&server->workers[0].rx, server->batch_size,
+		            osc_server_buf_size(server));
+	if (server->pool_size && !server->workers[0].pool)
+		server->workers[0].pool = osc_pool_new(server->pool_size);
+	osc_worker_configure_packets(&server->workers[0]);
+	server->worker_count = 1;
+}
+
+/* Sum of the statistics of all workers. While worker threads are
+ * running, the counters are read without synchronization. */
+void osc_server_get_stats(struct osc_server *server,
+                          struct osc_server_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	for (unsigned i = 0; i < server->worker_count; i++)
+		osc_stats_add(stats, &server->workers[i].stats);
+	osc_stats_add(stats, &server->dispatch_stats);
+
+	if (server->workers[0].ring)
+		stats->ring_occupancy = osc_ring_count(server->workers[0].ring);
+
+	stats->queue_delay_p50 = osc_shed_delay(server->shed, 500);
+	stats->queue_delay_p90 = osc_shed_delay(server->shed, 900);
+	stats->queue_delay_p99 = osc_shed_delay(server->shed, 990);
+	stats->queue_delay_p999 = osc_shed_delay(server->shed, 999);
+
+	for (unsigned i = 0; i < server->worker_count; i++) {
+		struct osc_pool_stats pool;
+
+		if (!server->workers[i].pool)
+			continue;
 
-		free(log);
-		osc_dispatcher_process(server->dispatcher, e);
-		osc_free(e);
+		osc_pool_get_stats(server->workers[i].pool, &pool);
+		stats->pool_failures += pool.failures;
+		if (pool.max_used > stats->pool_max_used)
+			stats->pool_max_used = pool.max_used;
 	}
 }
 
+/* A descriptor which becomes readable when osc_server_run has work */
 int osc_server_fd(struct osc_server *server)
 {
-	return server->fd;
+	if (server->workers[0].ring)
+		return osc_ring_fd(server->workers[0].ring);
+	if (server->workers[0].uring)
+		return osc_uring_fd(server->workers[0].uring);
+	return server->workers[0].epfd;
 }
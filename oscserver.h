@@ -23,15 +23,135 @@
 #define OSCSERVER_H
 
 #include "oscdispatcher.h"
+#include "oscshed.h"
 
 struct osc_server;
+struct osc_shm;
+
+struct osc_server_stats {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t parse_errors;
+
+	/* Receive batches, how many of them filled all slots, and the
+	 * largest number of packets in one batch */
+	uint64_t batches;
+	uint64_t full_batches;
+	uint64_t max_batch;
+
+	/* Packets queued from the receive thread of a pipeline to the
+	 * dispatching one, the most seen queued at once, and those dropped
+	 * because the ring was full */
+	uint64_t ring_occupancy;
+	uint64_t ring_max_occupancy;
+	uint64_t ring_overflows;
+
+	/* Datagrams dropped by the kernel, with drop counting enabled */
+	uint64_t kernel_drops;
+
+	/* Packets dropped by fair queueing because their source exceeded
+	 * its rate or had its queue full */
+	uint64_t source_rate_drops;
+	uint64_t source_queue_drops;
+
+	/* Datagrams dropped because they exceeded the maximum size */
+	uint64_t truncated;
+
+	/* Shared memory rings dropped because a producer corrupted them */
+	uint64_t shm_corrupt;
+
+	/* Packets shed from the queue of a pipeline by each policy, and
+	 * percentiles of the time packets spent in it */
+	uint64_t shed_newest;
+	uint64_t shed_oldest;
+	uint64_t shed_codel;
+	uint64_t queue_delay_p50;
+	uint64_t queue_delay_p90;
+	uint64_t queue_delay_p99;
+	uint64_t queue_delay_p999;
+
+	/* Messages replaced by a newer one to the same address */
+	uint64_t conflated;
+
+	/* Allocations a real-time pool could not serve, and the most bytes
+	 * of blocks one pool had in use at once */
+	uint64_t pool_failures;
+	uint64_t pool_max_used;
+};
+
+enum osc_timestamping {
+	OSC_TIMESTAMP_NONE,
+	OSC_TIMESTAMP_SOFTWARE,
+	OSC_TIMESTAMP_HARDWARE,
+};
+
+/* A datagram received by the caller, for osc_server_feed_batch */
+struct osc_server_datagram {
+	const void *data;
+	size_t len;
+	const struct sockaddr *src_addr;
+	const struct ucred *cred;
+	uint64_t rx_timestamp;
+};
 
 struct osc_server *osc_server_new(const char *node, const char *service,
                                   const struct addrinfo *hints);
-void osc_server_add_method(struct osc_server *server, const char *address,
-                           osc_method callback, void *arg);
+void osc_server_free(struct osc_server *server);
+int osc_server_add_listener(struct osc_server *server, const char *node,
+                            const char *service, const struct addrinfo *hints);
+int osc_server_add_method(struct osc_server *server, const char *address,
+                          osc_method callback, void *arg);
+int osc_server_add_method_info(struct osc_server *server, const char *address,
+                               osc_method_info callback, void *arg);
+int osc_server_add_unix_listener(struct osc_server *server, const char *path,
+                                 int type);
+int osc_server_add_shm(struct osc_server *server, struct osc_shm *shm,
+                       bool busy_poll);
+int osc_server_remove_shm(struct osc_server *server, struct osc_shm *shm);
+int osc_server_set_kernel_filter(struct osc_server *server, bool enable);
+int osc_server_allow_source(struct osc_server *server, const char *node,
+                            unsigned prefix);
+int osc_server_join_group(struct osc_server *server, const char *group,
+                          const char *ifname);
+int osc_server_set_sockopt(struct osc_server *server, int level, int name,
+                           int value);
+int osc_server_set_rcvbuf(struct osc_server *server, int size);
+int osc_server_set_drop_counting(struct osc_server *server, bool enable);
+int osc_server_set_credentials(struct osc_server *server, bool enable);
+int osc_server_set_timestamping(struct osc_server *server,
+                                enum osc_timestamping mode);
 int osc_server_set_blocking(struct osc_server *server, bool blocking);
+int osc_server_set_batch_size(struct osc_server *server, unsigned size);
+int osc_server_set_max_datagram(struct osc_server *server, size_t size);
+int osc_server_set_gro(struct osc_server *server, bool enable);
+int osc_server_set_fair_queueing(struct osc_server *server, size_t quantum,
+                                 size_t queue_limit);
+int osc_server_set_source_rate(struct osc_server *server, unsigned rate,
+                               unsigned burst);
+int osc_server_add_conflation(struct osc_server *server, const char *address);
+int osc_server_set_io_uring(struct osc_server *server, bool enable);
+int osc_server_set_realtime(struct osc_server *server, size_t pool_size,
+                            int priority, uint64_t spin_ns);
 int osc_server_run(struct osc_server *server);
+int osc_server_poll(struct osc_server *server, unsigned max_packets,
+                    uint64_t max_ns);
+int osc_server_feed(struct osc_server *server, const void *buf, size_t len,
+                    const struct sockaddr *src_addr, uint64_t rx_timestamp);
+int osc_server_feed_batch(struct osc_server *server,
+                          const struct osc_server_datagram *dgs,
+                          unsigned count);
+int osc_server_start_workers(struct osc_server *server, unsigned count,
+                             const cpu_set_t *cpus, bool flow_affinity);
+void osc_server_stop_workers(struct osc_server *server);
+int osc_server_set_shedding(struct osc_server *server,
+                            enum osc_shed_policy policy, size_t limit,
+                            uint64_t target_ns, uint64_t interval_ns);
+int osc_server_add_never_drop(struct osc_server *server, const char *address);
+int osc_server_start_pipeline(struct osc_server *server, size_t ring_size,
+                              int cpu);
+void osc_server_stop_pipeline(struct osc_server *server);
+void osc_server_get_stats(struct osc_server *server,
+                          struct osc_server_stats *stats);
 int osc_server_fd(struct osc_server *server);
 
 #endif
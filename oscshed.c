@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "oscshed.h"
+#include "oscalloc.h"
+#include "oscutils.h"
+
+#define OSC_SHED_TARGET_NS 5000000ULL
+#define OSC_SHED_INTERVAL_NS 100000000ULL
+#define OSC_SHED_DEPTH_MAX 8
+
+/* Queueing delays are counted in buckets of one eighth of a power of
+ * two nanoseconds, which bounds the error of a percentile to 12.5% */
+#define OSC_SHED_SUB_BITS 3
+#define OSC_SHED_SUB (1 << OSC_SHED_SUB_BITS)
+#define OSC_SHED_BUCKETS ((64 - OSC_SHED_SUB_BITS + 1) * OSC_SHED_SUB)
+
+/* Decides which packets to shed from a queue between receive and
+ * dispatch. The producer asks osc_shed_admit before queueing a packet,
+ * the consumer osc_shed_drop before dispatching one. Packets to
+ * addresses marked as never-drop are exempt from both. */
+struct osc_shed {
+	enum osc_shed_policy policy;
+	size_t limit;
+	uint64_t target_ns;
+	uint64_t interval_ns;
+
+	char **never_drop;
+	unsigned never_drop_count;
+
+	/* CoDel state, see RFC 8289 */
+	bool dropping;
+	uint64_t first_above;
+	uint64_t drop_next;
+	uint32_t count;
+	uint32_t last_count;
+
+	uint64_t delays[OSC_SHED_BUCKETS];
+	uint64_t delay_count;
+};
+
+struct osc_shed *osc_shed_new(void)
+{
+	return osc_mem_calloc(sizeof(struct osc_shed), 1);
+}
+
+void osc_shed_free(struct osc_shed *s)
+{
+	if (!s)
+		return;
+
+	for (unsigned i = 0; i < s->never_drop_count; i++)
+		osc_mem_free(s->never_drop[i]);
+	osc_mem_free(s->never_drop);
+	osc_mem_free(s);
+}
+
+/* With OSC_SHED_DROP_NEWEST, packets arriving while limit packets are
+ * queued are dropped, with OSC_SHED_DROP_OLDEST the oldest ones are
+ * dropped until no more than limit are queued. A limit of 0 leaves
+ * only the size of the queue as limit. OSC_SHED_CODEL drops packets
+ * once their queueing delay stayed above target_ns for interval_ns,
+ * more often the longer it stays there. Zero picks the usual 5 and
+ * 100 ms. */
+int osc_shed_set_policy(struct osc_shed *s, enum osc_shed_policy policy,
+                        size_t limit, uint64_t target_ns, uint64_t interval_ns)
+{
+	switch (policy) {
+	case OSC_SHED_DROP_NEWEST:
+		break;
+	case OSC_SHED_DROP_OLDEST:
+		if (!limit) {
+			errno = EINVAL;
+			return -1;
+		}
+		break;
+	case OSC_SHED_CODEL:
+		if (!target_ns)
+			target_ns = OSC_SHED_TARGET_NS;
+		if (!interval_ns)
+			interval_ns = OSC_SHED_INTERVAL_NS;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	s->policy = policy;
+	s->limit = limit;
+	s->target_ns = target_ns;
+	s->interval_ns = interval_ns;
+	s->dropping = false;
+	s->first_above = 0;
+	s->count = 0;
+	s->last_count = 0;
+	return 0;
+}
+
+enum osc_shed_policy osc_shed_policy(struct osc_shed *s)
+{
+	return s->policy;
+}
+
+/* Never drop packets to address, or to any address below it if it ends
+ * with a slash. Bundles are kept if they contain such a message. */
+int osc_shed_add_never_drop(struct osc_shed *s, const char *address)
+{
+	if (address[0] != '/') {
+		errno = EINVAL;
+		return -1;
+	}
+
+	char **never_drop = osc_mem_realloc(s->never_drop,
+	                            (s->never_drop_count + 1) * sizeof(*never_drop));
+	if (!never_drop)
+		return -1;
+	s->never_drop = never_drop;
+
+	never_drop[s->never_drop_count] = osc_mem_strdup(address);
+	if (!never_drop[s->never_drop_count])
+		return -1;
+	s->never_drop_count++;
+	return 0;
+}
+
+static bool osc_shed_packet_protected(struct osc_shed *s,
+                                      const unsigned char *data, size_t len,
+                                      unsigned depth)
+{
+	if (len && data[0] == '/')
+		return osc_address_listed(s->never_drop, s->never_drop_count,
+		                          (const char*)data, len);
+
+	if (len < 16 || memcmp(data, "#bundle", 8) || depth >= OSC_SHED_DEPTH_MAX)
+		return false;
+
+	for (size_t offset = 16; len - offset >= 4;) {
+		uint32_t size;
+
+		memcpy(&size, data + offset, sizeof(size));
+		size = ntohl(size);
+		offset += 4;
+		if (size > len - offset)
+			break;
+
+		if (osc_shed_packet_protected(s, data + offset, size, depth + 1))
+			return true;
+		offset += size;
+	}
+
+	return false;
+}
+
+bool osc_shed_protected(struct osc_shed *s, const void *data, size_t len)
+{
+	if (!s->never_drop_count)
+		return false;
+	return osc_shed_packet_protected(s, data, len, 0);
+}
+
+/* Whether a packet may be queued behind queued others */
+bool osc_shed_admit(struct osc_shed *s, size_t queued)
+{
+	return s->policy != OSC_SHED_DROP_NEWEST || !s->limit
+	       || queued < s->limit;
+}
+
+static uint64_t osc_isqrt(uint64_t x)
+{
+	uint64_t rv = 0;
+	uint64_t bit = 1ULL << 62;
+
+	while (bit > x)
+		bit >>= 2;
+
+	while (bit) {
+		if (x >= rv + bit) {
+			x -= rv + bit;
+			rv = (rv >> 1) + bit;
+		} else {
+			rv >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return rv;
+}
+
+/* Drops get closer together with the square root of their count */
+static uint64_t osc_shed_control_law(struct osc_shed *s, uint64_t t)
+{
+	return t + (s->interval_ns << 16) / osc_isqrt((uint64_t)s->count << 32);
+}
+
+static bool osc_shed_codel_ok(struct osc_shed *s, size_t queued,
+                              uint64_t delay_ns, uint64_t now)
+{
+	if (delay_ns < s->target_ns || queued <= 1) {
+		s->first_above = 0;
+		return false;
+	}
+
+	if (!s->first_above) {
+		s->first_above = now + s->interval_ns;
+		return false;
+	}
+
+	return now >= s->first_above;
+}
+
+static bool osc_shed_codel(struct osc_shed *s, size_t queued,
+                           uint64_t delay_ns, uint64_t now)
+{
+	bool ok = osc_shed_codel_ok(s, queued, delay_ns, now);
+
+	if (s->dropping) {
+		if (!ok) {
+			s->dropping = false;
+			return false;
+		}
+		if (now < s->drop_next)
+			return false;
+
+		s->count++;
+		s->drop_next = osc_shed_control_law(s, s->drop_next);
+		return true;
+	}
+
+	if (!ok)
+		return false;
+
+	/* Pick up the drop rate of a recent dropping state again */
+	uint32_t delta = s->count - s->last_count;
+	s->dropping = true;
+	if (delta > 1 && s->drop_next + 16 * s->interval_ns > now)
+		s->count = delta;
+	else
+		s->count = 1;
+	s->drop_next = osc_shed_control_law(s, now);
+	s->last_count = s->count;
+	return true;
+}
+
+/* Whether the oldest of queued packets, which waited delay_ns, is to
+ * be dropped instead of dispatched */
+bool osc_shed_drop(struct osc_shed *s, size_t queued, uint64_t delay_ns,
+                   uint64_t now)
+{
+	switch (s->policy) {
+	case OSC_SHED_DROP_OLDEST:
+		return queued > s->limit;
+	case OSC_SHED_CODEL:
+		return osc_shed_codel(s, queued, delay_ns, now);
+	default:
+		return false;
+	}
+}
+
+static unsigned osc_shed_bucket(uint64_t ns)
+{
+	if (ns < OSC_SHED_SUB)
+		return ns;
+
+	unsigned msb = 63 - __builtin_clzll(ns);
+	unsigned sub = (ns >> (msb - OSC_SHED_SUB_BITS)) & (OSC_SHED_SUB - 1);
+	return (msb - OSC_SHED_SUB_BITS + 1) * OSC_SHED_SUB + sub;
+}
+
+static uint64_t osc_shed_bucket_ns(unsigned bucket)
+{
+	if (bucket < OSC_SHED_SUB)
+		return bucket;
+
+	unsigned msb = bucket / OSC_SHED_SUB + OSC_SHED_SUB_BITS - 1;
+	uint64_t sub = bucket % OSC_SHED_SUB;
+	return (OSC_SHED_SUB + sub) << (msb - OSC_SHED_SUB_BITS);
+}
+
+void osc_shed_record_delay(struct osc_shed *s, uint64_t delay_ns)
+{
+	s->delays[osc_shed_bucket(delay_ns)]++;
+	s->delay_count++;
+}
+
+/* The queueing delay which permille of the recorded ones did not
+ * exceed, rounded down to its bucket */
+uint64_t osc_shed_delay(struct osc_shed *s, unsigned permille)
+{
+	uint64_t rank = (s->delay_count * permille + 999) / 1000;
+	uint64_t seen = 0;
+
+	if (!s->delay_count)
+		return 0;
+	if (!rank)
+		rank = 1;
+
+	for (unsigned i = 0; i < OSC_SHED_BUCKETS; i++) {
+		seen += s->delays[i];
+		if (seen >= rank)
+			return osc_shed_bucket_ns(i);
+	}
+
+	return osc_shed_bucket_ns(OSC_SHED_BUCKETS - 1);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef OSCSHED_H
+#define OSCSHED_H
+
+struct osc_shed;
+
+enum osc_shed_policy {
+	OSC_SHED_DROP_NEWEST,
+	OSC_SHED_DROP_OLDEST,
+	OSC_SHED_CODEL,
+};
+
+struct osc_shed *osc_shed_new(void);
+void osc_shed_free(struct osc_shed *s);
+int osc_shed_set_policy(struct osc_shed *s, enum osc_shed_policy policy,
+                        size_t limit, uint64_t target_ns, uint64_t interval_ns);
+enum osc_shed_policy osc_shed_policy(struct osc_shed *s);
+int osc_shed_add_never_drop(struct osc_shed *s, const char *address);
+bool osc_shed_protected(struct osc_shed *s, const void *data, size_t len);
+bool osc_shed_admit(struct osc_shed *s, size_t queued);
+bool osc_shed_drop(struct osc_shed *s, size_t queued, uint64_t delay_ns,
+                   uint64_t now);
+void osc_shed_record_delay(struct osc_shed *s, uint64_t delay_ns);
+uint64_t osc_shed_delay(struct osc_shed *s, unsigned permille);
+
+#endif
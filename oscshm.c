@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "oscshm.h"
+#include "oscalloc.h"
+
+#define OSC_SHM_MAGIC 0x4f534352U
+#define OSC_SHM_DATA 4096
+#define OSC_SHM_ALIGN 8
+#define OSC_SHM_HEADER OSC_SHM_ALIGN
+#define OSC_SHM_COMMITTED 0x80000000U
+#define OSC_SHM_WRAP UINT32_MAX
+#define OSC_SHM_RECORD(len) \
+	(OSC_SHM_HEADER + (((len) + OSC_SHM_ALIGN - 1) & ~(size_t)(OSC_SHM_ALIGN - 1)))
+
+/* A ring of packets in shared memory, written by any number of
+ * producers in any process which has the memory mapped and read by one
+ * consumer. Producers claim space by advancing tail with a
+ * compare-and-swap, copy their packet and then set the committed bit
+ * in its length word. The consumer reads records in order up to the
+ * first one not yet committed, and clears them before handing their
+ * space back by advancing head, so the length words of future records
+ * always start out as zero. A record not fitting before the end of
+ * the buffer is preceded by a wrap marker. Producers only make a
+ * system call to wake the consumer when it announced to be waiting,
+ * one which polls never does. Length words are checked against the
+ * end of the buffer, as any producer can write them. */
+struct osc_shm_header {
+	uint32_t magic;
+	uint32_t pad;
+	uint64_t size;
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t head __attribute__((aligned(64)));
+	uint32_t waiting;
+	uint64_t overflows __attribute__((aligned(64)));
+};
+
+struct osc_shm {
+	int fd;
+	int event_fd;
+	struct osc_shm_header *header;
+	unsigned char *buf;
+	size_t size;
+	uint64_t head;
+
+	/* Size of the record returned by osc_shm_peek, and whether a
+	 * length word was found to run past the end of the buffer */
+	size_t record;
+	bool corrupt;
+
+	const struct osc_allocator *allocator;
+};
+
+struct osc_shm_writer {
+	int event_fd;
+	struct osc_shm_header *header;
+	unsigned char *buf;
+	size_t size;
+	const struct osc_allocator *allocator;
+};
+
+static struct osc_shm_header *osc_shm_map(int fd, size_t size)
+{
+	void *p = mmap(NULL, OSC_SHM_DATA + size, PROT_READ | PROT_WRITE,
+	               MAP_SHARED, fd, 0);
+
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+/* Create a ring of at least size bytes, rounded up to a power of two,
+ * in a memfd. Producers in other processes get it by being passed
+ * osc_shm_fd and osc_shm_event_fd, e.g. with SCM_RIGHTS. Records take
+ * 8 bytes in addition to their length. */
+struct osc_shm *osc_shm_new(size_t size)
+{
+	struct osc_shm *rv = osc_mem_calloc(sizeof(*rv), 1);
+
+	if (!rv)
+		return NULL;
+
+	rv->allocator = osc_allocator_current();
+	rv->size = 64;
+	while (rv->size < size)
+		rv->size *= 2;
+
+	rv->fd = memfd_create("osc_shm", MFD_CLOEXEC);
+	rv->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rv->fd < 0 || rv->event_fd < 0
+	    || ftruncate(rv->fd, OSC_SHM_DATA + rv->size)
+	    || !(rv->header = osc_shm_map(rv->fd, rv->size))) {
+		osc_shm_free(rv);
+		return NULL;
+	}
+
+	/* The consumer starts out waiting for the first record */
+	rv->buf = (unsigned char*)rv->header + OSC_SHM_DATA;
+	rv->header->size = rv->size;
+	rv->header->waiting = 1;
+	__atomic_store_n(&rv->header->magic, OSC_SHM_MAGIC, __ATOMIC_RELEASE);
+	return rv;
+}
+
+void osc_shm_free(struct osc_shm *shm)
+{
+	if (!shm)
+		return;
+
+	OSC_ALLOCATOR_SCOPE(shm->allocator);
+
+	if (shm->header)
+		munmap(shm->header, OSC_SHM_DATA + shm->size);
+	if (shm->fd >= 0)
+		close(shm->fd);
+	if (shm->event_fd >= 0)
+		close(shm->event_fd);
+	osc_mem_free(shm);
+}
+
+int osc_shm_fd(struct osc_shm *shm)
+{
+	return shm->fd;
+}
+
+/* An eventfd which becomes readable when records arrived after
+ * osc_shm_prepare_wait */
+int osc_shm_event_fd(struct osc_shm *shm)
+{
+	return shm->event_fd;
+}
+
+static uint32_t *osc_shm_word(unsigned char *buf, size_t size, uint64_t pos)
+{
+	return (uint32_t*)(buf + (pos & (size - 1)));
+}
+
+/* Consumer: the oldest record, or NULL if there is none committed. The
+ * data stays in place until osc_shm_consume. Once a record did not fit
+ * the buffer, the ring is corrupt and NULL is returned with errno set
+ * to EBADMSG. */
+const void *osc_shm_peek(struct osc_shm *shm, size_t *len)
+{
+	if (shm->corrupt) {
+		errno = EBADMSG;
+		return NULL;
+	}
+
+	uint32_t *word = osc_shm_word(shm->buf, shm->size, shm->head);
+	uint32_t h = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+
+	if (h == OSC_SHM_WRAP) {
+		size_t skip = shm->size - (shm->head & (shm->size - 1));
+
+		memset(word, 0, skip);
+		shm->head += skip;
+		__atomic_store_n(&shm->header->head, shm->head, __ATOMIC_RELEASE);
+
+		word = (uint32_t*)shm->buf;
+		h = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+	}
+
+	if (!(h & OSC_SHM_COMMITTED))
+		return NULL;
+
+	size_t left = shm->size - (shm->head & (shm->size - 1));
+	if (OSC_SHM_RECORD(h & ~OSC_SHM_COMMITTED) > left) {
+		shm->corrupt = true;
+		errno = EBADMSG;
+		return NULL;
+	}
+
+	*len = h & ~OSC_SHM_COMMITTED;
+	shm->record = OSC_SHM_RECORD(*len);
+	return (unsigned char*)word + OSC_SHM_HEADER;
+}
+
+/* Consumer: release the record returned by osc_shm_peek */
+void osc_shm_consume(struct osc_shm *shm)
+{
+	uint32_t *word = osc_shm_word(shm->buf, shm->size, shm->head);
+
+	memset(word, 0, shm->record);
+	shm->head += shm->record;
+	__atomic_store_n(&shm->header->head, shm->head, __ATOMIC_RELEASE);
+}
+
+/* Consumer: whether the ring was found corrupt by osc_shm_peek, after
+ * which no more records are read from it */
+bool osc_shm_corrupt(struct osc_shm *shm)
+{
+	return shm->corrupt;
+}
+
+/* Consumer: announce that it is going to wait for osc_shm_event_fd to
+ * become readable. Returns false if records arrived in the meantime
+ * and the ring should be read instead. */
+bool osc_shm_prepare_wait(struct osc_shm *shm)
+{
+	uint64_t count;
+
+	if (read(shm->event_fd, &count, sizeof(count)) < 0) {
+		/* Nothing was pending */
+	}
+
+	__atomic_store_n(&shm->header->waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(osc_shm_word(shm->buf, shm->size, shm->head),
+	                    __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&shm->header->waiting, 0, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	return true;
+}
+
+/* Packets producers could not write because the ring was full */
+uint64_t osc_shm_overflows(struct osc_shm *shm)
+{
+	return __atomic_load_n(&shm->header->overflows, __ATOMIC_RELAXED);
+}
+
+/* Map a ring created by osc_shm_new in another process. The fds are
+ * duplicated and may be closed afterwards. */
+struct osc_shm_writer *osc_shm_writer_new(int fd, int event_fd)
+{
+	struct osc_shm_header header;
+	struct stat st;
+
+	if (fstat(fd, &st) || (size_t)st.st_size < OSC_SHM_DATA
+	    || pread(fd, &header, sizeof(header), 0) != sizeof(header))
+		return NULL;
+
+	size_t size = st.st_size - OSC_SHM_DATA;
+	if (header.magic != OSC_SHM_MAGIC || header.size != size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct osc_shm_writer *rv = osc_mem_calloc(sizeof(*rv), 1);
+	if (!rv)
+		return NULL;
+
+	rv->allocator = osc_allocator_current();
+	rv->size = size;
+	rv->event_fd = fcntl(event_fd, F_DUPFD_CLOEXEC, 0);
+	rv->header = osc_shm_map(fd, size);
+	if (rv->event_fd < 0 || !rv->header) {
+		osc_shm_writer_free(rv);
+		return NULL;
+	}
+
+	rv->buf = (unsigned char*)rv->header + OSC_SHM_DATA;
+	return rv;
+}
+
+void osc_shm_writer_free(struct osc_shm_writer *writer)
+{
+	if (!writer)
+		return;
+
+	OSC_ALLOCATOR_SCOPE(writer->allocator);
+
+	if (writer->header)
+		munmap(writer->header, OSC_SHM_DATA + writer->size);
+	if (writer->event_fd >= 0)
+		close(writer->event_fd);
+	osc_mem_free(writer);
+}
+
+/* Copy a packet into the ring and wake the consumer if it waits. Fails
+ * with ENOBUFS if the ring is full. Safe to call from several threads
+ * and processes at once. */
+int osc_shm_writer_send(struct osc_shm_writer *writer, const void *data,
+                        size_t len)
+{
+	struct osc_shm_header *h = writer->header;
+	size_t need = OSC_SHM_RECORD(len);
+	uint64_t tail, pos, skip;
+
+	if (len >= OSC_SHM_COMMITTED || need > writer->size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	tail = __atomic_load_n(&h->tail, __ATOMIC_RELAXED);
+	do {
+		uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+
+		pos = tail & (writer->size - 1);
+		skip = (writer->size - pos < need) ? writer->size - pos : 0;
+		if (writer->size - (tail - head) < skip + need) {
+			__atomic_fetch_add(&h->overflows, 1, __ATOMIC_RELAXED);
+			errno = ENOBUFS;
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&h->tail, &tail, tail + skip + need,
+	                                      true, __ATOMIC_ACQ_REL,
+	                                      __ATOMIC_RELAXED));
+
+	if (skip) {
+		__atomic_store_n(osc_shm_word(writer->buf, writer->size, tail),
+		                 OSC_SHM_WRAP, __ATOMIC_RELEASE);
+		pos = 0;
+	}
+
+	memcpy(writer->buf + pos + OSC_SHM_HEADER, data, len);
+	__atomic_store_n((uint32_t*)(writer->buf + pos),
+	                 (uint32_t)len | OSC_SHM_COMMITTED, __ATOMIC_RELEASE);
+
+	if (__atomic_exchange_n(&h->waiting, 0, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+
+		if (write(writer->event_fd, &one, sizeof(one)) < 0) {
+			/* The counter is already set */
+		}
+	}
+
+	return 0;
+}
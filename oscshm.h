@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef OSCSHM_H
+#define OSCSHM_H
+
+struct osc_shm;
+struct osc_shm_writer;
+
+struct osc_shm *osc_shm_new(size_t size);
+void osc_shm_free(struct osc_shm *shm);
+int osc_shm_fd(struct osc_shm *shm);
+int osc_shm_event_fd(struct osc_shm *shm);
+
+const void *osc_shm_peek(struct osc_shm *shm, size_t *len);
+void osc_shm_consume(struct osc_shm *shm);
+bool osc_shm_corrupt(struct osc_shm *shm);
+bool osc_shm_prepare_wait(struct osc_shm *shm);
+uint64_t osc_shm_overflows(struct osc_shm *shm);
+
+struct osc_shm_writer *osc_shm_writer_new(int fd, int event_fd);
+void osc_shm_writer_free(struct osc_shm_writer *writer);
+int osc_shm_writer_send(struct osc_shm_writer *writer, const void *data,
+                        size_t len);
+
+#endif
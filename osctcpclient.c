@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "osctcpclient.h"
+#include "oscalloc.h"
+#include "oscutils.h"
+
+#define OSC_TCP_IOV_MAX 64
+#define OSC_TCP_WATERMARK (1024 * 1024)
+#define OSC_TCP_RETRY_MIN_NS 100000000ULL
+#define OSC_TCP_RETRY_MAX_NS 5000000000ULL
+
+struct osc_tcp_frame {
+	struct osc_tcp_frame *next;
+	size_t len;
+	unsigned char data[];
+};
+
+struct osc_tcp_client {
+	int fd;
+	bool connecting;
+	enum osc_framing framing;
+	struct addrinfo *addrs;
+
+	/* Frames not yet completely written, the first one up to offset.
+	 * If the connection breaks, the first frame is sent again from its
+	 * start over the new connection. */
+	struct osc_tcp_frame *queue;
+	struct osc_tcp_frame **queue_endp;
+	size_t offset;
+	size_t pending;
+	size_t watermark;
+
+	uint64_t retry_at;
+	uint64_t retry_ns;
+
+	const struct osc_allocator *allocator;
+};
+
+static void osc_tcp_client_disconnect(struct osc_tcp_client *client)
+{
+	if (client->fd >= 0)
+		close(client->fd);
+
+	client->fd = -1;
+	client->connecting = false;
+	client->pending += client->offset;
+	client->offset = 0;
+	client->retry_at = osc_time_ns() + client->retry_ns;
+
+	client->retry_ns *= 2;
+	if (client->retry_ns > OSC_TCP_RETRY_MAX_NS)
+		client->retry_ns = OSC_TCP_RETRY_MAX_NS;
+}
+
+static void osc_tcp_client_connect(struct osc_tcp_client *client)
+{
+	for (struct addrinfo *rp = client->addrs; rp; rp = rp->ai_next) {
+		int fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK,
+		                rp->ai_protocol);
+
+		if (fd < 0)
+			continue;
+
+		/* Frames are batched already, so don't delay them further */
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+			client->fd = fd;
+			client->connecting = false;
+			client->retry_ns = OSC_TCP_RETRY_MIN_NS;
+			return;
+		}
+
+		if (errno == EINPROGRESS) {
+			client->fd = fd;
+			client->connecting = true;
+			return;
+		}
+
+		close(fd);
+	}
+
+	osc_tcp_client_disconnect(client);
+}
+
+/* Returns true once a pending connection has been established */
+static bool osc_tcp_client_connected(struct osc_tcp_client *client)
+{
+	if (!client->connecting)
+		return true;
+
+	struct pollfd pfd = {
+		.fd = client->fd,
+		.events = POLLOUT
+	};
+
+	if (poll(&pfd, 1, 0) <= 0)
+		return false;
+
+	int error;
+	socklen_t len = sizeof(error);
+	if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &len) || error) {
+		osc_tcp_client_disconnect(client);
+		return false;
+	}
+
+	client->connecting = false;
+	client->retry_ns = OSC_TCP_RETRY_MIN_NS;
+	return true;
+}
+
+struct osc_tcp_client *osc_tcp_client_new(const char *node, const char *service,
+                                          const struct addrinfo *hints,
+                                          enum osc_framing framing)
+{
+	struct addrinfo ai = {
+		.ai_flags = AI_V4MAPPED | AI_ADDRCONFIG,
+		.ai_family = AF_UNSPEC,
+	};
+
+	if (hints)
+		memcpy(&ai, hints, sizeof(ai));
+
+	ai.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo *res;
+	if (getaddrinfo(node, service, &ai, &res))
+		return NULL;
+
+	struct osc_tcp_client *rv = osc_mem_calloc(sizeof(*rv), 1);
+
+	rv->allocator = osc_allocator_current();
+	rv->fd = -1;
+	rv->framing = framing;
+	rv->addrs = res;
+	rv->queue_endp = &rv->queue;
+	rv->watermark = OSC_TCP_WATERMARK;
+	rv->retry_ns = OSC_TCP_RETRY_MIN_NS;
+
+	osc_tcp_client_connect(rv);
+	return rv;
+}
+
+void osc_tcp_client_free(struct osc_tcp_client *client)
+{
+	if (!client)
+		return;
+
+	OSC_ALLOCATOR_SCOPE(client->allocator);
+
+	while (client->queue) {
+		struct osc_tcp_frame *f = client->queue;
+		client->queue = f->next;
+		osc_mem_free(f);
+	}
+
+	if (client->fd >= 0)
+		close(client->fd);
+	freeaddrinfo(client->addrs);
+	osc_mem_free(client);
+}
+
+/* Limit the amount of queued data, beyond which sending fails with
+ * EAGAIN until the queue has been flushed. */
+void osc_tcp_client_set_watermark(struct osc_tcp_client *client, size_t bytes)
+{
+	client->watermark = bytes;
+}
+
+/* Queue a packet. Queued packets are written by osc_tcp_client_flush,
+ * as many at once as possible. */
+int osc_tcp_client_send(struct osc_tcp_client *client, const void *data,
+                        size_t len)
+{
+	OSC_ALLOCATOR_SCOPE(client->allocator);
+
+	size_t size = osc_frame_size(client->framing, data, len);
+
+	if (client->pending && client->pending + size > client->watermark) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	struct osc_tcp_frame *f = osc_mem_alloc(sizeof(*f) + size);
+	if (!f)
+		return -1;
+
+	f->next = NULL;
+	f->len = size;
+	osc_frame_encode(client->framing, data, len, f->data);
+
+	*client->queue_endp = f;
+	client->queue_endp = &f->next;
+	client->pending += size;
+	return 0;
+}
+
+static void osc_tcp_client_consume(struct osc_tcp_client *client, size_t bytes)
+{
+	OSC_ALLOCATOR_SCOPE(client->allocator);
+
+	client->pending -= bytes;
+
+	while (bytes) {
+		struct osc_tcp_frame *f = client->queue;
+		size_t left = f->len - client->offset;
+
+		if (bytes < left) {
+			client->offset += bytes;
+			return;
+		}
+
+		bytes -= left;
+		client->offset = 0;
+		client->queue = f->next;
+		if (!client->queue)
+			client->queue_endp = &client->queue;
+		osc_mem_free(f);
+	}
+}
+
+/* Write out queued frames, (re)connecting if necessary. Returns 0 if
+ * the queue is empty and 1 if data is still pending. When
+ * pending, wait for the fd to become writable or for
+ * osc_tcp_client_timeout to elapse before flushing again. */
+int osc_tcp_client_flush(struct osc_tcp_client *client)
+{
+	if (!client->queue)
+		return 0;
+
+	if (client->fd < 0) {
+		if (osc_time_ns() < client->retry_at)
+			return 1;
+		osc_tcp_client_connect(client);
+		if (client->fd < 0)
+			return 1;
+	}
+
+	if (!osc_tcp_client_connected(client))
+		return 1;
+
+	while (client->queue) {
+		struct iovec iov[OSC_TCP_IOV_MAX];
+		size_t count = 0;
+
+		for (struct osc_tcp_frame *f = client->queue;
+		     f && count < OSC_TCP_IOV_MAX; f = f->next) {
+			iov[count].iov_base = f->data;
+			iov[count].iov_len = f->len;
+			count++;
+		}
+		iov[0].iov_base = client->queue->data + client->offset;
+		iov[0].iov_len -= client->offset;
+
+		/* sendmsg rather than writev to avoid SIGPIPE */
+		struct msghdr msg = {
+			.msg_iov = iov,
+			.msg_iovlen = count
+		};
+
+		ssize_t bytes = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+				return 1;
+			osc_tcp_client_disconnect(client);
+			return 1;
+		}
+
+		osc_tcp_client_consume(client, bytes);
+	}
+
+	return 0;
+}
+
+/* Microseconds until a reconnect is due, -1 if there is none */
+long osc_tcp_client_timeout(struct osc_tcp_client *client)
+{
+	if (client->fd >= 0 || !client->queue)
+		return -1;
+
+	uint64_t now = osc_time_ns();
+	if (now >= client->retry_at)
+		return 0;
+
+	return (client->retry_at - now + 999) / 1000;
+}
+
+size_t osc_tcp_client_pending(struct osc_tcp_client *client)
+{
+	return client->pending;
+}
+
+/* The socket of the current connection, or -1 while disconnected */
+int osc_tcp_client_fd(struct osc_tcp_client *client)
+{
+	return client->fd;
+}
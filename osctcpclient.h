@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef OSCTCPCLIENT_H
+#define OSCTCPCLIENT_H
+
+#include "oscframing.h"
+
+struct osc_tcp_client;
+
+struct osc_tcp_client *osc_tcp_client_new(const char *node, const char *service,
+                                          const struct addrinfo *hints,
+                                          enum osc_framing framing);
+void osc_tcp_client_free(struct osc_tcp_client *client);
+void osc_tcp_client_set_watermark(struct osc_tcp_client *client, size_t bytes);
+int osc_tcp_client_send(struct osc_tcp_client *client, const void *data,
+                        size_t len);
+int osc_tcp_client_flush(struct osc_tcp_client *client);
+long osc_tcp_client_timeout(struct osc_tcp_client *client);
+size_t osc_tcp_client_pending(struct osc_tcp_client *client);
+int osc_tcp_client_fd(struct osc_tcp_client *client);
+
+#endif
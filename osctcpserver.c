@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "cosc.h"
+#include "oscparser.h"
+#include "osctcpserver.h"
+#include "oscalloc.h"
+#include "oscutils.h"
+
+#define OSC_TCP_SERVER_BUFSIZE 16384
+#define OSC_TCP_SERVER_POOL_MAX 64
+#define OSC_TCP_SERVER_FRAME_MAX (16 * 1024 * 1024)
+#define OSC_TCP_SERVER_EVENTS 64
+
+struct osc_tcp_buffer {
+	struct osc_tcp_buffer *next;
+	size_t size;
+	unsigned char data[];
+};
+
+struct osc_tcp_conn {
+	int fd;
+	struct osc_tcp_conn *next;
+	struct osc_tcp_conn **pprev;
+	struct sockaddr_storage addr;
+
+	/* The start of a frame not yet completely received. Connections
+	 * only hold a buffer while they have one. */
+	struct osc_deframer deframer;
+	struct osc_tcp_buffer *buf;
+	size_t len;
+};
+
+struct osc_tcp_server {
+	int fd;
+	int epfd;
+	bool blocking;
+	enum osc_framing framing;
+	size_t frame_max;
+	struct osc_dispatcher *dispatcher;
+
+	struct osc_tcp_conn *conns;
+	unsigned conn_count;
+
+	/* Unused buffers of OSC_TCP_SERVER_BUFSIZE bytes, to be shared by
+	 * the connections */
+	struct osc_tcp_buffer *pool;
+	unsigned pool_count;
+
+	struct osc_tcp_server_stats stats;
+	const struct osc_allocator *allocator;
+};
+
+static struct osc_tcp_buffer *osc_tcp_buffer_get(struct osc_tcp_server *server)
+{
+	struct osc_tcp_buffer *buf = server->pool;
+
+	if (buf) {
+		server->pool = buf->next;
+		server->pool_count--;
+		return buf;
+	}
+
+	buf = osc_mem_alloc(sizeof(*buf) + OSC_TCP_SERVER_BUFSIZE);
+	if (buf)
+		buf->size = OSC_TCP_SERVER_BUFSIZE;
+	return buf;
+}
+
+static void osc_tcp_buffer_put(struct osc_tcp_server *server,
+                               struct osc_tcp_buffer *buf)
+{
+	if (!buf)
+		return;
+
+	/* Buffers grown for large frames are not kept */
+	if (buf->size != OSC_TCP_SERVER_BUFSIZE
+	    || server->pool_count >= OSC_TCP_SERVER_POOL_MAX) {
+		osc_mem_free(buf);
+		return;
+	}
+
+	buf->next = server->pool;
+	server->pool = buf;
+	server->pool_count++;
+}
+
+static void osc_tcp_conn_close(struct osc_tcp_server *server,
+                               struct osc_tcp_conn *c)
+{
+	close(c->fd);
+	osc_tcp_buffer_put(server, c->buf);
+
+	*c->pprev = c->next;
+	if (c->next)
+		c->next->pprev = c->pprev;
+	server->conn_count--;
+	osc_mem_free(c);
+}
+
+struct osc_tcp_server *osc_tcp_server_new(const char *node, const char *service,
+                                          const struct addrinfo *hints,
+                                          enum osc_framing framing)
+{
+	int fd = osc_socket_bind(node, service, hints, SOCK_STREAM);
+	if (fd < 0)
+		return NULL;
+
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL
+	};
+
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0 || listen(fd, SOMAXCONN)
+	    || osc_socket_set_blocking(fd, false)
+	    || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		if (epfd >= 0)
+			close(epfd);
+		close(fd);
+		return NULL;
+	}
+
+	struct osc_tcp_server *rv = osc_mem_calloc(sizeof(*rv), 1);
+
+	rv->allocator = osc_allocator_current();
+	rv->fd = fd;
+	rv->epfd = epfd;
+	rv->blocking = true;
+	rv->framing = framing;
+	rv->frame_max = OSC_TCP_SERVER_FRAME_MAX;
+	rv->dispatcher = osc_dispatcher_new();
+	return rv;
+}
+
+void osc_tcp_server_free(struct osc_tcp_server *server)
+{
+	if (!server)
+		return;
+
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	while (server->conns)
+		osc_tcp_conn_close(server, server->conns);
+
+	while (server->pool) {
+		struct osc_tcp_buffer *buf = server->pool;
+		server->pool = buf->next;
+		osc_mem_free(buf);
+	}
+
+	close(server->epfd);
+	close(server->fd);
+	osc_dispatcher_free(server->dispatcher);
+	osc_mem_free(server);
+}
+
+void osc_tcp_server_add_method(struct osc_tcp_server *server,
+                               const char *address, osc_method callback,
+                               void *arg)
+{
+	osc_dispatcher_add_method(server->dispatcher, address, callback, arg);
+}
+
+void osc_tcp_server_add_method_info(struct osc_tcp_server *server,
+                                    const char *address,
+                                    osc_method_info callback, void *arg)
+{
+	osc_dispatcher_add_method_info(server->dispatcher, address, callback, arg);
+}
+
+int osc_tcp_server_set_blocking(struct osc_tcp_server *server, bool blocking)
+{
+	server->blocking = blocking;
+	return 0;
+}
+
+/* Close connections sending frames of more than bytes, framing
+ * included, instead of buffering them */
+void osc_tcp_server_set_frame_max(struct osc_tcp_server *server, size_t bytes)
+{
+	server->frame_max = bytes;
+	for (struct osc_tcp_conn *c = server->conns; c; c = c->next)
+		c->deframer.max = bytes;
+}
+
+static void osc_tcp_server_accept(struct osc_tcp_server *server)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+
+	int fd = accept4(server->fd, (struct sockaddr*)&addr, &addrlen,
+	                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	struct osc_tcp_conn *c = osc_mem_calloc(sizeof(*c), 1);
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = c
+	};
+
+	if (!c || epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		osc_mem_free(c);
+		close(fd);
+		return;
+	}
+
+	c->fd = fd;
+	c->addr = addr;
+	osc_deframer_init(&c->deframer, server->framing, server->frame_max);
+
+	c->next = server->conns;
+	if (c->next)
+		c->next->pprev = &c->next;
+	c->pprev = &server->conns;
+	server->conns = c;
+	server->conn_count++;
+	server->stats.connections++;
+}
+
+static void osc_tcp_server_dispatch(struct osc_tcp_server *server,
+                                    struct osc_tcp_conn *c, const void *data,
+                                    size_t len, uint64_t rx_timestamp)
+{
+	server->stats.packets++;
+	server->stats.bytes += len;
+
+	char *log;
+	struct osc_element *e = osc_parse_packet(data, len, &log);
+	if (!e) {
+		server->stats.parse_errors++;
+		fprintf(stderr, "Could not parse packet:<parser>\n%s<endparser>\n", log);
+		osc_mem_free(log);
+		return;
+	}
+
+	osc_mem_free(log);
+
+	struct osc_dispatch_info info = {
+		.src_addr = (struct sockaddr*)&c->addr,
+		.rx_timestamp = rx_timestamp,
+		.dispatch_timestamp = osc_realtime_ns(),
+	};
+	osc_dispatcher_process_info(server->dispatcher, e, &info);
+	osc_free(e);
+}
+
+/* Make room for the rest of an incomplete frame. Returns -1 if it would
+ * exceed the limit. */
+static int osc_tcp_conn_grow(struct osc_tcp_server *server,
+                             struct osc_tcp_conn *c)
+{
+	size_t size = c->buf->size;
+
+	if (c->len >= server->frame_max)
+		return -1;
+
+	if (c->deframer.need > size)
+		size = c->deframer.need;
+	else if (c->len == size)
+		size *= 2;
+	else
+		return 0;
+
+	if (size > server->frame_max)
+		size = server->frame_max;
+
+	struct osc_tcp_buffer *buf = osc_mem_realloc(c->buf, sizeof(*buf) + size);
+	if (!buf)
+		return -1;
+
+	buf->size = size;
+	c->buf = buf;
+	return 0;
+}
+
+/* Receive once from a connection and dispatch the frames completed.
+ * Frames are decoded and dispatched from the receive buffer, only the
+ * start of an incomplete one is moved to its beginning. */
+static void osc_tcp_conn_read(struct osc_tcp_server *server,
+                              struct osc_tcp_conn *c)
+{
+	if (!c->buf) {
+		c->buf = osc_tcp_buffer_get(server);
+		if (!c->buf) {
+			osc_tcp_conn_close(server, c);
+			return;
+		}
+	}
+
+	ssize_t bytes = recv(c->fd, c->buf->data + c->len, c->buf->size - c->len, 0);
+	if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		bytes = 0;
+	else if (bytes <= 0) {
+		osc_tcp_conn_close(server, c);
+		return;
+	}
+
+	uint64_t now = osc_realtime_ns();
+	size_t off = 0;
+
+	c->len += bytes;
+	while (off < c->len) {
+		void *packet;
+		size_t len;
+		ssize_t rv = osc_deframer_next(&c->deframer, c->buf->data + off,
+		                               c->len - off, &packet, &len);
+
+		if (rv < 0) {
+			server->stats.framing_errors++;
+			osc_tcp_conn_close(server, c);
+			return;
+		}
+		if (!rv)
+			break;
+
+		osc_tcp_server_dispatch(server, c, packet, len, now);
+		off += rv;
+	}
+
+	c->len -= off;
+	if (!c->len) {
+		osc_tcp_buffer_put(server, c->buf);
+		c->buf = NULL;
+		return;
+	}
+
+	if (off)
+		memmove(c->buf->data, c->buf->data + off, c->len);
+
+	if (osc_tcp_conn_grow(server, c)) {
+		server->stats.framing_errors++;
+		osc_tcp_conn_close(server, c);
+	}
+}
+
+/* Accept connections and dispatch what they send. In non-blocking
+ * mode, returns once nothing is left to receive. */
+int osc_tcp_server_run(struct osc_tcp_server *server)
+{
+	OSC_ALLOCATOR_SCOPE(server->allocator);
+
+	struct epoll_event events[OSC_TCP_SERVER_EVENTS];
+
+	while (1) {
+		int count = epoll_wait(server->epfd, events, OSC_TCP_SERVER_EVENTS,
+		                       server->blocking ? -1 : 0);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+
+		if (!count)
+			return 0;
+
+		/* Connections are level triggered and read once per round,
+		 * so one sending a lot does not hold up the others */
+		for (int i = 0; i < count; i++) {
+			struct osc_tcp_conn *c = events[i].data.ptr;
+
+			if (c)
+				osc_tcp_conn_read(server, c);
+			else
+				osc_tcp_server_accept(server);
+		}
+	}
+}
+
+unsigned osc_tcp_server_connections(struct osc_tcp_server *server)
+{
+	return server->conn_count;
+}
+
+void osc_tcp_server_get_stats(struct osc_tcp_server *server,
+                              struct osc_tcp_server_stats *stats)
+{
+	*stats = server->stats;
+}
+
+/* An epoll fd which becomes readable when there is work for
+ * osc_tcp_server_run */
+int osc_tcp_server_fd(struct osc_tcp_server *server)
+{
+	return server->epfd;
+}
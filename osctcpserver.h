@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef OSCTCPSERVER_H
+#define OSCTCPSERVER_H
+
+#include "oscdispatcher.h"
+#include "oscframing.h"
+
+struct osc_tcp_server;
+
+struct osc_tcp_server_stats {
+	uint64_t connections;
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t parse_errors;
+
+	/* Connections closed because of malformed or oversized frames */
+	uint64_t framing_errors;
+};
+
+struct osc_tcp_server *osc_tcp_server_new(const char *node, const char *service,
+                                          const struct addrinfo *hints,
+                                          enum osc_framing framing);
+void osc_tcp_server_free(struct osc_tcp_server *server);
+void osc_tcp_server_add_method(struct osc_tcp_server *server,
+                               const char *address, osc_method callback,
+                               void *arg);
+void osc_tcp_server_add_method_info(struct osc_tcp_server *server,
+                                    const char *address,
+                                    osc_method_info callback, void *arg);
+int osc_tcp_server_set_blocking(struct osc_tcp_server *server, bool blocking);
+void osc_tcp_server_set_frame_max(struct osc_tcp_server *server, size_t bytes);
+int osc_tcp_server_run(struct osc_tcp_server *server);
+unsigned osc_tcp_server_connections(struct osc_tcp_server *server);
+void osc_tcp_server_get_stats(struct osc_tcp_server *server,
+                              struct osc_tcp_server_stats *stats);
+int osc_tcp_server_fd(struct osc_tcp_server *server);
+
+#endif
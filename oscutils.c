@@ -21,6 +21,7 @@
  */
 #include "cosc.h"
 #include "oscutils.h"
+#include "oscalloc.h"
 
 char **osc_addr_split(const char *address, size_t *count)
 {
@@ -31,7 +32,11 @@ char **osc_addr_split(const char *address, size_t *count)
 			(*count)++;
 	}
 
-	char **rv = calloc((*count) + 2, sizeof(*rv));
+	char **rv = osc_mem_calloc((*count) + 2, sizeof(*rv));
+	if (!rv) {
+		*count = 0;
+		return NULL;
+	}
 
 	const char *start = address + 1;
 	const char *i = start;
@@ -43,7 +48,13 @@ char **osc_addr_split(const char *address, size_t *count)
 			continue;
 		}
 
-		rv[*count] = malloc(i - start + 1);
+		rv[*count] = osc_mem_alloc(i - start + 1);
+		if (!rv[*count]) {
+			while (*count)
+				osc_mem_free(rv[--(*count)]);
+			osc_mem_free(rv);
+			return NULL;
+		}
 		memcpy(rv[*count], start, i-start);
 		rv[*count][i-start] = '\0';
 		(*count)++;
@@ -151,32 +162,33 @@ top:
 		if (!end)
 			return false; /* Pattern is broken if there is no closing brace */
 
-		char *commalist = malloc(end - pattern);
-		memcpy(commalist, pattern+1, end - pattern - 1);
-		commalist[end - pattern - 1] = '\0';
+		const char *word = pattern + 1;
 		pattern = end + 1;
 
-		char *saveptr;
-		for (char *input = commalist; ; input = NULL) {
-			char *word = strtok_r(input, ",", &saveptr);
-			if (!word)
-				break;
+		while (word < end) {
+			const char *comma = memchr(word, ',', end - word);
+			if (!comma)
+				comma = end;
 
-			/* If the word does not match, continue */
-			if (strncmp(word, token, strlen(word)))
+			size_t word_len = comma - word;
+			const char *next = comma + 1;
+
+			/* If the word is empty or does not match, continue */
+			if (!word_len || strncmp(word, token, word_len)) {
+				word = next;
 				continue;
+			}
 
-			if (osc_pattern_match(pattern, token + strlen(word))) {
+			if (osc_pattern_match(pattern, token + word_len)) {
 				/* The rest matches, so we have a match */
-				free(commalist);
 				return true;
 			}
 			/* The word matches, but the rest did not, continue
 			 * testing other words. (They might share the same prefix)
 			 */
+			word = next;
 		}
 
-		free(commalist);
 		return false; /* None of the words matches */
 	}
 
@@ -187,3 +199,125 @@ top:
 	token++;
 	goto top;
 }
+
+/* Monotonic timestamp used for deadlines and rate control */
+uint64_t osc_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Wall clock time, as used for receive timestamps */
+uint64_t osc_realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int osc_socket_set_blocking(int fd, bool blocking)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0)
+		return -1;
+
+	if (blocking)
+		flags &= ~(O_NONBLOCK);
+	else
+		flags |= O_NONBLOCK;
+
+	if (fcntl(fd, F_SETFL, flags) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Create a socket bound to the first usable address of node/service */
+int osc_socket_bind(const char *node, const char *service,
+                    const struct addrinfo *hints, int socktype)
+{
+	struct addrinfo ai = {
+		.ai_flags = AI_V4MAPPED | AI_ADDRCONFIG,
+		.ai_family = AF_UNSPEC,
+	};
+
+	if (hints)
+		memcpy(&ai, hints, sizeof(ai));
+
+	ai.ai_flags |= AI_PASSIVE;
+	ai.ai_socktype = socktype;
+
+	struct addrinfo *res, *rp;
+	if (getaddrinfo(node, service, &ai, &res))
+		return -1;
+
+	int fd;
+	for (rp = res; rp; rp = rp->ai_next) {
+		fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+
+		if (fd < 0)
+			continue;
+
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if (bind(fd, rp->ai_addr, rp->ai_addrlen) != 0) {
+			close(fd);
+			continue;
+		}
+
+		break;
+	}
+
+	freeaddrinfo(res);
+
+	if (!rp)
+		return -1;
+
+	return fd;
+}
+
+/* Whether the address at the start of a packet of len bytes is in
+ * list, or below an entry of it which ends with a slash */
+bool osc_address_listed(char *const *list, unsigned count,
+                        const char *address, size_t len)
+{
+	for (unsigned i = 0; i < count; i++) {
+		size_t plen = strlen(list[i]);
+
+		if (plen > len || memcmp(address, list[i], plen))
+			continue;
+		if (list[i][plen - 1] == '/' || plen == len || !address[plen])
+			return true;
+	}
+
+	return false;
+}
+
+/* Fill in the address of a Unix domain socket. A path starting with
+ * '@' names a socket in the abstract namespace. Returns the length of
+ * the address, 0 if the path is too long. */
+socklen_t osc_unix_addr(struct sockaddr_un *sun, const char *path)
+{
+	size_t len = strlen(path);
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+
+	if (len >= sizeof(sun->sun_path)) {
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+
+	memcpy(sun->sun_path, path, len);
+	if (path[0] == '@') {
+		sun->sun_path[0] = '\0';
+		return offsetof(struct sockaddr_un, sun_path) + len;
+	}
+
+	return sizeof(*sun);
+}
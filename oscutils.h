@@ -24,5 +24,13 @@
 
 char **osc_addr_split(const char *address, size_t *count);
 bool osc_pattern_match(const char *pattern, const char *token);
+uint64_t osc_time_ns(void);
+uint64_t osc_realtime_ns(void);
+int osc_socket_set_blocking(int fd, bool blocking);
+int osc_socket_bind(const char *node, const char *service,
+                    const struct addrinfo *hints, int socktype);
+bool osc_address_listed(char *const *list, unsigned count,
+                        const char *address, size_t len);
+socklen_t osc_unix_addr(struct sockaddr_un *sun, const char *path);
 
 #endif
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "../cosc.h"
+#include "../oscclient.h"
+#include "../oscparser.h"
+
+static const char message[] = "/foo/bar\0\0\0\0,i\0\0\0\0\0\x2a";
+
+static int count_all(int fd)
+{
+	unsigned char buf[8192];
+	int count = 0;
+
+	while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		count++;
+
+	return count;
+}
+
+static void receive_all(int fd)
+{
+	unsigned char buf[8192];
+	ssize_t bytes;
+
+	while ((bytes = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		struct osc_element *e = osc_parse_packet(buf, bytes, NULL);
+		printf("Received %zd bytes:\n%s", bytes, osc_format(e));
+		osc_free(e);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port = htons(4224),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+	};
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr*)&sin, sizeof(sin))) {
+		fprintf(stderr, "Could not bind receiver.\n");
+		return 1;
+	}
+
+	struct osc_client *client = osc_client_new("127.0.0.1", "4224", NULL);
+	if (!client) {
+		fprintf(stderr, "Could not create client.\n");
+		return 1;
+	}
+
+	printf("Sending without bundling\n");
+	osc_client_send(client, message, sizeof(message) - 1);
+	receive_all(fd);
+
+	printf("Sending 5 messages with bundling into 64 bytes\n");
+	osc_client_set_bundling(client, 64, 0);
+	for (int i = 0; i < 5; i++)
+		osc_client_send(client, message, sizeof(message) - 1);
+	printf("Timeout before flush: %ld\n", osc_client_timeout(client));
+	osc_client_flush(client);
+	receive_all(fd);
+
+	printf("Sending with 1000us deadline\n");
+	osc_client_set_bundling(client, 1472, 1000);
+	osc_client_send(client, message, sizeof(message) - 1);
+	osc_client_send(client, message, sizeof(message) - 1);
+	osc_client_run(client);
+	receive_all(fd);
+	usleep(osc_client_timeout(client));
+	osc_client_run(client);
+	receive_all(fd);
+
+	printf("Sending 5 messages paced to 1000/s with burst 2\n");
+	osc_client_set_bundling(client, 0, 0);
+	osc_client_set_pacing(client, 1000, 2);
+	for (int i = 0; i < 5; i++)
+		osc_client_send(client, message, sizeof(message) - 1);
+	printf("Received %d datagrams immediately\n", count_all(fd));
+
+	int received = 0;
+	long timeout;
+	while ((timeout = osc_client_timeout(client)) >= 0) {
+		usleep(timeout);
+		osc_client_run(client);
+		received += count_all(fd);
+	}
+	printf("Received %d datagrams paced\n", received);
+
+	osc_client_free(client);
+	close(fd);
+	printf("Done.\n");
+	return 0;
+}
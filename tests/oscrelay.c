@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "../cosc.h"
+#include "../oscclient.h"
+#include "../oscparser.h"
+#include "../oscrelay.h"
+
+static const char mixer[] = "/mixer/fader1\0\0\0,f\0\0\x3f\x00\x00\x00";
+static const char light[] = "/light/1\0\0\0\0,i\0\0\0\0\0\x01";
+static const char other[] = "/other\0\0";
+
+static int receiver(unsigned short port)
+{
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+	};
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr*)&sin, sizeof(sin)))
+		return -1;
+	return fd;
+}
+
+static void receive_all(const char *name, int fd)
+{
+	unsigned char buf[8192];
+	ssize_t bytes;
+
+	while ((bytes = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		struct osc_element *e = osc_parse_packet(buf, bytes, NULL);
+		printf("%s received %zd bytes:\n%s", name, bytes, osc_format(e));
+		osc_free(e);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET
+	};
+
+	int mixer_fd = receiver(4227);
+	int light_fd = receiver(4228);
+	struct osc_relay *relay = osc_relay_new("127.0.0.1", "4226", &hints);
+	struct osc_client *client = osc_client_new("127.0.0.1", "4226", NULL);
+
+	if (mixer_fd < 0 || light_fd < 0 || !relay || !client) {
+		fprintf(stderr, "Could not set up sockets.\n");
+		return 1;
+	}
+
+	int mixer_dest = osc_relay_add_destination(relay, "127.0.0.1", "4227");
+	int light_dest = osc_relay_add_destination(relay, "127.0.0.1", "4228");
+	osc_relay_add_route(relay, "/mixer", mixer_dest);
+	osc_relay_add_route(relay, "/{light,lamp}/*", light_dest);
+	osc_relay_set_blocking(relay, false);
+
+	printf("Sending messages\n");
+	osc_client_send(client, mixer, sizeof(mixer) - 1);
+	osc_client_send(client, light, sizeof(light) - 1);
+	osc_client_send(client, other, sizeof(other) - 1);
+	usleep(10000);
+	osc_relay_run(relay);
+	usleep(10000);
+	receive_all("mixer", mixer_fd);
+	receive_all("light", light_fd);
+
+	printf("Sending bundle\n");
+	osc_client_set_bundling(client, 1472, 0);
+	osc_client_send(client, mixer, sizeof(mixer) - 1);
+	osc_client_send(client, other, sizeof(other) - 1);
+	osc_client_send(client, light, sizeof(light) - 1);
+	osc_client_send(client, mixer, sizeof(mixer) - 1);
+	osc_client_flush(client);
+	usleep(10000);
+	osc_relay_run(relay);
+	usleep(10000);
+	receive_all("mixer", mixer_fd);
+	receive_all("light", light_fd);
+
+	osc_client_free(client);
+	osc_relay_free(relay);
+	printf("Done.\n");
+	return 0;
+}
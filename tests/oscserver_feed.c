@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "../cosc.h"
+#include "../oscserver.h"
+#include "../oscparser.h"
+#include "../oscutils.h"
+
+static const char message[] = "/foo/bar\0\0\0\0,i\0\0\0\0\0\x2a";
+static const char bundle[] = "#bundle\0\0\0\0\0\0\0\0\x01"
+                             "\0\0\0\x14/foo/bar\0\0\0\0,i\0\0\0\0\0\x2a";
+
+static unsigned calls;
+
+static void callback(void *arg, struct osc_element *arguments)
+{
+	calls++;
+}
+
+int main(int argc, char **argv)
+{
+	struct osc_server_stats stats;
+	struct sockaddr_in src = {
+		.sin_family = AF_INET,
+		.sin_port = htons(4223),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+
+	/* Port 0 binds nothing in particular, the socket stays unused */
+	struct osc_server *server = osc_server_new("127.0.0.1", "0", NULL);
+	if (!server) {
+		fprintf(stderr, "Could not create server.\n");
+		return 1;
+	}
+	osc_server_add_method(server, "/foo/bar", callback, NULL);
+
+	printf("Feeding a message, a bundle and garbage\n");
+	osc_server_feed(server, message, sizeof(message) - 1,
+	                (struct sockaddr*)&src, 0);
+	osc_server_feed(server, bundle, sizeof(bundle) - 1, NULL, 0);
+	osc_server_feed(server, "garbage", 7, NULL, 0);
+	printf("callback called %u times\n", calls);
+
+	struct osc_server_datagram dgs[64];
+	for (int i = 0; i < 64; i++) {
+		dgs[i] = (struct osc_server_datagram) {
+			.data = message,
+			.len = sizeof(message) - 1,
+			.src_addr = (struct sockaddr*)&src,
+			.rx_timestamp = osc_time_ns(),
+		};
+	}
+
+	printf("Feeding 100000 batches of 64 messages\n");
+	calls = 0;
+	uint64_t start = osc_time_ns();
+	for (int i = 0; i < 100000; i++)
+		osc_server_feed_batch(server, dgs, 64);
+	uint64_t elapsed = osc_time_ns() - start;
+	printf("callback called %u times\n", calls);
+	fprintf(stderr, "%.0f messages/s\n", 6400000 / (elapsed / 1e9));
+
+	osc_server_get_stats(server, &stats);
+	printf("packets %" PRIu64 ", bytes %" PRIu64 ", parse errors %" PRIu64 "\n",
+	       stats.packets, stats.bytes, stats.parse_errors);
+	printf("batches %" PRIu64 ", max %" PRIu64 "\n",
+	       stats.batches, stats.max_batch);
+
+	osc_server_free(server);
+	printf("Done.\n");
+	return 0;
+}
@@ -0,0 +1,917 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "../cosc.h"
+#include "../oscalloc.h"
+#include "../oscclient.h"
+#include "../oscdispatcher.h"
+#include "../oscpacket.h"
+#include "../oscparser.h"
+#include "../oscserver.h"
+
+static const char message[] = "/foo/bar\0\0\0\0,i\0\0\0\0\0\x2a";
+
+static unsigned calls;
+static unsigned checks;
+static unsigned failures;
+
+static void check(const char *what, bool ok)
+{
+	printf("%s: %s\n", what, ok ? "yes" : "no");
+	checks++;
+	if (!ok)
+		failures++;
+}
+
+static void check_count(const char *what, uint64_t got, uint64_t want)
+{
+	printf("%s: %" PRIu64 "\n", what, got);
+	checks++;
+	if (got != want) {
+		printf("expected %" PRIu64 "\n", want);
+		failures++;
+	}
+}
+
+static void setup_failed(const char *what)
+{
+	fprintf(stderr, "Could not set up %s: %s\n", what, strerror(errno));
+	checks++;
+	failures++;
+}
+
+static void callback(void *arg, struct osc_element *arguments)
+{
+	__atomic_fetch_add(&calls, 1, __ATOMIC_RELAXED);
+}
+
+static void print_stats(struct osc_server *server)
+{
+	struct osc_server_stats stats;
+
+	osc_server_get_stats(server, &stats);
+	printf("packets %" PRIu64 ", bytes %" PRIu64 ", parse errors %" PRIu64 "\n",
+	       stats.packets, stats.bytes, stats.parse_errors);
+	printf("batches %" PRIu64 ", full %" PRIu64 ", max %" PRIu64 "\n",
+	       stats.batches, stats.full_batches, stats.max_batch);
+}
+
+static void test_batch(struct osc_server *server, struct osc_client *client)
+{
+	printf("Receiving 40 packets in batches of 16\n");
+	osc_server_set_batch_size(server, 16);
+	for (int i = 0; i < 40; i++)
+		osc_client_send(client, message, sizeof(message) - 1);
+	usleep(10000);
+	osc_server_run(server);
+	check_count("callback calls", calls, 40);
+	print_stats(server);
+}
+
+static void test_poll(struct osc_server *server, struct osc_client *client)
+{
+	printf("Polling 40 packets, 16 at a time\n");
+	calls = 0;
+	for (int i = 0; i < 40; i++)
+		osc_client_send(client, message, sizeof(message) - 1);
+	usleep(10000);
+
+	int rv;
+	do {
+		rv = osc_server_poll(server, 16, 0);
+		printf("poll returned %d, callback called %u times\n", rv, calls);
+	} while (rv > 0);
+	check_count("callback calls", calls, 40);
+
+	printf("Polling 40 packets with a time budget\n");
+	calls = 0;
+	for (int i = 0; i < 40; i++)
+		osc_client_send(client, message, sizeof(message) - 1);
+	usleep(10000);
+
+	while (osc_server_poll(server, 0, 1) > 0)
+		;
+	check_count("callback calls", calls, 40);
+}
+
+static void test_drops(struct osc_server *server, struct osc_client *client)
+{
+	struct osc_server_stats stats;
+
+	printf("Overflowing a small receive buffer with 500 packets\n");
+	if (osc_server_set_rcvbuf(server, 4096)
+	    || osc_server_set_drop_counting(server, true)) {
+		setup_failed("drop counting");
+		return;
+	}
+
+	calls = 0;
+	for (int i = 0; i < 500; i++)
+		osc_client_send(client, message, sizeof(message) - 1);
+	usleep(10000);
+	osc_server_run(server);
+
+	/* The drop count comes with the next datagram */
+	osc_client_send(client, message, sizeof(message) - 1);
+	usleep(10000);
+	osc_server_run(server);
+
+	osc_server_get_stats(server, &stats);
+	check("received and dropped all", calls + stats.kernel_drops == 501);
+	osc_server_set_rcvbuf(server, 1024 * 1024);
+}
+
+static void timestamp_callback(void *arg, struct osc_element *arguments,
+                               const struct osc_dispatch_info *info)
+{
+	const struct sockaddr_in *src = (const struct sockaddr_in*)info->src_addr;
+	uint64_t latency = info->dispatch_timestamp - info->rx_timestamp;
+
+	calls++;
+	check("from loopback",
+	      src && src->sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+	check("timestamped before dispatch",
+	      info->rx_timestamp && latency < 1000000000ULL);
+}
+
+static void test_timestamps(struct osc_server *server, struct osc_client *client)
+{
+	static const char stamp[] = "/time/stamp\0,\0\0\0";
+
+	printf("Receiving a packet with a kernel timestamp\n");
+	if (osc_server_set_timestamping(server, OSC_TIMESTAMP_SOFTWARE)) {
+		setup_failed("timestamping");
+		return;
+	}
+
+	osc_server_add_method_info(server, "/time/stamp", timestamp_callback, NULL);
+	calls = 0;
+	osc_client_send(client, stamp, sizeof(stamp) - 1);
+	usleep(10000);
+	osc_server_run(server);
+	check_count("callback calls", calls, 1);
+	osc_server_set_timestamping(server, OSC_TIMESTAMP_NONE);
+}
+
+static void test_io_uring(struct osc_server *server, struct osc_client *client)
+{
+	printf("Receiving 40 packets through io_uring\n");
+	calls = 0;
+	if (osc_server_set_io_uring(server, true)) {
+		/* Falls back to recvmmsg, the result stays the same */
+		fprintf(stderr, "io_uring unavailable: %s\n", strerror(errno));
+	}
+
+	for (int i = 0; i < 40; i++)
+		osc_client_send(client, message, sizeof(message) - 1);
+	usleep(10000);
+	osc_server_run(server);
+
+	osc_server_set_io_uring(server, false);
+	for (int i = 0; i < 40; i++)
+		osc_client_send(client, message, sizeof(message) - 1);
+	usleep(10000);
+	osc_server_run(server);
+	check_count("callback calls", calls, 80);
+}
+
+static void cred_callback(void *arg, struct osc_element *arguments,
+                          const struct osc_dispatch_info *info)
+{
+	calls++;
+	if (!info->cred || info->cred->pid != getpid())
+		check("credentials", false);
+}
+
+static void test_unix(struct osc_server *server)
+{
+	static const char cred[] = "/cred\0\0\0,\0\0\0";
+
+	printf("Receiving 10 packets each over Unix datagram and seqpacket sockets\n");
+	if (osc_server_add_unix_listener(server, "@cosc-test-dgram", SOCK_DGRAM)
+	    || osc_server_add_unix_listener(server, "@cosc-test-seqpacket",
+	                                    SOCK_SEQPACKET)
+	    || osc_server_set_credentials(server, true)) {
+		setup_failed("Unix domain sockets");
+		return;
+	}
+	osc_server_add_method_info(server, "/cred", cred_callback, NULL);
+
+	struct osc_client *dgram = osc_client_new_unix("@cosc-test-dgram",
+	                                               SOCK_DGRAM);
+	struct osc_client *seqpacket = osc_client_new_unix("@cosc-test-seqpacket",
+	                                                   SOCK_SEQPACKET);
+	if (!dgram || !seqpacket) {
+		setup_failed("Unix domain clients");
+		return;
+	}
+
+	calls = 0;
+	for (int i = 0; i < 10; i++) {
+		osc_client_send(dgram, cred, sizeof(cred) - 1);
+		osc_client_send(seqpacket, cred, sizeof(cred) - 1);
+	}
+	usleep(10000);
+	osc_server_run(server);
+	check_count("callback calls", calls, 20);
+
+	printf("Receiving 5 packets over a second connection\n");
+	calls = 0;
+	osc_client_free(seqpacket);
+	seqpacket = osc_client_new_unix("@cosc-test-seqpacket", SOCK_SEQPACKET);
+	for (int i = 0; i < 5; i++)
+		osc_client_send(seqpacket, cred, sizeof(cred) - 1);
+	usleep(10000);
+	osc_server_run(server);
+	check_count("callback calls", calls, 5);
+
+	osc_client_free(seqpacket);
+	osc_client_free(dgram);
+	osc_server_set_credentials(server, false);
+}
+
+static void big_callback(void *arg, struct osc_element *arguments)
+{
+	calls++;
+}
+
+/* A message with a string argument filling it up to len bytes */
+static size_t big_message(char *buf, size_t len)
+{
+	memset(buf, 0, len);
+	memcpy(buf, "/big\0\0\0\0,s\0\0", 12);
+	memset(buf + 12, 'x', len - 16);
+	return len;
+}
+
+/* Send count datagrams of len bytes in one call, segmented by the
+ * kernel unless the receiver takes them coalesced */
+static int send_segmented(const char *buf, size_t len, unsigned count)
+{
+	char *data = malloc(len * count);
+	char control[CMSG_SPACE(sizeof(uint16_t))] = { 0 };
+	struct sockaddr_in dst = {
+		.sin_family = AF_INET,
+		.sin_port = htons(4240),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	struct iovec iov = { data, len * count };
+	struct msghdr msg = {
+		.msg_name = &dst,
+		.msg_namelen = sizeof(dst),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	uint16_t segment = len;
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	int rv = -1;
+
+	for (unsigned i = 0; i < count; i++)
+		memcpy(data + i * len, buf, len);
+
+	c->cmsg_level = SOL_UDP;
+	c->cmsg_type = UDP_SEGMENT;
+	c->cmsg_len = CMSG_LEN(sizeof(segment));
+	memcpy(CMSG_DATA(c), &segment, sizeof(segment));
+
+	if (fd >= 0 && sendmsg(fd, &msg, 0) == (ssize_t)(len * count))
+		rv = 0;
+	if (fd >= 0)
+		close(fd);
+	free(data);
+	return rv;
+}
+
+static void test_large(void)
+{
+	static char buf[12000];
+	struct osc_server_stats stats;
+	uint64_t batches;
+
+	printf("Receiving a datagram of 12000 bytes\n");
+	struct osc_server *server = osc_server_new("127.0.0.1", "4240", NULL);
+	struct osc_client *client = osc_client_new("127.0.0.1", "4240", NULL);
+	if (!server || !client) {
+		setup_failed("sockets");
+		return;
+	}
+
+	osc_server_add_method(server, "/big", big_callback, NULL);
+	osc_server_set_blocking(server, false);
+
+	calls = 0;
+	osc_client_send(client, buf, big_message(buf, sizeof(buf)));
+	usleep(10000);
+	osc_server_run(server);
+	osc_server_get_stats(server, &stats);
+	check("dropped as truncated", !calls && stats.truncated == 1);
+
+	if (osc_server_set_max_datagram(server, 65536)) {
+		setup_failed("large datagrams");
+		goto out;
+	}
+	osc_client_send(client, buf, sizeof(buf));
+	usleep(10000);
+	osc_server_run(server);
+	check_count("callback calls", calls, 1);
+
+	printf("Receiving 10 datagrams coalesced by GRO\n");
+	if (osc_server_set_gro(server, true)) {
+		setup_failed("GRO");
+		goto out;
+	}
+
+	calls = 0;
+	osc_server_get_stats(server, &stats);
+	batches = stats.batches;
+	if (send_segmented(buf, big_message(buf, 1000), 10)) {
+		setup_failed("segmented datagrams");
+		goto out;
+	}
+	usleep(10000);
+	osc_server_run(server);
+	osc_server_get_stats(server, &stats);
+	check_count("callback calls", calls, 10);
+	check("received at once", stats.batches - batches == 1);
+
+out:
+	osc_client_free(client);
+	osc_server_free(server);
+}
+
+static int32_t fader_value;
+
+static void fader_callback(void *arg, struct osc_element *arguments)
+{
+	fader_value = ((struct osc_int32*)arguments)->value;
+}
+
+static void test_workers(struct osc_server *server)
+{
+	struct osc_client *clients[3];
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(0, &cpus);
+
+	printf("Receiving 60 packets from 3 sources with 4 workers\n");
+	calls = 0;
+	if (osc_server_start_workers(server, 4, &cpus, true)) {
+		setup_failed("workers");
+		return;
+	}
+
+	for (int i = 0; i < 3; i++)
+		clients[i] = osc_client_new("127.0.0.1", "4231", NULL);
+	for (int i = 0; i < 60; i++)
+		osc_client_send(clients[i % 3], message, sizeof(message) - 1);
+	usleep(100000);
+
+	check("run refused while workers run",
+	      osc_server_run(server) && errno == EBUSY);
+	check("adding methods refused while workers run",
+	      osc_server_add_method(server, "/late", callback, NULL)
+	      && errno == EBUSY);
+	check("feeding refused while workers run",
+	      osc_server_feed(server, message, sizeof(message) - 1, NULL, 0)
+	      && errno == EBUSY);
+
+	osc_server_stop_workers(server);
+	check_count("callback calls", calls, 60);
+	for (int i = 0; i < 3; i++)
+		osc_client_free(clients[i]);
+}
+
+static void test_listeners(void)
+{
+	const char *targets[][2] = {
+		{ "127.0.0.1", "4232" },
+		{ "::1", "4232" },
+		{ "127.0.0.1", "4233" },
+	};
+
+	printf("Receiving on IPv4 and IPv6 and on two ports\n");
+	struct osc_server *server = osc_server_new(NULL, "4232", NULL);
+	if (!server || osc_server_add_listener(server, NULL, "4233", NULL)) {
+		setup_failed("listeners");
+		return;
+	}
+
+	osc_server_add_method(server, "/foo/bar", callback, NULL);
+	osc_server_set_blocking(server, false);
+
+	/* IPv6 may be unavailable, count only what was sent */
+	unsigned sent = 0;
+	calls = 0;
+	for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+		struct osc_client *c = osc_client_new(targets[i][0], targets[i][1], NULL);
+		if (!c)
+			continue;
+		if (osc_client_send(c, message, sizeof(message) - 1) >= 0)
+			sent++;
+		osc_client_free(c);
+	}
+	usleep(10000);
+
+	osc_server_run(server);
+	check("received all sent", sent >= 2 && calls == sent);
+	osc_server_free(server);
+}
+
+static void test_multicast(void)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET
+	};
+
+	printf("Receiving 10 packets sent to a multicast group on loopback\n");
+	struct osc_server *server = osc_server_new(NULL, "4248", &hints);
+	struct osc_client *client = osc_client_new("239.255.42.1", "4248", NULL);
+	if (!server || !client
+	    || osc_server_join_group(server, "239.255.42.1", "lo")
+	    || osc_client_set_multicast(client, 0, true, "lo")) {
+		setup_failed("multicast");
+		goto out;
+	}
+
+	osc_server_add_method(server, "/foo/bar", callback, NULL);
+	osc_server_set_blocking(server, false);
+
+	calls = 0;
+	for (int i = 0; i < 10; i++)
+		osc_client_send(client, message, sizeof(message) - 1);
+	usleep(10000);
+	osc_server_run(server);
+	check_count("callback calls", calls, 10);
+
+out:
+	osc_client_free(client);
+	osc_server_free(server);
+}
+
+static void test_sockopts(void)
+{
+	printf("Setting options before and on the sockets they apply to\n");
+	struct osc_server *server = osc_server_new("127.0.0.1", "4249", NULL);
+	if (!server) {
+		setup_failed("socket options");
+		return;
+	}
+
+	/* Credentials are only passed on Unix domain sockets */
+	check("option checked without sockets it applies to",
+	      !osc_server_set_credentials(server, true));
+	check("option applied to new sockets",
+	      !osc_server_add_unix_listener(server, "@cosc-test-sockopt",
+	                                    SOCK_DGRAM));
+
+	/* Zero copy is for UDP, not Unix domain sockets */
+	check("option refused", osc_server_set_sockopt(server, SOL_SOCKET,
+	                                               SO_ZEROCOPY, 1));
+	check("option not kept for new sockets",
+	      !osc_server_add_unix_listener(server, "@cosc-test-sockopt2",
+	                                    SOCK_DGRAM));
+	osc_server_free(server);
+}
+
+struct counting_arena {
+	unsigned allocs;
+	unsigned frees;
+};
+
+static void *counting_alloc(void *ctx, size_t size)
+{
+	((struct counting_arena*)ctx)->allocs++;
+	return malloc(size);
+}
+
+static void *counting_realloc(void *ctx, void *ptr, size_t size)
+{
+	struct counting_arena *arena = ctx;
+
+	arena->allocs++;
+	if (ptr)
+		arena->frees++;
+	return realloc(ptr, size);
+}
+
+static void counting_free(void *ctx, void *ptr)
+{
+	if (ptr)
+		((struct counting_arena*)ctx)->frees++;
+	free(ptr);
+}
+
+static void test_allocator(void)
+{
+	struct counting_arena arena = {0};
+	struct osc_allocator counting = {
+		.alloc = counting_alloc,
+		.realloc = counting_realloc,
+		.free = counting_free,
+		.ctx = &arena
+	};
+
+	printf("Receiving 10 packets with a server on its own allocator\n");
+	const struct osc_allocator *prev = osc_use_allocator(&counting);
+	struct osc_server *server = osc_server_new("127.0.0.1", "4243", NULL);
+	osc_use_allocator(prev);
+
+	struct osc_client *client = osc_client_new("127.0.0.1", "4243", NULL);
+	if (!server || !client) {
+		setup_failed("allocator test");
+		return;
+	}
+
+	osc_server_add_method(server, "/foo/bar", callback, NULL);
+	osc_server_set_blocking(server, false);
+
+	calls = 0;
+	for (int i = 0; i < 10; i++)
+		osc_client_send(client, message, sizeof(message) - 1);
+	usleep(10000);
+	osc_server_run(server);
+	osc_server_free(server);
+	osc_client_free(client);
+
+	check_count("callback calls", calls, 10);
+	check("all server memory from its allocator and returned",
+	      arena.allocs > 10 && arena.allocs == arena.frees);
+}
+
+static void test_realtime(void)
+{
+	struct counting_arena arena = {0};
+	struct osc_allocator counting = {
+		.alloc = counting_alloc,
+		.realloc = counting_realloc,
+		.free = counting_free,
+		.ctx = &arena
+	};
+	struct osc_server_stats stats;
+
+	printf("Receiving 20 packets in real-time mode\n");
+	const struct osc_allocator *prev = osc_use_allocator(&counting);
+	struct osc_server *server = osc_server_new("127.0.0.1", "4244", NULL);
+	osc_use_allocator(prev);
+
+	struct osc_client *client = osc_client_new("127.0.0.1", "4244", NULL);
+	if (!server || !client || osc_server_add_conflation(server, "/fader/")) {
+		setup_failed("real-time test");
+		return;
+	}
+
+	if (osc_server_set_realtime(server, 1024 * 1024, 0, 20000)) {
+		setup_failed("real-time mode");
+		osc_client_free(client);
+		osc_server_free(server);
+		return;
+	}
+
+	osc_server_add_method(server, "/foo/bar", callback, NULL);
+	osc_server_add_method(server, "/fader/0", fader_callback, NULL);
+	osc_server_set_blocking(server, false);
+
+	char fader[] = "/fader/0\0\0\0\0,i\0\0\0\0\0\0";
+	unsigned allocs = arena.allocs;
+
+	calls = 0;
+	for (int32_t i = 0; i < 10; i++) {
+		int32_t value = htonl(i);
+
+		memcpy(fader + 16, &value, sizeof(value));
+		osc_client_send(client, fader, sizeof(fader) - 1);
+		osc_client_send(client, message, sizeof(message) - 1);
+	}
+	usleep(10000);
+	osc_server_run(server);
+
+	check_count("callback calls", calls, 10);
+	check_count("latest value", fader_value, 9);
+	check("no allocations outside the pool", arena.allocs == allocs);
+
+	calls = 0;
+	if (osc_server_start_workers(server, 2, NULL, false)) {
+		setup_failed("real-time workers");
+	} else {
+		usleep(50000);
+		allocs = arena.allocs;
+		for (int i = 0; i < 10; i++)
+			osc_client_send(client, message, sizeof(message) - 1);
+		usleep(50000);
+		check_count("worker callback calls", calls, 10);
+		check("no allocations outside the pools", arena.allocs == allocs);
+		osc_server_stop_workers(server);
+	}
+
+	osc_server_get_stats(server, &stats);
+	check("pool used, no failures",
+	      stats.pool_max_used && !stats.pool_failures);
+
+	osc_server_free(server);
+	osc_client_free(client);
+	check("all server memory returned", arena.allocs == arena.frees);
+}
+
+static struct osc_packet *kept[10];
+static unsigned kept_count;
+
+static void keep_callback(void *arg, struct osc_element *arguments,
+                          const struct osc_dispatch_info *info)
+{
+	if (info->packet && kept_count < 10)
+		kept[kept_count++] = osc_packet_ref(info->packet);
+}
+
+/* Reads the kept packets after their dispatch and releases them */
+static void *release_thread(void *arg)
+{
+	unsigned *intact = arg;
+
+	for (unsigned i = 0; i < kept_count; i++) {
+		const struct osc_message *m = (const void*)osc_packet_element(kept[i]);
+		size_t len;
+		const void *data = osc_packet_data(kept[i], &len);
+
+		if (m->type == OSC_MESSAGE && !strcmp(m->address->value, "/keep")
+		    && m->arguments->type == OSC_INT32
+		    && ((struct osc_int32*)m->arguments)->value == (int32_t)i
+		    && len == 16 && !memcmp(data, "/keep", 5))
+			(*intact)++;
+		osc_packet_unref(kept[i]);
+	}
+	return NULL;
+}
+
+static void test_retain(void)
+{
+	char keep[] = "/keep\0\0\0,i\0\0\0\0\0\0";
+	struct osc_packet *first[10];
+	unsigned intact = 0;
+	pthread_t thread;
+
+	printf("Keeping 10 packets past their dispatch\n");
+	struct osc_server *server = osc_server_new("127.0.0.1", "4245", NULL);
+	struct osc_client *client = osc_client_new("127.0.0.1", "4245", NULL);
+	if (!server || !client) {
+		setup_failed("retain test");
+		return;
+	}
+
+	osc_server_add_method_info(server, "/keep", keep_callback, NULL);
+	osc_server_set_blocking(server, false);
+
+	for (int32_t i = 0; i < 10; i++) {
+		int32_t value = htonl(i);
+
+		memcpy(keep + 12, &value, sizeof(value));
+		osc_client_send(client, keep, sizeof(keep) - 1);
+	}
+	usleep(10000);
+	osc_server_run(server);
+
+	check_count("kept packets", kept_count, 10);
+	check("workers refused while packets are kept",
+	      osc_server_start_workers(server, 2, NULL, false) && errno == EBUSY);
+	check("real-time mode refused while packets are kept",
+	      osc_server_set_realtime(server, 65536, 0, 0) && errno == EBUSY);
+	memcpy(first, kept, sizeof(first));
+	pthread_create(&thread, NULL, release_thread, &intact);
+	pthread_join(thread, NULL);
+	check_count("intact when read from another thread", intact, 10);
+
+	kept_count = 0;
+	for (int i = 0; i < 10; i++)
+		osc_client_send(client, keep, sizeof(keep) - 1);
+	usleep(10000);
+	osc_server_run(server);
+
+	bool reused = false;
+	for (unsigned i = 0; i < kept_count; i++) {
+		for (unsigned j = 0; j < 10; j++)
+			reused |= (kept[i] == first[j]);
+		osc_packet_unref(kept[i]);
+	}
+	check("buffers reused after release", reused);
+	check("workers started once all are released",
+	      !osc_server_start_workers(server, 2, NULL, false));
+	osc_server_stop_workers(server);
+
+	osc_client_free(client);
+	osc_server_free(server);
+}
+
+/* Sends 5 packets each to /foo/bar, /foobar and /other/x, returns how
+ * many the server received */
+static uint64_t send_filtered(struct osc_server *server,
+                              struct osc_client *client)
+{
+	static const char foobar[] = "/foobar\0,\0\0\0";
+	static const char other[] = "/other/x\0\0\0\0,\0\0\0";
+	struct osc_server_stats before, after;
+
+	osc_server_get_stats(server, &before);
+	for (int i = 0; i < 5; i++) {
+		osc_client_send(client, message, sizeof(message) - 1);
+		osc_client_send(client, foobar, sizeof(foobar) - 1);
+		osc_client_send(client, other, sizeof(other) - 1);
+	}
+	usleep(10000);
+	osc_server_run(server);
+	osc_server_get_stats(server, &after);
+	return after.packets - before.packets;
+}
+
+static void test_kernel_filter(void)
+{
+	printf("Filtering packets in the kernel by method and source\n");
+	struct osc_server *server = osc_server_new("127.0.0.1", "4246", NULL);
+	struct osc_client *client = osc_client_new("127.0.0.1", "4246", NULL);
+	if (!server || !client) {
+		setup_failed("filter test");
+		return;
+	}
+
+	osc_server_add_method(server, "/foo/bar", callback, NULL);
+	osc_server_set_blocking(server, false);
+
+	check_count("received without filter", send_filtered(server, client), 15);
+	if (osc_server_set_kernel_filter(server, true)) {
+		setup_failed("kernel filter");
+		osc_client_free(client);
+		osc_server_free(server);
+		return;
+	}
+	check_count("received with filter", send_filtered(server, client), 5);
+
+	static const char *patterns[] = {
+		"/*/bar\0\0,\0\0\0", "/fo?/bar\0\0\0\0,\0\0\0",
+		"/{foo,x}/bar\0\0\0\0,\0\0\0", "/f[a-z]o\0\0\0\0,\0\0\0",
+	};
+	static const size_t pattern_lens[] = { 12, 16, 20, 12 };
+	struct osc_server_stats before, after;
+
+	osc_server_get_stats(server, &before);
+	for (int i = 0; i < 4; i++)
+		osc_client_send(client, patterns[i], pattern_lens[i]);
+	usleep(10000);
+	osc_server_run(server);
+	osc_server_get_stats(server, &after);
+	check_count("received with a pattern in the first part",
+	            after.packets - before.packets, 4);
+
+	osc_server_add_method(server, "/other/x", callback, NULL);
+	check_count("received after adding /other/x",
+	            send_filtered(server, client), 10);
+
+	osc_server_allow_source(server, "10.0.0.0", 8);
+	check_count("received from sources not allowed",
+	            send_filtered(server, client), 0);
+
+	osc_server_allow_source(server, "127.0.0.0", 8);
+	check_count("received from allowed sources",
+	            send_filtered(server, client), 10);
+
+	osc_server_set_kernel_filter(server, false);
+	check_count("received without filter again",
+	            send_filtered(server, client), 15);
+
+	osc_client_free(client);
+	osc_server_free(server);
+}
+
+/* Serves a fixed number of allocations, then fails and counts that
+ * like a real-time pool in release builds, which abort debug builds */
+struct bounded_arena {
+	unsigned left;
+	unsigned failures;
+	unsigned allocs;
+	unsigned frees;
+};
+
+static void *bounded_alloc(void *ctx, size_t size)
+{
+	struct bounded_arena *arena = ctx;
+
+	if (!arena->left) {
+		arena->failures++;
+		errno = ENOMEM;
+		return NULL;
+	}
+	arena->left--;
+	arena->allocs++;
+	return malloc(size);
+}
+
+static void *bounded_realloc(void *ctx, void *ptr, size_t size)
+{
+	if (!ptr)
+		return bounded_alloc(ctx, size);
+	return realloc(ptr, size);
+}
+
+static void bounded_free(void *ctx, void *ptr)
+{
+	if (ptr)
+		((struct bounded_arena*)ctx)->frees++;
+	free(ptr);
+}
+
+static void test_exhausted(void)
+{
+	struct osc_dispatcher *d = osc_dispatcher_new();
+	struct osc_string addr = {
+		.type = OSC_STRING,
+		.value = "/foo/bar/baz"
+	};
+	struct osc_message m = {
+		.type = OSC_MESSAGE,
+		.address = &addr
+	};
+
+	printf("Dispatching with an exhausted pool\n");
+	osc_dispatcher_add_method(d, "/foo/bar/baz", callback, NULL);
+
+	/* Splitting the address takes four allocations, each of which
+	 * fails in turn */
+	calls = 0;
+	for (unsigned left = 0; left <= 4; left++) {
+		struct bounded_arena arena = { .left = left };
+		struct osc_allocator bounded = {
+			.alloc = bounded_alloc,
+			.realloc = bounded_realloc,
+			.free = bounded_free,
+			.ctx = &arena
+		};
+
+		OSC_ALLOCATOR_SCOPE(&bounded);
+		osc_dispatcher_process(d, (struct osc_element*)&m);
+		if (left < 4) {
+			check("failure counted", arena.failures == 1);
+			check("partial split freed", arena.allocs == arena.frees);
+		}
+	}
+	check_count("messages delivered", calls, 1);
+	osc_dispatcher_free(d);
+}
+
+int main(int argc, char **argv)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET
+	};
+
+	struct osc_server *server = osc_server_new("127.0.0.1", "4231", &hints);
+	struct osc_client *client = osc_client_new("127.0.0.1", "4231", NULL);
+	if (!server || !client) {
+		fprintf(stderr, "Could not set up sockets.\n");
+		return 1;
+	}
+
+	osc_server_add_method(server, "/foo/bar", callback, NULL);
+	osc_server_set_blocking(server, false);
+
+	test_batch(server, client);
+	test_poll(server, client);
+	test_drops(server, client);
+	test_timestamps(server, client);
+	test_io_uring(server, client);
+	test_unix(server);
+	test_workers(server);
+	print_stats(server);
+	test_listeners();
+	test_multicast();
+	test_sockopts();
+	test_large();
+	test_allocator();
+	test_realtime();
+	test_exhausted();
+	test_retain();
+	test_kernel_filter();
+
+	osc_client_free(client);
+	osc_server_free(server);
+	printf("%u of %u checks failed.\n", failures, checks);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "../cosc.h"
+#include "../oscclient.h"
+#include "../oscparser.h"
+#include "../oscserver.h"
+
+static const char message[] = "/foo/bar\0\0\0\0,i\0\0\0\0\0\x2a";
+
+static unsigned calls;
+static unsigned checks;
+static unsigned failures;
+
+static void check(const char *what, bool ok)
+{
+	printf("%s: %s\n", what, ok ? "yes" : "no");
+	checks++;
+	if (!ok)
+		failures++;
+}
+
+static void check_count(const char *what, uint64_t got, uint64_t want)
+{
+	printf("%s: %" PRIu64 "\n", what, got);
+	checks++;
+	if (got != want) {
+		printf("expected %" PRIu64 "\n", want);
+		failures++;
+	}
+}
+
+static void setup_failed(const char *what)
+{
+	fprintf(stderr, "Could not set up %s: %s\n", what, strerror(errno));
+	checks++;
+	failures++;
+}
+
+static void callback(void *arg, struct osc_element *arguments)
+{
+	calls++;
+}
+
+static void slow_callback(void *arg, struct osc_element *arguments)
+{
+	usleep(1000);
+	calls++;
+}
+
+static void test_pipeline(void)
+{
+	struct osc_server_stats stats;
+
+	printf("Receiving 200 packets for a slow callback with a pipeline\n");
+	struct osc_server *server = osc_server_new("127.0.0.1", "4234", NULL);
+	struct osc_client *client = osc_client_new("127.0.0.1", "4234", NULL);
+	if (!server || !client || osc_server_start_pipeline(server, 65536, -1)) {
+		setup_failed("pipeline");
+		return;
+	}
+
+	osc_server_add_method(server, "/foo/bar", slow_callback, NULL);
+	osc_server_set_blocking(server, false);
+
+	calls = 0;
+	for (int i = 0; i < 200; i++)
+		osc_client_send(client, message, sizeof(message) - 1);
+	osc_client_send(client, "garbage", 7);
+
+	for (int i = 0; i < 100 && calls < 200; i++) {
+		usleep(10000);
+		osc_server_run(server);
+	}
+	check_count("callback calls", calls, 200);
+
+	osc_server_get_stats(server, &stats);
+	check_count("parse errors", stats.parse_errors, 1);
+	printf("ring occupancy %" PRIu64 ", overflows %" PRIu64 "\n",
+	       stats.ring_occupancy, stats.ring_overflows);
+
+	osc_server_stop_pipeline(server);
+	osc_client_free(client);
+	osc_server_free(server);
+}
+
+static unsigned cue_calls;
+
+static void cue_callback(void *arg, struct osc_element *arguments)
+{
+	cue_calls++;
+}
+
+static void run_until_empty(struct osc_server *server)
+{
+	struct osc_server_stats stats;
+
+	do {
+		usleep(10000);
+		osc_server_run(server);
+		osc_server_get_stats(server, &stats);
+	} while (stats.ring_occupancy);
+}
+
+static void test_shedding(void)
+{
+	static const char cue[] = "/cue/go\0,\0\0\0";
+	struct osc_server_stats stats;
+
+	printf("Shedding the oldest of 200 packets down to 10, but no cues\n");
+	struct osc_server *server = osc_server_new("127.0.0.1", "4241", NULL);
+	struct osc_client *client = osc_client_new("127.0.0.1", "4241", NULL);
+	if (!server || !client
+	    || osc_server_set_rcvbuf(server, 4 * 1024 * 1024)
+	    || osc_server_set_shedding(server, OSC_SHED_DROP_OLDEST, 10, 0, 0)
+	    || osc_server_add_never_drop(server, "/cue/")
+	    || osc_server_start_pipeline(server, 1024 * 1024, -1)) {
+		setup_failed("shedding");
+		return;
+	}
+
+	osc_server_add_method(server, "/foo/bar", callback, NULL);
+	osc_server_add_method(server, "/cue/go", cue_callback, NULL);
+	osc_server_set_blocking(server, false);
+
+	calls = 0;
+	for (int i = 0; i < 200; i++) {
+		osc_client_send(client, message, sizeof(message) - 1);
+		if (i % 40 == 0)
+			osc_client_send(client, cue, sizeof(cue) - 1);
+	}
+	usleep(10000);
+	run_until_empty(server);
+	osc_server_get_stats(server, &stats);
+	printf("callback called %u times, shed %" PRIu64 "\n",
+	       calls, stats.shed_oldest);
+	check_count("cues", cue_calls, 5);
+	check("callbacks and shed add up", stats.shed_oldest
+	      && calls + stats.shed_oldest == 200);
+
+	printf("Shedding packets for a slow callback with CoDel\n");
+	osc_server_stop_pipeline(server);
+	osc_server_add_method(server, "/slow", slow_callback, NULL);
+	if (osc_server_set_shedding(server, OSC_SHED_CODEL, 0, 1000000, 10000000)
+	    || osc_server_start_pipeline(server, 1024 * 1024, -1)) {
+		setup_failed("CoDel");
+		osc_client_free(client);
+		osc_server_free(server);
+		return;
+	}
+
+	calls = 0;
+	for (int i = 0; i < 200; i++)
+		osc_client_send(client, "/slow\0\0\0,\0\0\0", 12);
+	run_until_empty(server);
+	osc_server_get_stats(server, &stats);
+	check("shed some", stats.shed_codel && stats.shed_codel < 200
+	      && calls + stats.shed_codel == 200);
+	check("delay percentiles ordered",
+	      stats.queue_delay_p50 <= stats.queue_delay_p99
+	      && stats.queue_delay_p99 <= stats.queue_delay_p999);
+
+	osc_server_stop_pipeline(server);
+	osc_client_free(client);
+	osc_server_free(server);
+}
+
+static unsigned fader_calls;
+static int32_t fader_values[2];
+
+static void fader_callback(void *arg, struct osc_element *arguments)
+{
+	int32_t *value = arg;
+
+	fader_calls++;
+	*value = ((struct osc_int32*)arguments)->value;
+}
+
+static void test_conflation(void)
+{
+	char fader[] = "/fader/0\0\0\0\0,i\0\0\0\0\0\0";
+	struct osc_server_stats stats;
+
+	printf("Conflating 200 values of two faders next to 40 packets\n");
+	struct osc_server *server = osc_server_new("127.0.0.1", "4242", NULL);
+	struct osc_client *client = osc_client_new("127.0.0.1", "4242", NULL);
+	if (!server || !client
+	    || osc_server_set_rcvbuf(server, 4 * 1024 * 1024)
+	    || osc_server_set_batch_size(server, 64)
+	    || osc_server_add_conflation(server, "/fader/")) {
+		setup_failed("conflation");
+		return;
+	}
+
+	osc_server_add_method(server, "/foo/bar", callback, NULL);
+	osc_server_add_method(server, "/fader/0", fader_callback, &fader_values[0]);
+	osc_server_add_method(server, "/fader/1", fader_callback, &fader_values[1]);
+	osc_server_set_blocking(server, false);
+
+	calls = 0;
+	for (int32_t i = 0; i < 100; i++) {
+		int32_t value = htonl(i);
+
+		memcpy(fader + 16, &value, sizeof(value));
+		for (int f = 0; f < 2; f++) {
+			fader[7] = '0' + f;
+			osc_client_send(client, fader, sizeof(fader) - 1);
+		}
+		if (i % 5 == 0) {
+			osc_client_send(client, message, sizeof(message) - 1);
+			osc_client_send(client, message, sizeof(message) - 1);
+		}
+	}
+	usleep(10000);
+	osc_server_run(server);
+
+	osc_server_get_stats(server, &stats);
+	check_count("callback calls", calls, 40);
+	check("latest values", fader_values[0] == 99 && fader_values[1] == 99);
+	check("fader callbacks and conflated add up",
+	      fader_calls < 200 && fader_calls + stats.conflated == 200);
+
+	printf("Conflating 600 addresses queued in a pipeline\n");
+	if (osc_server_start_pipeline(server, 1024 * 1024, -1)) {
+		setup_failed("pipeline");
+		goto out;
+	}
+
+	for (int i = 0; i < 600; i++) {
+		char buf[20] = { 0 };
+
+		/* The address, padded to 12 bytes, is followed by ",i" */
+		snprintf(buf, sizeof(buf), "/fader/%03d", i);
+		memcpy(buf + 12, ",i", 2);
+		osc_client_send(client, buf, sizeof(buf));
+	}
+	for (int i = 0; i < 100; i++) {
+		osc_server_get_stats(server, &stats);
+		if (stats.ring_occupancy == 600)
+			break;
+		usleep(1000);
+	}
+
+	/* Only a bounded number of records leave the ring before the
+	 * conflated ones are dispatched */
+	for (int i = 0; i < 4; i++)
+		osc_server_poll(server, 1, 0);
+	osc_server_get_stats(server, &stats);
+	check("backlog left in the ring", stats.ring_occupancy >= 300);
+	run_until_empty(server);
+	osc_server_stop_pipeline(server);
+
+out:
+	osc_client_free(client);
+	osc_server_free(server);
+}
+
+static unsigned good_calls;
+static unsigned good_flood[10];
+
+/* Notes how many flood packets were dispatched before each one */
+static void good_callback(void *arg, struct osc_element *arguments)
+{
+	if (good_calls < 10)
+		good_flood[good_calls] = calls;
+	good_calls++;
+}
+
+static void test_flood(void)
+{
+	static const char good[] = "/good\0\0\0,\0\0\0";
+	struct osc_server_stats stats;
+
+	printf("Receiving 10 packets next to a flood of 500 with fair queueing\n");
+	struct osc_server *server = osc_server_new("127.0.0.1", "4235", NULL);
+	struct osc_client *flooder = osc_client_new("127.0.0.1", "4235", NULL);
+	struct osc_client *client = osc_client_new("127.0.0.1", "4235", NULL);
+	if (!server || !flooder || !client
+	    || osc_server_set_rcvbuf(server, 4 * 1024 * 1024)
+	    || osc_server_set_fair_queueing(server, 1500, 64)
+	    || osc_server_set_source_rate(server, 100, 20)) {
+		setup_failed("fair queueing");
+		return;
+	}
+
+	osc_server_add_method(server, "/foo/bar", callback, NULL);
+	osc_server_add_method(server, "/good", good_callback, NULL);
+	osc_server_set_blocking(server, false);
+
+	for (int i = 0; i < 500; i++) {
+		osc_client_send(flooder, message, sizeof(message) - 1);
+		if (i % 50 == 0)
+			osc_client_send(client, good, sizeof(good) - 1);
+	}
+	usleep(10000);
+	osc_server_run(server);
+	check_count("good callback calls", good_calls, 10);
+
+	osc_server_get_stats(server, &stats);
+	check("flood limited", stats.source_rate_drops);
+
+	printf("Taking turns with a flood of 500 without a rate limit\n");
+	if (osc_server_set_source_rate(server, 0, 0)
+	    || osc_server_set_fair_queueing(server, 32, 64)) {
+		setup_failed("fair queueing");
+		goto out;
+	}
+
+	calls = 0;
+	good_calls = 0;
+	for (int i = 0; i < 500; i++) {
+		osc_client_send(flooder, message, sizeof(message) - 1);
+		if (i % 50 == 0)
+			osc_client_send(client, good, sizeof(good) - 1);
+	}
+	usleep(10000);
+	osc_server_run(server);
+	check_count("good callback calls", good_calls, 10);
+	check_count("flood callback calls", calls, 500);
+
+	/* Each but the first was sent after 50 more flood packets */
+	bool ahead = good_calls == 10;
+	for (unsigned i = 1; i < 10; i++)
+		ahead &= good_flood[i] + 16 <= 50 * i + 1;
+	check("dispatched ahead of the flood", ahead);
+
+out:
+
+	osc_client_free(client);
+	osc_client_free(flooder);
+	osc_server_free(server);
+}
+
+int main(int argc, char **argv)
+{
+	test_pipeline();
+	test_flood();
+	test_shedding();
+	test_conflation();
+
+	printf("%u of %u checks failed.\n", failures, checks);
+	return failures ? 1 : 0;
+}
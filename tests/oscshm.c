@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <sys/wait.h>
+#include "../cosc.h"
+#include "../oscparser.h"
+#include "../oscserver.h"
+#include "../oscshm.h"
+
+#define PRODUCERS 4
+#define PACKETS 20000
+
+static unsigned calls;
+static unsigned disorder;
+static int32_t last[PRODUCERS];
+
+/* Packets of each producer have to arrive in the order sent */
+static void callback(void *arg, struct osc_element *arguments)
+{
+	struct osc_int32 *producer = (struct osc_int32*)arguments;
+	struct osc_int32 *seq = (struct osc_int32*)arguments->next;
+
+	calls++;
+	if (seq->value != last[producer->value] + 1)
+		disorder++;
+	last[producer->value] = seq->value;
+}
+
+static void produce(struct osc_shm_writer *writer, int32_t producer)
+{
+	unsigned char message[] = "/shm\0\0\0\0,ii\0\0\0\0\0\0\0\0\0";
+	int32_t value = htonl(producer);
+
+	memcpy(message + 12, &value, 4);
+	for (int32_t i = 1; i <= PACKETS; i++) {
+		value = htonl(i);
+		memcpy(message + 16, &value, 4);
+		while (osc_shm_writer_send(writer, message, 20))
+			sched_yield();
+	}
+}
+
+struct producer {
+	pthread_t thread;
+	struct osc_shm_writer *writer;
+	int32_t id;
+};
+
+static void *producer_thread(void *arg)
+{
+	struct producer *p = arg;
+
+	produce(p->writer, p->id);
+	return NULL;
+}
+
+static void run(struct osc_server *server, bool busy_poll)
+{
+	struct producer producers[PRODUCERS - 1];
+	struct osc_shm *shm = osc_shm_new(16384);
+
+	calls = 0;
+	disorder = 0;
+	memset(last, 0, sizeof(last));
+
+	if (!shm || osc_server_add_shm(server, shm, busy_poll)) {
+		perror("Could not set up ring");
+		return;
+	}
+
+	/* One producer in another process, the rest in threads */
+	pid_t pid = fork();
+	if (!pid) {
+		struct osc_shm_writer *writer = osc_shm_writer_new(osc_shm_fd(shm),
+		                                                   osc_shm_event_fd(shm));
+		if (writer)
+			produce(writer, 0);
+		_exit(writer ? 0 : 1);
+	}
+
+	struct osc_shm_writer *writer = osc_shm_writer_new(osc_shm_fd(shm),
+	                                                   osc_shm_event_fd(shm));
+	for (int i = 0; i < PRODUCERS - 1; i++) {
+		producers[i].writer = writer;
+		producers[i].id = i + 1;
+		pthread_create(&producers[i].thread, NULL, producer_thread,
+		               &producers[i]);
+	}
+
+	while (calls < PRODUCERS * PACKETS) {
+		if (busy_poll) {
+			osc_server_poll(server, 0, 0);
+			continue;
+		}
+
+		struct pollfd pfd = {
+			.fd = osc_server_fd(server),
+			.events = POLLIN
+		};
+		if (poll(&pfd, 1, 1000) <= 0)
+			break;
+		osc_server_run(server);
+	}
+
+	for (int i = 0; i < PRODUCERS - 1; i++)
+		pthread_join(producers[i].thread, NULL);
+	waitpid(pid, NULL, 0);
+
+	printf("received all in order: %s\n",
+	       calls == PRODUCERS * PACKETS && !disorder ? "yes" : "no");
+
+	osc_server_remove_shm(server, shm);
+	osc_shm_writer_free(writer);
+	osc_shm_free(shm);
+}
+
+/* A producer claiming a record longer than the ring gets the ring
+ * removed, without anything being read or cleared past its end */
+static int run_corrupt(struct osc_server *server)
+{
+	static const char message[] = "/shm\0\0\0\0,ii\0\0\0\0\0\0\0\0\0";
+	struct osc_server_stats before, after;
+	struct osc_shm *shm = osc_shm_new(4096);
+	struct osc_shm_writer *writer = shm ? osc_shm_writer_new(osc_shm_fd(shm),
+	                                      osc_shm_event_fd(shm)) : NULL;
+
+	if (!writer || osc_server_add_shm(server, shm, false)) {
+		perror("Could not set up ring");
+		return 1;
+	}
+
+	/* The first record starts the ring, after a page of header */
+	uint32_t *word = mmap(NULL, 8192, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                      osc_shm_fd(shm), 0);
+	if (word == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	calls = 0;
+	osc_server_get_stats(server, &before);
+	osc_shm_writer_send(writer, message, 20);
+	/* Committed, with a length of almost 2 GiB */
+	__atomic_store_n(&word[1024], 0x80000000U | 0x7ffffff0U, __ATOMIC_RELEASE);
+	osc_server_run(server);
+	osc_server_get_stats(server, &after);
+
+	bool ok = !calls && after.shm_corrupt == before.shm_corrupt + 1
+	          && osc_shm_corrupt(shm)
+	          && osc_server_remove_shm(server, shm) && errno == ENOENT;
+	printf("ring removed as corrupt: %s\n", ok ? "yes" : "no");
+
+	munmap(word, 8192);
+	osc_shm_writer_free(writer);
+	osc_shm_free(shm);
+	return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct osc_server *server = osc_server_new("127.0.0.1", "4239", NULL);
+	if (!server) {
+		fprintf(stderr, "Could not set up server.\n");
+		return 1;
+	}
+
+	osc_server_add_method(server, "/shm", callback, NULL);
+	osc_server_set_blocking(server, false);
+	osc_server_set_batch_size(server, 64);
+
+	printf("Receiving from 4 producers through a shared memory ring\n");
+	run(server, false);
+	printf("Receiving from 4 producers with busy polling\n");
+	run(server, true);
+	printf("Receiving a record longer than the ring\n");
+	int rv = run_corrupt(server);
+
+	osc_server_free(server);
+	printf("Done.\n");
+	return rv;
+}
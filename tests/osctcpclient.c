@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "../cosc.h"
+#include "../osctcpclient.h"
+
+static const char message[] = "/foo/bar\0\0\0\0,i\0\0\0\0\xc0\xdb";
+
+static int listener(unsigned short port)
+{
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+	};
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (fd < 0 || bind(fd, (struct sockaddr*)&sin, sizeof(sin)) || listen(fd, 1))
+		return -1;
+	return fd;
+}
+
+static void flush_all(struct osc_tcp_client *client)
+{
+	while (osc_tcp_client_flush(client)) {
+		long timeout = osc_tcp_client_timeout(client);
+		usleep(timeout > 0 ? timeout : 1000);
+	}
+}
+
+static void receive_all(int fd)
+{
+	unsigned char buf[1024];
+	ssize_t bytes;
+
+	usleep(10000);
+	while ((bytes = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		printf("Received %zd bytes:", bytes);
+		for (ssize_t i = 0; i < bytes; i++)
+			printf(" %02x", buf[i]);
+		printf("\n");
+	}
+}
+
+static void run(enum osc_framing framing, unsigned short port)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET
+	};
+	char service[16];
+
+	snprintf(service, sizeof(service), "%hu", port);
+
+	printf("Connecting before server is listening\n");
+	struct osc_tcp_client *client = osc_tcp_client_new("127.0.0.1", service,
+	                                                   &hints, framing);
+	osc_tcp_client_send(client, message, sizeof(message) - 1);
+	osc_tcp_client_send(client, message, sizeof(message) - 1);
+	printf("Flush: %d, pending %zu\n", osc_tcp_client_flush(client),
+	       osc_tcp_client_pending(client));
+
+	int lfd = listener(port);
+	flush_all(client);
+	printf("Pending after reconnect: %zu\n", osc_tcp_client_pending(client));
+
+	int fd = accept(lfd, NULL, NULL);
+	receive_all(fd);
+
+	osc_tcp_client_set_watermark(client, 1);
+	osc_tcp_client_send(client, message, sizeof(message) - 1);
+	printf("Send over watermark: %d\n",
+	       osc_tcp_client_send(client, message, sizeof(message) - 1));
+	flush_all(client);
+	receive_all(fd);
+
+	osc_tcp_client_free(client);
+	close(fd);
+	close(lfd);
+}
+
+/* Break the connection while a frame is partly written, it is sent
+ * again in full over the next one */
+static int run_partial(unsigned short port)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET
+	};
+	size_t len = 8 * 1024 * 1024;
+	size_t size = len + 4;
+	char service[16];
+	int rv = 0;
+
+	snprintf(service, sizeof(service), "%hu", port);
+
+	printf("Reconnecting after a partial write\n");
+	int lfd = listener(port);
+	struct osc_tcp_client *client = osc_tcp_client_new("127.0.0.1", service,
+	                                                   &hints,
+	                                                   OSC_FRAMING_LENGTH);
+	unsigned char *data = calloc(1, len);
+	int fd = accept(lfd, NULL, NULL);
+	if (lfd < 0 || !client || !data || fd < 0) {
+		fprintf(stderr, "Could not set up partial write.\n");
+		return 1;
+	}
+
+	osc_tcp_client_set_watermark(client, 2 * size);
+	osc_tcp_client_send(client, data, len);
+	osc_tcp_client_flush(client);
+	size_t pending = osc_tcp_client_pending(client);
+	printf("Partly written: %s\n", pending && pending < size ? "yes" : "no");
+
+	/* Unread data makes the close reset the connection */
+	close(fd);
+	usleep(10000);
+	osc_tcp_client_flush(client);
+	pending = osc_tcp_client_pending(client);
+	printf("Pending after the connection broke: %s\n",
+	       pending == size ? "yes" : "no");
+	if (pending != size)
+		rv = 1;
+
+	while (osc_tcp_client_flush(client) && osc_tcp_client_fd(client) < 0) {
+		long timeout = osc_tcp_client_timeout(client);
+		usleep(timeout > 0 ? timeout : 1000);
+	}
+	fd = accept(lfd, NULL, NULL);
+	size_t received = 0;
+	while (fd >= 0) {
+		int more = osc_tcp_client_flush(client);
+		ssize_t bytes = recv(fd, data, len, MSG_DONTWAIT);
+
+		if (bytes > 0)
+			received += bytes;
+		else if (!more)
+			break;
+		else
+			usleep(1000);
+	}
+	printf("Received whole frame again: %s\n", received == size ? "yes" : "no");
+	if (received != size || osc_tcp_client_pending(client))
+		rv = 1;
+
+	osc_tcp_client_free(client);
+	free(data);
+	close(fd);
+	close(lfd);
+	return rv;
+}
+
+int main(int argc, char **argv)
+{
+	printf("Length prefixed framing\n");
+	run(OSC_FRAMING_LENGTH, 4229);
+	printf("SLIP framing\n");
+	run(OSC_FRAMING_SLIP, 4230);
+	int rv = run_partial(4247);
+	printf("Done.\n");
+	return rv;
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2016 Christian Franke <nobody@nowhere.ws>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "../cosc.h"
+#include "../osctcpclient.h"
+#include "../osctcpserver.h"
+
+static const char message[] = "/foo/bar\0\0\0\0,i\0\0\0\0\xc0\xdb";
+
+static unsigned calls;
+static unsigned big_calls;
+
+static void callback(void *arg, struct osc_element *arguments)
+{
+	calls++;
+}
+
+static void big_callback(void *arg, struct osc_element *arguments)
+{
+	big_calls++;
+}
+
+static int connect_to(unsigned short port)
+{
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+	};
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&sin, sizeof(sin))) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void serve(struct osc_tcp_server *server)
+{
+	for (int i = 0; i < 5; i++) {
+		usleep(10000);
+		osc_tcp_server_run(server);
+	}
+}
+
+static void run(enum osc_framing framing, unsigned short port)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET
+	};
+	char service[16];
+
+	snprintf(service, sizeof(service), "%hu", port);
+
+	struct osc_tcp_server *server = osc_tcp_server_new("127.0.0.1", service,
+	                                                   &hints, framing);
+	if (!server) {
+		fprintf(stderr, "Could not set up server.\n");
+		return;
+	}
+	osc_tcp_server_add_method(server, "/foo/bar", callback, NULL);
+	osc_tcp_server_add_method(server, "/big", big_callback, NULL);
+	osc_tcp_server_set_blocking(server, false);
+
+	printf("Receiving 3 packets from a client\n");
+	calls = 0;
+	struct osc_tcp_client *client = osc_tcp_client_new("127.0.0.1", service,
+	                                                   &hints, framing);
+	for (int i = 0; i < 3; i++)
+		osc_tcp_client_send(client, message, sizeof(message) - 1);
+	while (osc_tcp_client_flush(client))
+		usleep(1000);
+	serve(server);
+	printf("callback called %u times\n", calls);
+
+	printf("Receiving 2 packets one byte at a time\n");
+	calls = 0;
+	size_t size = osc_frame_size(framing, message, sizeof(message) - 1);
+	unsigned char *frame = malloc(size);
+	osc_frame_encode(framing, message, sizeof(message) - 1, frame);
+
+	int fd = connect_to(port);
+	for (int i = 0; i < 2; i++) {
+		for (size_t j = 0; j < size; j++) {
+			send(fd, frame + j, 1, 0);
+			usleep(100);
+			osc_tcp_server_run(server);
+		}
+	}
+	serve(server);
+	printf("callback called %u times\n", calls);
+	free(frame);
+
+	printf("Receiving a packet of 100000 bytes\n");
+	size_t big_len = 100000;
+	unsigned char *big = calloc(big_len, 1);
+	memcpy(big, "/big\0\0\0\0,s\0\0", 12);
+	memset(big + 12, 0xc0, big_len - 16);
+
+	osc_tcp_client_send(client, big, big_len);
+	while (osc_tcp_client_flush(client)) {
+		usleep(1000);
+		osc_tcp_server_run(server);
+	}
+	serve(server);
+	printf("big callback called %u times\n", big_calls);
+	free(big);
+
+	printf("Closing a connection sending an oversized frame\n");
+	osc_tcp_server_set_frame_max(server, 1024);
+	unsigned char huge[2048];
+	memset(huge, 0x01, sizeof(huge));
+	send(fd, huge, sizeof(huge), 0);
+	serve(server);
+	printf("connections left: %u\n", osc_tcp_server_connections(server));
+
+	struct osc_tcp_server_stats stats;
+	osc_tcp_server_get_stats(server, &stats);
+	printf("connections %" PRIu64 ", packets %" PRIu64 ", framing errors %" PRIu64 "\n",
+	       stats.connections, stats.packets, stats.framing_errors);
+
+	close(fd);
+	osc_tcp_client_free(client);
+	osc_tcp_server_free(server);
+}
+
+static void run_idle(unsigned short port)
+{
+	int fds[1000];
+	char service[16];
+
+	snprintf(service, sizeof(service), "%hu", port);
+
+	printf("Holding 1000 idle connections\n");
+	struct osc_tcp_server *server = osc_tcp_server_new("127.0.0.1", service,
+	                                                   NULL, OSC_FRAMING_LENGTH);
+	if (!server) {
+		fprintf(stderr, "Could not set up server.\n");
+		return;
+	}
+	osc_tcp_server_set_blocking(server, false);
+
+	unsigned count;
+	for (count = 0; count < 1000; count++) {
+		fds[count] = connect_to(port);
+		if (fds[count] < 0)
+			break;
+		if (count % 100 == 99)
+			osc_tcp_server_run(server);
+	}
+	serve(server);
+	printf("all connected: %s\n",
+	       osc_tcp_server_connections(server) == 1000 ? "yes" : "no");
+
+	for (unsigned i = 0; i < count; i++)
+		close(fds[i]);
+	serve(server);
+	printf("connections left: %u\n", osc_tcp_server_connections(server));
+	osc_tcp_server_free(server);
+}
+
+int main(int argc, char **argv)
+{
+	printf("Length prefixed framing\n");
+	run(OSC_FRAMING_LENGTH, 4236);
+	printf("SLIP framing\n");
+	run(OSC_FRAMING_SLIP, 4237);
+	run_idle(4238);
+	printf("Done.\n");
+	return 0;
+}